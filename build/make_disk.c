@@ -1,5 +1,8 @@
 /*
  * build/make_disk.c: Build disk image for filesystem & OS
+ *   The fs_root tree is scanned once into memory, the whole image is laid out in a
+ *   memory buffer, then written with 1 sequential write; or with "-u", only the blocks
+ *   that differ from the existing image are written
  */
 #define _DEFAULT_SOURCE // DT_DIR & DT_REG definitions for dirent->d_type
 #include <stdio.h>
@@ -12,36 +15,108 @@
 
 #include "C/stdint.h"
 #include "fs/fs.h"
+#include "fs/fs_check.h"
 
 const char IMAGE_NAME[] = "../bin/OS.bin";
 
-FILE *IMAGE_PTR = 0;
+// File or directory found in fs_root
+typedef struct file_node {
+    char path[512];
+    char name[60];
+    bool is_dir;
+    uint32_t size_bytes;                // Files only, directory sizes are set when laid out
+    uint32_t leaves;                    // Directories: hashed name index leaf blocks, 0 = linear
+    uint32_t num_children;
+    struct file_node *children;
+} file_node_t;
+
+file_node_t root_node = {0};
+uint8_t *image = 0;             // Whole disk image being built or checked
 uint32_t file_blocks = 0, num_files = 0;
-const uint8_t null_block[FS_BLOCK_SIZE] = {0};
-uint8_t sector_buf[FS_SECTOR_SIZE] = {0};
 superblock_t superblock = {0};
 uint32_t disk_size = 512*2880;  // Default size is 1.44MB
+bool dir_index = false;         // Build hashed name index for directories, "-i" option
+bool update_image = false;      // Only write changed blocks of existing image, "-u" option
 
 // Default starting inode will be after root directory (id=1) & bootloader (id=2)
-uint32_t next_inode_id = 3;     
+uint32_t next_inode_id = 3;
 uint32_t first_block = 0;   // First data block to start writing new file data at
 
 const uint32_t ROOT_INODE_ID = 1;
 const uint32_t BOOTLOADER_INODE_ID = 2;
 
 // =============================================================
-// Return number of bytes to align to next boundary byte value
+// Get a block of the disk image in memory
 // =============================================================
-uint32_t num_padding_bytes(const uint32_t bytes, const uint32_t boundary) {
-    if (bytes % boundary == 0) return 0;
-    return (bytes - (bytes % boundary) + boundary) - bytes;
+uint8_t *image_block(const uint32_t block) {
+    return image + (block * FS_BLOCK_SIZE);
+}
+
+// =============================================================
+// Get # of leaf blocks for a directory's hashed name index: the fewest blocks
+//   where its names fit when split into even ranges of name hashes.
+//   Returns 0 for a plain linear directory
+// =============================================================
+uint64_t dir_index_hash_range(const uint32_t leaves) {
+    return ((1ULL << 32) + leaves - 1) / leaves;
+}
+
+uint32_t dir_index_leaves(const file_node_t *dir) {
+    if (!dir_index) return 0;
+
+    // Hashes of all names, including "." and ".."
+    const uint32_t num_names = dir->num_children + 2;
+    uint32_t *hashes = malloc(num_names * sizeof *hashes);
+    hashes[0] = dir_name_hash(".");
+    hashes[1] = dir_name_hash("..");
+
+    for (uint32_t i = 0; i < dir->num_children; i++)
+        hashes[i+2] = dir_name_hash(dir->children[i].name);
+
+    uint32_t leaves = bytes_to_blocks(num_names * sizeof(dir_entry_t));
+    uint32_t *counts = calloc(DIR_INDEX_MAX_ENTRIES, sizeof *counts);
+
+    for (; leaves <= DIR_INDEX_MAX_ENTRIES; leaves++) {
+        bool fits = true;
+        memset(counts, 0, leaves * sizeof *counts);
+
+        for (uint32_t i = 0; i < num_names && fits; i++)
+            if (++counts[hashes[i] / dir_index_hash_range(leaves)] > DIR_ENTRIES_PER_BLOCK) fits = false;
+
+        if (fits) break;
+    }
+
+    free(counts);
+    free(hashes);
+    return leaves <= DIR_INDEX_MAX_ENTRIES ? leaves : 0;
+}
+
+// =============================================================
+// Add a dir_entry to a directory's data, in its leaf block if indexed
+// =============================================================
+void add_dir_entry(dir_entry_t *dir_data, const uint32_t num_entries, const uint32_t leaves,
+                   const dir_entry_t *dir_entry) {
+    uint32_t first = 0;
+
+    if (leaves) {
+        // Block 0 is the index, leaves follow in order of hash
+        first = (1 + dir_name_hash(dir_entry->name) / dir_index_hash_range(leaves)) * DIR_ENTRIES_PER_BLOCK;
+    }
+
+    for (uint32_t i = first; i < num_entries; i++) {
+        if (dir_data[i].id != 0) continue;
+        dir_data[i] = *dir_entry;
+        return;
+    }
+
+    assert(!"No space for dir_entry");
 }
 
 // ============================
 // Write Boot block
 // ============================
 bool write_boot_block(void) {
-    boot_block_t boot_block = {0}; 
+    boot_block_t *boot_block = (boot_block_t *)image_block(0);
 
     FILE *fp = fopen("../bin/fs_root/sys/bin/bootSect.bin", "rb");
     if (!fp) {
@@ -50,7 +125,7 @@ bool write_boot_block(void) {
     }
 
     // Boot sector
-    assert(fread(boot_block.sector[0], FS_SECTOR_SIZE, 1, fp) == 1);
+    assert(fread(boot_block->sector[0], FS_SECTOR_SIZE, 1, fp) == 1);
 
     fclose(fp);
 
@@ -68,14 +143,11 @@ bool write_boot_block(void) {
         }
 
         // Read next sector until end of file
-        if (fread(boot_block.sector[i], 1, FS_SECTOR_SIZE, fp) < FS_SECTOR_SIZE)
+        if (fread(boot_block->sector[i], 1, FS_SECTOR_SIZE, fp) < FS_SECTOR_SIZE)
             break;
     }
 
     fclose(fp);
-
-    // Write boot block to disk image
-    assert(fwrite(&boot_block, FS_BLOCK_SIZE, 1, IMAGE_PTR) == 1);
     return true;
 }
 
@@ -87,16 +159,26 @@ bool write_superblock(void) {
     superblock.first_inode_bitmap_block = 2;                // block 0 = boot block, block 1 = superblock
     superblock.num_inode_bitmap_blocks  = superblock.num_inodes / (FS_BLOCK_SIZE * 8) + ((superblock.num_inodes % (FS_BLOCK_SIZE * 8) > 0) ? 1: 0);
     superblock.first_data_bitmap_block  = superblock.first_inode_bitmap_block + superblock.num_inode_bitmap_blocks;
-    superblock.num_inode_blocks         = bytes_to_blocks(superblock.num_inodes * sizeof(inode_t));   
+    superblock.num_inode_blocks         = bytes_to_blocks(superblock.num_inodes * sizeof(inode_t));
 
     const uint32_t data_blocks = bytes_to_blocks(disk_size);
 
-    // Total disk blocks - (boot block + superblock + inode bitmap blocks + data bit map blocks + inode blocks)
-    uint32_t num_data_bits = (data_blocks - superblock.first_data_bitmap_block - superblock.num_inode_blocks - 1); 
+    // Metadata journal region, after inode blocks. It's 2 slots used in turn, each holds the most
+    //   blocks 1 fs_sync() writes: every kernel block cache entry dirty, all inode & data bitmap
+    //   blocks, and a descriptor & commit block. Data bitmap blocks are counted as if there was
+    //   no journal, so can be 1 too many
+    const uint32_t max_data_bits = data_blocks - superblock.first_data_bitmap_block - superblock.num_inode_blocks - 1;
+    const uint32_t journal_blocks = 2 * (BLOCK_CACHE_SIZE + superblock.num_inode_bitmap_blocks +
+                                         (max_data_bits + BITS_PER_BLOCK-1) / BITS_PER_BLOCK + 2);
+
+    // Total disk blocks - (boot block + superblock + inode bitmap blocks + data bit map blocks + inode blocks + journal blocks)
+    uint32_t num_data_bits = (data_blocks - superblock.first_data_bitmap_block - superblock.num_inode_blocks - journal_blocks - 1);
 
     superblock.num_data_bitmap_blocks     = num_data_bits / (FS_BLOCK_SIZE * 8) + ((num_data_bits % (FS_BLOCK_SIZE * 8) > 0) ? 1 : 0);
     superblock.first_inode_block          = superblock.first_data_bitmap_block + superblock.num_data_bitmap_blocks;
-    superblock.first_data_block           = superblock.first_inode_block + superblock.num_inode_blocks;
+    superblock.first_journal_block        = superblock.first_inode_block + superblock.num_inode_blocks;
+    superblock.num_journal_blocks         = journal_blocks;             // Left as 0s = empty journal
+    superblock.first_data_block           = superblock.first_journal_block + superblock.num_journal_blocks;
 
     superblock.num_data_blocks            = superblock.first_data_block + file_blocks;    // Only need to add file blocks here
 
@@ -106,7 +188,7 @@ bool write_superblock(void) {
     superblock.root_inode_pointer         = 0;                          // Filled at runtime from kernel, or 3rdstage bootloader
     superblock.inodes_per_block           = FS_BLOCK_SIZE / sizeof(inode_t);
     superblock.direct_extents_per_inode   = 4;                          // Probably will be 4
-    superblock.extents_per_indirect_block = FS_BLOCK_SIZE / sizeof(extent_t); 
+    superblock.extents_per_indirect_block = FS_BLOCK_SIZE / sizeof(extent_t);
     superblock.first_free_inode_bit       = superblock.num_inodes;      // First 0 bit in inode bitmap
 
     // 0-based index of first available disk block in data bitmap
@@ -115,39 +197,34 @@ bool write_superblock(void) {
     superblock.device_number              = 0x1;
     superblock.first_unreserved_inode     = 3;                          // inode 0 = invalid, inode 1 = root dir, inode 2 = bootloader/3rdstage
 
-    assert(fwrite(&superblock, sizeof(superblock_t), 1, IMAGE_PTR) == 1);
+    if (superblock.num_data_blocks > data_blocks) {
+        fprintf(stderr, "Error: Files need %u blocks, disk only has %u!\n", superblock.num_data_blocks, data_blocks);
+        return false;
+    }
 
-    // Pad out to end of block
-    assert(fwrite(&null_block, num_padding_bytes(sizeof(superblock_t), FS_BLOCK_SIZE), 1, IMAGE_PTR) == 1);
+    *(superblock_t *)image_block(1) = superblock;
     return true;
 }
 
 // ============================================================
-// Write Inode bitmap blocks
+// Set the first num_bits bits of a bitmap starting at a disk block
 // ============================================================
-bool write_inode_bitmap_blocks(void) {
-    uint64_t bit_chunk = 0;
-    uint32_t total_blocks = superblock.num_inodes / 32;
-    uint32_t bytes_written = 0;
+void set_bitmap_bits(const uint32_t block, const uint32_t num_bits) {
+    uint32_t *bitmap = (uint32_t *)image_block(block);
 
-    // Set number of bits = number of inodes
-    while (total_blocks > 0) {
-        bit_chunk = 0xFFFFFFFF;  // Set 32 bits at a time
-        total_blocks--;
-        assert(fwrite(&bit_chunk, 4, 1, IMAGE_PTR) == 1);
-        bytes_written += 4;
-    }
+    // Set 32 bits at a time, then last partial amount of < 32 bits
+    for (uint32_t i = 0; i < num_bits / 32; i++) bitmap[i] = 0xFFFFFFFF;
 
-    // Check special case for bits % 32 == 0, or multiple of 32;
-    if ((superblock.num_inodes % 32) > 0) {
-        // Set last partial amount of < 32 bits
-        bit_chunk = (2 << ((superblock.num_inodes % 32) - 1)) - 1;
-        assert(fwrite(&bit_chunk, 4, 1, IMAGE_PTR) == 1);
-        bytes_written += 4;
-    }
+    if ((num_bits % 32) > 0)
+        bitmap[num_bits / 32] = (2 << ((num_bits % 32) - 1)) - 1;
+}
 
-    // Pad out to end of block
-    assert(fwrite(null_block, num_padding_bytes(bytes_written, FS_BLOCK_SIZE), 1, IMAGE_PTR) == 1);
+// ============================================================
+// Write Inode bitmap blocks
+// ============================================================
+bool write_inode_bitmap_blocks(void) {
+    // Set number of bits = number of inodes
+    set_bitmap_bits(superblock.first_inode_bitmap_block, superblock.num_inodes);
     return true;
 }
 
@@ -155,111 +232,96 @@ bool write_inode_bitmap_blocks(void) {
 // Write Data bitmap blocks
 // ============================================================
 bool write_data_bitmap_blocks(void) {
-    uint64_t bit_chunk = 0;
-    uint32_t total_blocks = superblock.num_data_blocks / 32;
-    uint32_t bytes_written = 0;
-
     // Set number of bits = number of data blocks
-    while (total_blocks > 0) {
-        bit_chunk = 0xFFFFFFFF;  // Set 32 bits at a time
-        total_blocks--;
-        assert(fwrite(&bit_chunk, 4, 1, IMAGE_PTR) == 1);
-        bytes_written += 4;
-    }
-
-    // Check special case for bits % 32 == 0, or multiple of 32;
-    if ((superblock.num_data_blocks % 32) > 0) {
-        // Set last partial amount of < 32 bits
-        bit_chunk = (2 << ((superblock.num_data_blocks % 32) - 1)) - 1;
-        assert(fwrite(&bit_chunk, 4, 1, IMAGE_PTR) == 1);
-        bytes_written += 4;
-    }
-
-    // Pad out to end of block
-    assert(fwrite(null_block, num_padding_bytes(bytes_written, FS_BLOCK_SIZE), 1, IMAGE_PTR) == 1);
+    set_bitmap_bits(superblock.first_data_bitmap_block, superblock.num_data_blocks);
     return true;
 }
 
 // ============================================================
-// Get initial values for total # of files in filesystem, and 
-//   total size of those files in blocks
+// Scan a directory and all directories in it into memory, and get
+//   total # of files in filesystem, and total size of those files in blocks
 // ============================================================
-bool get_file_info(char *dir_path) {
-    DIR *dirp = opendir(dir_path);
+bool get_file_info(file_node_t *dir) {
+    DIR *dirp = opendir(dir->path);
     if (!dirp) {
-        fprintf(stderr, "Error: Could not open directory %s\n", dir_path);
-        return EXIT_FAILURE;
+        fprintf(stderr, "Error: Could not open directory %s\n", dir->path);
+        return false;
     }
 
-    uint32_t dir_entries = 2;   // Default/emptry dir is only "." and ".." entries
-
     for (struct dirent *dirent = readdir(dirp); dirent; dirent = readdir(dirp)) {
         if (!strncmp(dirent->d_name, ".", 2) ||
             !strncmp(dirent->d_name, "..", 3)) {
             continue;
         }
 
-        // Set new qualified name for stat() call
-        char temp_name[512] = {0};
-        snprintf(temp_name, sizeof temp_name, "%s/%s", dir_path, dirent->d_name);
+        if (dirent->d_type != DT_DIR && dirent->d_type != DT_REG) continue;
 
-        if (dirent->d_type == DT_DIR) {
-            printf("Found directory %s\n", temp_name);
-        } else if (dirent->d_type == DT_REG) {
-            printf("Found file %s\n", temp_name);
+        if (strlen(dirent->d_name) >= sizeof root_node.name) {
+            fprintf(stderr, "Error: File name %s is too long\n", dirent->d_name);
+            return false;
         }
 
-        num_files++;    // Found new file/directory
-        dir_entries++;  // Add to local count for this directory
+        dir->children = realloc(dir->children, (dir->num_children+1) * sizeof *dir->children);
+        assert(dir->children);
+
+        file_node_t *node = &dir->children[dir->num_children++];
+        *node = (file_node_t){ .is_dir = (dirent->d_type == DT_DIR) };
+        strcpy(node->name, dirent->d_name);
 
-        // Get size from stat struct in blocks, add to total
-        struct stat file_stat;
-        if (stat(temp_name, &file_stat) < 0) {
-            fprintf(stderr, "Error: Could not get stat() for %s\n", temp_name);
+        // Set new qualified name for stat() call
+        if (snprintf(node->path, sizeof node->path, "%s/%s", dir->path, dirent->d_name) >= (int)sizeof node->path) {
+            fprintf(stderr, "Error: Path %s/%s is too long\n", dir->path, dirent->d_name);
             return false;
         }
 
-        if (dirent->d_type == DT_REG) {
-            // Regular file
-            file_blocks += bytes_to_blocks(file_stat.st_size);
+        num_files++;    // Found new file/directory
+
+        if (node->is_dir) {
+            printf("Found directory %s\n", node->path);
+        } else {
+            printf("Found file %s\n", node->path);
 
-        } else if (dirent->d_type == DT_DIR) {
-            // If found directory, read through its files as well
-            if (!get_file_info(temp_name)) return false;
+            // Get size from stat struct in blocks, add to total
+            struct stat file_stat;
+            if (stat(node->path, &file_stat) < 0) {
+                fprintf(stderr, "Error: Could not get stat() for %s\n", node->path);
+                return false;
+            }
+
+            node->size_bytes = file_stat.st_size;
+            file_blocks += bytes_to_blocks(file_stat.st_size);
         }
     }
 
     closedir(dirp);
 
-    // Get size for this directory in blocks
-    file_blocks += bytes_to_blocks(dir_entries * sizeof(dir_entry_t));
+    // If found directories, read through their files as well. Children array is complete now,
+    //   so pointers to its nodes stay valid
+    for (uint32_t i = 0; i < dir->num_children; i++)
+        if (dir->children[i].is_dir && !get_file_info(&dir->children[i])) return false;
+
+    // Get size for this directory in blocks, plus the index block if indexed;
+    //   default/empty dir is only "." and ".." entries
+    dir->leaves = dir_index_leaves(dir);
+    file_blocks += dir->leaves ? dir->leaves + 1 : bytes_to_blocks((dir->num_children + 2) * sizeof(dir_entry_t));
     return true;
 }
 
 // ============================================================
 // Add data (inode and data blocks) for a directory and all files in the directory
 // ============================================================
-bool write_file_data(char *dir_path, uint32_t curr_inode_id, uint32_t parent_inode_id) {
-    DIR *dirp = opendir(dir_path);
-    if (!dirp) {
-        fprintf(stderr, "Error: Could not open directory %s\n", dir_path);
-        return EXIT_FAILURE;
-    }
-
-    // Read through dir once to begin with, to get total # of dir_entries;
-    //    need this value to determine total size in blocks for inode extent length_blocks
-    uint32_t dir_entries = 0; 
-    for (struct dirent *dirent = readdir(dirp); dirent; dirent = readdir(dirp)) 
-        dir_entries++;
-
-    uint32_t dir_size = dir_entries * sizeof(dir_entry_t);
+bool write_file_data(const file_node_t *dir, uint32_t curr_inode_id, uint32_t parent_inode_id) {
+    // Indexed directories are always whole blocks: the index block, then the leaf blocks
+    const uint32_t leaves = dir->leaves;
+    const uint32_t dir_size = leaves ? (leaves + 1) * FS_BLOCK_SIZE : (dir->num_children + 2) * sizeof(dir_entry_t);
 
     // Add dir inode
     inode_t dir_inode = {0};
-    dir_inode.id = curr_inode_id;  
+    dir_inode.id = curr_inode_id;
     dir_inode.type = FILETYPE_DIR;
     dir_inode.size_bytes = dir_size;
     dir_inode.size_sectors = bytes_to_sectors(dir_size);
+    dir_inode.flags = leaves ? INODE_FLAG_HASH_INDEX : 0;
     dir_inode.last_modified_timestamp = (fs_datetime_t){
         .second = 0,
         .minute = 37,
@@ -277,41 +339,40 @@ bool write_file_data(char *dir_path, uint32_t curr_inode_id, uint32_t parent_ino
     first_block += dir_inode.extent[0].length_blocks;
 
     // Write inode to disk image
-    fseek(IMAGE_PTR, 
-          (superblock.first_inode_block + (dir_inode.id / INODES_PER_BLOCK)) * FS_BLOCK_SIZE, 
-          SEEK_SET);
+    ((inode_t *)image_block(superblock.first_inode_block + (dir_inode.id / INODES_PER_BLOCK)))[dir_inode.id % INODES_PER_BLOCK] = dir_inode;
 
-    fseek(IMAGE_PTR, (dir_inode.id % INODES_PER_BLOCK) * sizeof(inode_t), SEEK_CUR);
+    // Directory's data blocks are built in place in the image
+    const uint32_t num_entries = dir_inode.extent[0].length_blocks * DIR_ENTRIES_PER_BLOCK;
+    dir_entry_t *dir_data = (dir_entry_t *)image_block(dir_inode.extent[0].first_block);
 
-    assert(fwrite(&dir_inode, sizeof dir_inode, 1, IMAGE_PTR) == 1);
+    // Add index entries, each leaf holds an even range of name hashes
+    if (leaves) {
+        dir_index_record_t *records = (dir_index_record_t *)dir_data;
+        records[0].count = leaves;
 
-    // Add dir_entry's for "." and ".."
-    fseek(IMAGE_PTR, dir_inode.extent[0].first_block * FS_BLOCK_SIZE, SEEK_SET);
+        for (uint32_t i = 0; i < leaves; i++)
+            DIR_INDEX_ENTRY(records, i) = (dir_index_entry_t){
+                .hash = i * dir_index_hash_range(leaves),
+                .block = i + 1,
+            };
+    }
 
+    // Add dir_entry's for "." and ".."
     dir_entry_t dir_entry = {0};
     dir_entry.id = dir_inode.id;    // "." = current (this) directory
     strcpy(dir_entry.name, ".");
-    assert(fwrite(&dir_entry, sizeof dir_entry, 1, IMAGE_PTR) == 1);
+    add_dir_entry(dir_data, num_entries, leaves, &dir_entry);
 
     dir_entry.id = parent_inode_id; // ".." = parent directory
     strcpy(dir_entry.name, "..");
-    assert(fwrite(&dir_entry, sizeof dir_entry, 1, IMAGE_PTR) == 1);
+    add_dir_entry(dir_data, num_entries, leaves, &dir_entry);
 
-    // Rewind to read through directory again, and add file data for all files in directory
-    rewinddir(dirp);   
-    uint32_t curr_dir_pos = 0;  // Save variable outside local directory loop
-    for (struct dirent *dirent = readdir(dirp); dirent; dirent = readdir(dirp)) {
-        if (!strncmp(dirent->d_name, ".", 2) ||
-            !strncmp(dirent->d_name, "..", 3)) {
-            continue;
-        }
-
-        // Set new qualified name for stat() call
-        char temp_name[512] = {0};
-        snprintf(temp_name, sizeof temp_name, "%s/%s", dir_path, dirent->d_name);
+    // Add file data for all files in directory
+    for (uint32_t i = 0; i < dir->num_children; i++) {
+        const file_node_t *node = &dir->children[i];
 
         // Add dir_entry for this file
-        if (!strncmp(dirent->d_name, "3rdstage.bin", 13)) {
+        if (!strncmp(node->name, "3rdstage.bin", 13)) {
             // If file is 3rdstage.bin, use specific inode 2, so that boot sector
             //   continues to work and booting can be simpler.
             dir_entry.id = BOOTLOADER_INODE_ID;
@@ -319,27 +380,18 @@ bool write_file_data(char *dir_path, uint32_t curr_inode_id, uint32_t parent_ino
             dir_entry.id = next_inode_id++;
         }
 
-        strcpy(dir_entry.name, dirent->d_name);
-        assert(fwrite(&dir_entry, sizeof dir_entry, 1, IMAGE_PTR) == 1);
-
-        // Save current position in dir for next dir_entry
-        curr_dir_pos = ftell(IMAGE_PTR);
+        memset(dir_entry.name, 0, sizeof dir_entry.name);
+        strcpy(dir_entry.name, node->name);
+        add_dir_entry(dir_data, num_entries, leaves, &dir_entry);
 
-        // Get size from stat struct in blocks
-        struct stat file_stat;
-        if (stat(temp_name, &file_stat) < 0) {
-            fprintf(stderr, "Error: Could not get stat() for %s\n", temp_name);
-            return false;
-        }
-
-        if (dirent->d_type == DT_REG) {
+        if (!node->is_dir) {
             // Regular file
-            // Add file inode 
+            // Add file inode
             inode_t file_inode = {0};
-            file_inode.id   = dir_entry.id; 
+            file_inode.id   = dir_entry.id;
             file_inode.type = FILETYPE_FILE;
-            file_inode.size_bytes = file_stat.st_size;
-            file_inode.size_sectors = bytes_to_sectors(file_stat.st_size);
+            file_inode.size_bytes = node->size_bytes;
+            file_inode.size_sectors = bytes_to_sectors(node->size_bytes);
             file_inode.last_modified_timestamp = (fs_datetime_t){
                 .second = 0,
                 .minute = 37,
@@ -350,62 +402,40 @@ bool write_file_data(char *dir_path, uint32_t curr_inode_id, uint32_t parent_ino
             };
             file_inode.extent[0] = (extent_t){
                 .first_block = first_block,
-                .length_blocks = bytes_to_blocks(file_stat.st_size),
+                .length_blocks = bytes_to_blocks(node->size_bytes),
             };
 
             // Set next position to start writing a new file at
             first_block += file_inode.extent[0].length_blocks;
 
             // Add file inode to inode blocks
-            fseek(IMAGE_PTR, 
-                  (superblock.first_inode_block + (file_inode.id / INODES_PER_BLOCK)) * FS_BLOCK_SIZE, 
-                  SEEK_SET);
-
-            fseek(IMAGE_PTR, (file_inode.id % INODES_PER_BLOCK) * sizeof(inode_t), SEEK_CUR);
+            ((inode_t *)image_block(superblock.first_inode_block + (file_inode.id / INODES_PER_BLOCK)))[file_inode.id % INODES_PER_BLOCK] = file_inode;
 
-            assert(fwrite(&file_inode, sizeof file_inode, 1, IMAGE_PTR) == 1);
-
-            // Add file data 
-            fseek(IMAGE_PTR, file_inode.extent[0].first_block * FS_BLOCK_SIZE, SEEK_SET);
-
-            FILE *fp = fopen(temp_name, "rb");
+            // Add file data, rest of its last block is already 0s
+            FILE *fp = fopen(node->path, "rb");
             if (!fp) {
-                fprintf(stderr, "Error: Could not open file %s\n", temp_name);
+                fprintf(stderr, "Error: Could not open file %s\n", node->path);
                 return false;
             }
 
-            uint32_t total_bytes_written = 0;
-            for (uint32_t i = 0; i < file_inode.size_sectors; i++) {
-                uint32_t bytes_read = fread(sector_buf, 1, FS_SECTOR_SIZE, fp);
-                assert(fwrite(sector_buf, 1, bytes_read, IMAGE_PTR) == bytes_read);
-                total_bytes_written += bytes_read;
+            if (fread(image_block(file_inode.extent[0].first_block), 1, node->size_bytes, fp) != node->size_bytes) {
+                fprintf(stderr, "Error: Could not read file %s\n", node->path);
+                fclose(fp);
+                return false;
             }
-            fclose(fp);  
-
-            // Pad out to end of data block for this file
-            assert(fwrite(null_block, 1, num_padding_bytes(total_bytes_written, FS_BLOCK_SIZE), IMAGE_PTR) ==
-                   num_padding_bytes(total_bytes_written, FS_BLOCK_SIZE));
+            fclose(fp);
 
-            printf("Wrote file %s, %llu (%u blocks)\n", 
-                   temp_name, (unsigned long long)file_stat.st_size, bytes_to_blocks(file_stat.st_size));
+            printf("Wrote file %s, %u (%u blocks)\n",
+                   node->path, node->size_bytes, bytes_to_blocks(node->size_bytes));
 
-        } else if (dirent->d_type == DT_DIR) {
-            // If found directory, read through its files as well
-            if (!write_file_data(temp_name, dir_entry.id, dir_inode.id)) return false;
+        } else {
+            // If found directory, add its files as well
+            if (!write_file_data(node, dir_entry.id, dir_inode.id)) return false;
         }
-
-        // Restore current position in dir for next dir_entry
-        fseek(IMAGE_PTR, curr_dir_pos, SEEK_SET);
     }
 
-    closedir(dirp);
-
-    // Pad out to end of data block for this directory
-    assert(fwrite(null_block, 1, num_padding_bytes(dir_size, FS_BLOCK_SIZE), IMAGE_PTR) ==
-           num_padding_bytes(dir_size, FS_BLOCK_SIZE));
-
-    printf("Wrote dir %s, %u (%u dir entries + 2, %u blocks)\n", 
-           dir_path, dir_size, (dir_size / (uint32_t)sizeof(dir_entry_t))-2, bytes_to_blocks(dir_size));
+    printf("Wrote dir %s, %u (%u dir entries + 2, %u blocks%s)\n",
+           dir->path, dir_size, dir->num_children, bytes_to_blocks(dir_size), leaves ? ", indexed" : "");
     return true;
 }
 
@@ -414,40 +444,181 @@ bool write_file_data(char *dir_path, uint32_t curr_inode_id, uint32_t parent_ino
 // ============================================
 bool write_inode_and_data_blocks(void) {
     // 1st available position on disk to start writing new file data
-    first_block = superblock.first_data_block;  
+    first_block = superblock.first_data_block;
 
     // Add all files/directories under root as new initial filesystem
-    if (!write_file_data("../bin/fs_root", ROOT_INODE_ID, ROOT_INODE_ID)) return false;
+    return write_file_data(&root_node, ROOT_INODE_ID, ROOT_INODE_ID);
+}
+
+// ============================================
+// Write whole disk image in 1 sequential write
+// ============================================
+bool write_image(const uint32_t disk_blocks) {
+    FILE *fp = fopen(IMAGE_NAME, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error: Could not create disk image %s\n", IMAGE_NAME);
+        return false;
+    }
+
+    assert(fwrite(image, FS_BLOCK_SIZE, disk_blocks, fp) == disk_blocks);
+    fclose(fp);
+    return true;
+}
 
-    // Pad out disk image to final size
-    uint32_t disk_blocks = bytes_to_blocks(disk_size);
+// ============================================
+// Write only the blocks that differ from the existing disk image, as runs
+//   of changed blocks. A missing or different sized image is written whole
+// ============================================
+bool update_disk_image(const uint32_t disk_blocks) {
+    FILE *fp = fopen(IMAGE_NAME, "r+b");
+    if (!fp) return write_image(disk_blocks);
+
+    fseek(fp, 0, SEEK_END);
+    if (ftell(fp) != (long)disk_blocks * FS_BLOCK_SIZE) {
+        fclose(fp);
+        return write_image(disk_blocks);
+    }
+    rewind(fp);
 
-    fseek(IMAGE_PTR, 0, SEEK_END);
-    uint32_t diff = disk_blocks - bytes_to_blocks(ftell(IMAGE_PTR));
+    uint8_t *old_image = malloc(disk_blocks * FS_BLOCK_SIZE);
+    assert(old_image);
+    assert(fread(old_image, FS_BLOCK_SIZE, disk_blocks, fp) == disk_blocks);
 
-    for (uint32_t i = 0; i < diff; i++)
-      assert(fwrite(null_block, FS_BLOCK_SIZE, 1, IMAGE_PTR) == 1);
+    uint32_t changed = 0;
+    for (uint32_t block = 0; block < disk_blocks; ) {
+        if (!memcmp(old_image + (block * FS_BLOCK_SIZE), image_block(block), FS_BLOCK_SIZE)) {
+            block++;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (block + run < disk_blocks &&
+               memcmp(old_image + ((block + run) * FS_BLOCK_SIZE), image_block(block + run), FS_BLOCK_SIZE))
+            run++;
+
+        fseek(fp, block * FS_BLOCK_SIZE, SEEK_SET);
+        assert(fwrite(image_block(block), FS_BLOCK_SIZE, run, fp) == run);
+
+        changed += run;
+        block += run;
+    }
+
+    fclose(fp);
+    free(old_image);
+
+    printf("Updated %u of %u blocks\n", changed, disk_blocks);
     return true;
 }
 
+// ============================================
+// Print usage & fragmentation stats for an existing disk image,
+//   and check its data bitmap against the blocks files use
+// ============================================
+bool check_disk_image(const char *name) {
+    FILE *fp = fopen(name, "rb");
+    if (!fp) {
+        fprintf(stderr, "Could not open disk image %s\n", name);
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    const uint32_t total_blocks = ftell(fp) / FS_BLOCK_SIZE;
+    rewind(fp);
+
+    image = malloc(total_blocks * FS_BLOCK_SIZE);
+    assert(image);
+    assert(fread(image, FS_BLOCK_SIZE, total_blocks, fp) == total_blocks);
+    fclose(fp);
+
+    // Superblock is block 1
+    const superblock_t *sb = (superblock_t *)image_block(1);
+    if (total_blocks < 2 || sb->block_size_bytes != FS_BLOCK_SIZE ||
+        sb->first_data_block >= total_blocks) {
+        fprintf(stderr, "%s does not have a valid superblock\n", name);
+        return false;
+    }
+
+    fs_check_disk_t disk = {
+        .superblock   = sb,
+        .inode_bitmap = (uint32_t *)image_block(sb->first_inode_bitmap_block),
+        .data_bitmap  = (uint32_t *)image_block(sb->first_data_bitmap_block),
+        .total_blocks = total_blocks,
+        .read_block   = image_block,
+        .seen         = calloc((total_blocks + 31) / 32, sizeof(uint32_t)),
+    };
+    assert(disk.seen);
+
+    // Data bitmap must cover the whole image
+    if (total_blocks > sb->num_data_bitmap_blocks * FS_BLOCK_SIZE * 8)
+        disk.total_blocks = sb->num_data_bitmap_blocks * FS_BLOCK_SIZE * 8;
+
+    fs_check_t check = {0};
+    fs_check(&disk, &check);
+    free(disk.seen);
+
+    printf("\nChecking disk image: %s\n", name);
+    printf("Blocks: %u total, %u used, %u free\n",
+           check.total_blocks, check.total_blocks - check.free_blocks, check.free_blocks);
+    printf("Free space: %u runs, largest %u blocks\n", check.free_runs, check.largest_free_run);
+    printf("Files: %u, directories: %u, extents: %u\n", check.files, check.dirs, check.extents);
+    printf("Extents per file: 0: %u  1: %u  2: %u  3: %u  4: %u  5-8: %u  9+: %u\n",
+           check.extent_histogram[0], check.extent_histogram[1], check.extent_histogram[2],
+           check.extent_histogram[3], check.extent_histogram[4], check.extent_histogram[5],
+           check.extent_histogram[6]);
+    printf("Directories: %u blocks, %u entries, largest is inode %u with %u entries\n",
+           check.dir_blocks, check.dir_entries, check.largest_dir_id, check.largest_dir_entries);
+    printf("Errors: %u bad inodes, %u bad extents, %u shared blocks, %u used blocks marked free, "
+           "%u free blocks marked used\n",
+           check.bad_inodes, check.bad_extents, check.shared_blocks, check.unmarked_blocks,
+           check.leaked_blocks);
+
+    free(image);
+    return check.bad_inodes + check.bad_extents + check.shared_blocks + check.unmarked_blocks == 0;
+}
+
 // ============================================
 // M A I N
 // ============================================
 // TODO: Pass in user input disk size? Or default value from makefile, don't hardcode 1.44MB
-int main(void) {
-    // Get pointer to output image
-    IMAGE_PTR = fopen(IMAGE_NAME, "wb");
+// Options:
+//   -i: Build a hashed name index for each directory
+//   -u: Only write blocks that changed in the existing image, e.g. changed files' data
+//       & their inodes; the result is the same as building the whole image
+//   -c [image]: Don't build an image, print stats for & check an existing one
+//               (default ../bin/OS.bin)
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-i")) {
+            dir_index = true;
+        } else if (!strcmp(argv[i], "-u")) {
+            update_image = true;
+        } else if (!strcmp(argv[i], "-c")) {
+            const char *name = (i+1 < argc) ? argv[i+1] : IMAGE_NAME;
+            return check_disk_image(name) ? EXIT_SUCCESS : EXIT_FAILURE;
+        } else {
+            fprintf(stderr, "Usage: %s [-i] [-u] [-c [image]]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
 
-    // Get total number of files (variable num_files) and 
+    // Scan fs_root once into memory, and get total number of files (variable num_files) and
     //     total size of those files (variable file_blocks), to build superblock and rest
     //     of disk image
-    if (!get_file_info("../bin/fs_root")) return EXIT_FAILURE;
+    strcpy(root_node.path, "../bin/fs_root");
+    root_node.is_dir = true;
+    if (!get_file_info(&root_node)) return EXIT_FAILURE;
+
+    const uint32_t disk_blocks = bytes_to_blocks(disk_size);
 
     printf("\nCreating disk image: %s\n", &IMAGE_NAME[7]);
-    printf("Block size: %d, Total disk_blocks: %d\n", FS_BLOCK_SIZE, bytes_to_blocks(disk_size));
-    printf("Total # of Files: %u, File blocks: %d\n", 
+    printf("Block size: %d, Total disk_blocks: %d\n", FS_BLOCK_SIZE, disk_blocks);
+    printf("Total # of Files: %u, File blocks: %d\n",
            num_files, file_blocks);
 
+    // Whole image is built in memory, blocks not written below stay 0s
+    image = calloc(disk_blocks, FS_BLOCK_SIZE);
+    assert(image);
+
     // Boot block
     if (!write_boot_block()) return EXIT_FAILURE;
 
@@ -463,6 +634,8 @@ int main(void) {
     // Inode and Data blocks for files
     if (!write_inode_and_data_blocks()) return EXIT_FAILURE;
 
-    // Finished writing disk image
-    fclose(IMAGE_PTR);
+    // Finished building disk image, write it out
+    if (!(update_image ? update_disk_image(disk_blocks) : write_image(disk_blocks))) return EXIT_FAILURE;
+
+    free(image);
 }
@@ -0,0 +1,742 @@
+/*
+ * disk/ata.h: Interrupt (IRQ14) driven ATA driver for the primary IDE channel,
+ *   using a queue of pending read/write requests. Transfers use bus master DMA
+ *   when a PCI IDE controller is found, otherwise PIO
+ */
+#pragma once
+
+#include "C/stdint.h"
+#include "C/stdbool.h"
+#include "C/string.h"
+#include "global/global_addresses.h"
+#include "ports/io.h"
+#include "ports/pci.h"
+#include "memory/physical_memory_manager.h"
+
+// Primary ATA bus I/O ports
+#define ATA_DATA          0x1F0
+#define ATA_ERROR         0x1F1
+#define ATA_SECTOR_COUNT  0x1F2
+#define ATA_LBA_LOW       0x1F3
+#define ATA_LBA_MID       0x1F4
+#define ATA_LBA_HIGH      0x1F5
+#define ATA_DRIVE_HEAD    0x1F6
+#define ATA_STATUS        0x1F7     // Reading this also acknowledges a pending IRQ14
+#define ATA_COMMAND       0x1F7
+#define ATA_ALT_STATUS    0x3F6     // Same as status, but does NOT acknowledge IRQs
+#define ATA_DEVICE_CONTROL 0x3F6
+
+// Status register bits
+#define ATA_SR_ERR 0x01     // Error
+#define ATA_SR_DRQ 0x08     // Data request, drive is ready to send/receive a sector
+#define ATA_SR_DF  0x20     // Drive fault
+#define ATA_SR_BSY 0x80     // Busy
+
+// Device control register bits
+#define ATA_DC_NIEN 0x02    // Disable drive interrupts
+#define ATA_DC_SRST 0x04    // Software reset
+
+// Bus master IDE registers, offsets from BAR4 I/O port of the PCI IDE controller
+#define BM_COMMAND 0x00
+#define BM_STATUS  0x02
+#define BM_PRDT    0x04     // Physical address of PRD table
+
+#define BM_CMD_START 0x01   // Start/stop bus master transfer
+#define BM_CMD_READ  0x08   // Direction: set = disk to memory (read), clear = memory to disk (write)
+
+#define BM_SR_ACTIVE 0x01   // Transfer in progress
+#define BM_SR_ERR    0x02   // DMA error, write 1 to clear
+#define BM_SR_IRQ    0x04   // Drive raised IRQ, write 1 to clear
+
+#define ATA_PRD_EOT 0x8000  // Last entry in PRD table
+
+#define ATA_REQUEST_QUEUE_SIZE 32
+#define ATA_DMA_PAGES 32    // 128KB of DMA buffers, enough for the max 256 sectors per command
+#define ATA_MAX_COMMAND_SECTORS 256     // Sector count register is 8 bits, 0 = 256 sectors
+#define ATA_DEFAULT_MULTIPLE 16         // Sectors per DRQ block for READ/WRITE MULTIPLE, if IDENTIFY fails
+#define ATA_LBA28_MAX_SECTORS 0x10000000    // Sectors past this need 48 bit LBA commands
+#define ATA_MAX_RETRIES 2               // Times a failed drive command is sent again before the request fails
+#define ATA_TIMEOUT_TICKS 5000          // Timer ticks (~1ms) a drive command can take before it's retried
+#define ATA_RESET_POLLS 1000000         // Status reads to wait for the drive after a reset, ~1s
+
+enum {
+    READ_WITH_RETRY   = 0x20,
+    READ_SECTORS_EXT  = 0x24,
+    READ_DMA_EXT      = 0x25,
+    READ_MULTIPLE_EXT = 0x29,
+    WRITE_WITH_RETRY  = 0x30,
+    WRITE_SECTORS_EXT = 0x34,
+    WRITE_DMA_EXT     = 0x35,
+    WRITE_MULTIPLE_EXT = 0x39,
+    READ_MULTIPLE     = 0xC4,
+    WRITE_MULTIPLE    = 0xC5,
+    SET_MULTIPLE_MODE = 0xC6,
+    READ_DMA          = 0xC8,
+    WRITE_DMA         = 0xCA,
+    CACHE_FLUSH       = 0xE7,
+    CACHE_FLUSH_EXT   = 0xEA,
+    IDENTIFY_DEVICE   = 0xEC,
+} ata_pio_commands;
+
+// Requests for the driver only, not drive commands. Plain writes stay in the drive's write
+//   cache until a flush; callers that need data on disk use ata_flush() or WRITE_AND_FLUSH
+enum {
+    WRITE_AND_FLUSH = 0x01, // Write, then flush the drive's write cache
+    FLUSH_ONLY      = 0x02, // No sectors, only flush the drive's write cache
+};
+
+// What the drive supports, from IDENTIFY DEVICE data
+typedef struct {
+    bool present;               // IDENTIFY worked, otherwise assume a basic 28 bit LBA PIO drive
+    char model[41];             // Words 27-46, null terminated
+    uint32_t sectors_28;        // Words 60-61, # of sectors addressable with 28 bit LBA
+    uint64_t sectors_48;        // Words 100-103, # of sectors addressable with 48 bit LBA
+    uint8_t max_multiple;       // Word 47 bits 0-7, max sectors per DRQ block for READ/WRITE MULTIPLE
+    bool lba48;                 // Word 83 bit 10, 48 bit LBA EXT commands
+    bool dma;                   // Word 49 bit 8, DMA commands
+    bool write_cache;           // Word 85 bit 5, write cache is enabled, needs flushing after writes
+    bool flush_cache_ext;       // Word 83 bit 13, FLUSH CACHE EXT
+} ata_device_t;
+
+// Physical region descriptor, 1 entry per physical memory region for a bus master DMA transfer
+typedef struct {
+    uint32_t address;       // Physical address, region can't cross a 64KB boundary
+    uint16_t size_bytes;    // 0 = 64KB
+    uint16_t flags;         // Bit 15 = end of table
+} ata_prd_t;                // sizeof(ata_prd_t) = 8 bytes
+
+typedef enum {
+    ATA_REQ_FREE = 0,   // Slot can be used for a new request
+    ATA_REQ_QUEUED,     // Waiting for the drive
+    ATA_REQ_ACTIVE,     // Command sent to the drive, transferring sectors
+    ATA_REQ_FLUSHING,   // All sectors written, waiting on cache flush
+    ATA_REQ_DONE,       // Finished successfully
+    ATA_REQ_ERROR,      // Finished with an error from the drive
+} ata_request_state_t;
+
+typedef struct ata_request ata_request_t;
+
+// Completion callback, called from the IRQ14 handler with interrupts disabled
+typedef void (*ata_callback_t)(ata_request_t *request);
+
+struct ata_request {
+    uint32_t lba;                   // Starting sector
+    uint32_t size_in_sectors;       // Total # of sectors to transfer
+    uint32_t sectors_left;          // # of sectors not transferred yet
+    uint32_t next_lba;              // Next sector to transfer
+    uint32_t command_sectors_left;  // # of sectors left in the current drive command, max 256
+    uint16_t *buffer;               // Next word in memory to transfer to/from
+    uint8_t command;                // READ_WITH_RETRY or WRITE_WITH_RETRY
+    bool flush;                     // Flush drive's write cache after writing
+    volatile uint8_t state;         // ata_request_state_t
+    bool dma;                       // Using bus master DMA instead of PIO for this request
+    bool lba48;                     // Current command uses 48 bit LBA EXT command
+    uint8_t sectors_per_drq;        // PIO sectors moved per DRQ/IRQ, >1 for READ/WRITE MULTIPLE
+    uint8_t retries;                // # of times a failed drive command was sent again
+    uint8_t error;                  // Error register from the last failed drive command
+    ata_callback_t callback;        // Optional, if 0 caller will ata_wait() on the request
+    void *callback_data;            // Passed through for the callback to use
+    uint32_t submit_tick;           // Timer ticks (~1ms) when request was queued
+    uint32_t complete_tick;         // Timer ticks when request finished
+    uint32_t command_tick;          // Timer ticks when the current drive command was sent
+};
+
+// Counters for the disk request queue
+typedef struct {
+    uint32_t requests;              // Total # of finished requests
+    uint32_t errors;                // # of requests that finished with an error
+    uint32_t sectors;               // Total # of sectors transferred
+    uint32_t irqs;                  // # of IRQ14s received
+    uint32_t dma_requests;          // # of finished requests that used DMA
+    uint32_t queue_depth;           // Current # of queued + active requests
+    uint32_t max_queue_depth;       // Highest queue depth seen
+    uint32_t last_latency;          // Ticks from submit to completion, for the last request
+    uint32_t max_latency;           // Highest latency seen
+    uint32_t total_latency;         // Sum of all request latencies, for averages
+    uint32_t flushes;               // # of cache flush commands sent
+    uint32_t retries;               // # of drive commands sent again after an error or timeout
+    uint32_t timeouts;              // # of drive commands that took too long
+    uint32_t resets;                // # of drive software resets
+    uint8_t last_error;             // Error register from the last failed drive command
+} ata_stats_t;
+
+ata_request_t ata_queue[ATA_REQUEST_QUEUE_SIZE];
+uint32_t ata_queue_head = 0;        // Oldest request, the one the drive is working on
+uint32_t ata_queue_tail = 0;        // Next slot to queue a new request in
+ata_stats_t ata_stats = {0};
+bool ata_unflushed_writes = false;  // Writes were queued since the last flush
+bool ata_irq_enabled = false;       // Set after IRQ14 handler is installed, otherwise poll
+uint8_t ata_multiple_sectors = 1;   // Sectors per DRQ block set with SET MULTIPLE MODE, 1 = not used
+ata_device_t ata_device = {0};      // Primary master drive
+
+uint16_t ata_bm_port = 0;           // Bus master IDE registers I/O port
+bool ata_dma_available = false;     // Found a bus master IDE controller & set up DMA buffers
+bool ata_dma_enabled = false;       // Use DMA for new requests, if available
+ata_prd_t *ata_prdt = 0;            // PRD table, identity mapped
+uint32_t ata_dma_pages[ATA_DMA_PAGES] = {0};  // Physical (identity mapped) DMA buffer pages
+
+volatile uint32_t *timer_ticks = (uint32_t *)IRQ0_TIMER_TICKS_AREA;
+
+// Save EFLAGS and disable interrupts, for touching the queue from outside the IRQ handler
+uint32_t ata_save_flags_cli(void) {
+    uint32_t eflags;
+    __asm__ __volatile__ ("pushfl; popl %0; cli" : "=r"(eflags) : : "memory");
+    return eflags;
+}
+
+// Restore interrupt flag from saved EFLAGS
+void ata_restore_flags(const uint32_t eflags) {
+    if (eflags & 0x200) __asm__ __volatile__ ("sti" : : : "memory");
+}
+
+// 400ns delay - Read alternate status register
+void ata_delay_400ns(void) {
+    for (uint8_t i = 0; i < 4; i++)
+        inb(ATA_ALT_STATUS);
+}
+
+// Get the request the drive is currently working on, if any
+ata_request_t *ata_active_request(void) {
+    if (ata_queue_head == ata_queue_tail) return 0;
+
+    ata_request_t *request = &ata_queue[ata_queue_head];
+    if (request->state != ATA_REQ_ACTIVE && request->state != ATA_REQ_FLUSHING) return 0;
+
+    return request;
+}
+
+// Fill PRD table for the current DMA command, copying data to write into the DMA buffer pages
+void ata_dma_prepare(ata_request_t *request) {
+    uint32_t bytes_left = request->command_sectors_left * 512;
+    uint32_t i = 0;
+
+    for (; bytes_left > 0; i++) {
+        const uint32_t size = bytes_left > BLOCK_SIZE ? BLOCK_SIZE : bytes_left;
+
+        ata_prdt[i].address    = ata_dma_pages[i];
+        ata_prdt[i].size_bytes = size;
+        ata_prdt[i].flags      = 0;
+
+        if (request->command == WRITE_WITH_RETRY)
+            memcpy32((void *)ata_dma_pages[i], (uint8_t *)request->buffer + (i * BLOCK_SIZE), size);
+
+        bytes_left -= size;
+    }
+    ata_prdt[i-1].flags = ATA_PRD_EOT;
+
+    outb(ata_bm_port + BM_COMMAND, 0);                          // Make sure bus master is stopped
+    outb(ata_bm_port + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);       // Clear error & interrupt bits
+    outl(ata_bm_port + BM_PRDT, (uint32_t)ata_prdt);
+}
+
+// Finish the current DMA command after the drive is done, copying read data out of the DMA buffer pages
+// Returns: false if the bus master had an error
+bool ata_dma_finish(ata_request_t *request) {
+    const uint8_t bm_status = inb(ata_bm_port + BM_STATUS);
+    const uint32_t sectors = request->command_sectors_left;
+
+    outb(ata_bm_port + BM_COMMAND, 0);                          // Stop bus master
+    outb(ata_bm_port + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);       // Clear error & interrupt bits
+
+    if (bm_status & BM_SR_ERR) return false;
+
+    if (request->command == READ_WITH_RETRY) {
+        uint32_t bytes_left = sectors * 512;
+
+        for (uint32_t i = 0; bytes_left > 0; i++) {
+            const uint32_t size = bytes_left > BLOCK_SIZE ? BLOCK_SIZE : bytes_left;
+            memcpy32((uint8_t *)request->buffer + (i * BLOCK_SIZE), (void *)ata_dma_pages[i], size);
+            bytes_left -= size;
+        }
+    }
+
+    request->buffer += sectors * 256;
+    request->next_lba += sectors;
+    request->sectors_left -= sectors;
+    request->command_sectors_left = 0;
+    return true;
+}
+
+// Move 1 DRQ block of sectors between the data port and memory, for PIO commands
+void ata_pio_transfer_block(ata_request_t *request) {
+    uint32_t sectors = request->sectors_per_drq;
+    if (sectors > request->command_sectors_left) sectors = request->command_sectors_left;
+
+    if (request->command == READ_WITH_RETRY) {
+        // Read 256 words per sector from data port into memory
+        for (uint32_t i = 0; i < sectors * 256; i++)
+            *request->buffer++ = inw(ATA_DATA);
+    } else {
+        // Write 256 words per sector from memory to data port
+        for (uint32_t i = 0; i < sectors * 256; i++)
+            outw(ATA_DATA, *request->buffer++);
+    }
+
+    request->next_lba += sectors;
+    request->sectors_left -= sectors;
+    request->command_sectors_left -= sectors;
+    ata_delay_400ns();
+}
+
+// Send the drive a command for the next (up to) 256 sectors of a request
+void ata_send_command(ata_request_t *request) {
+    const uint32_t lba = request->next_lba;
+    const bool read = (request->command == READ_WITH_RETRY);
+
+    request->command_sectors_left = request->sectors_left > ATA_MAX_COMMAND_SECTORS ? ATA_MAX_COMMAND_SECTORS 
+                                                                                    : request->sectors_left;
+    request->command_tick = *timer_ticks;
+    if (request->dma) ata_dma_prepare(request);
+
+    // Only use 48 bit LBA when the sectors are out of 28 bit range, EXT commands need more port writes
+    request->lba48 = ata_device.lba48 && (lba + request->command_sectors_left > ATA_LBA28_MAX_SECTORS);
+
+    if (request->lba48) {
+        // High bytes first: sector count bits 8-15, LBA bits 24-47 (sector #s are 32 bit here)
+        outb(ATA_DRIVE_HEAD,   0x40);                   // LBA mode, drive 0
+        outb(ATA_SECTOR_COUNT, (request->command_sectors_left >> 8) & 0xFF);
+        outb(ATA_LBA_LOW,      (lba >> 24) & 0xFF);     // LBA bits 24-31
+        outb(ATA_LBA_MID,      0);                      // LBA bits 32-39
+        outb(ATA_LBA_HIGH,     0);                      // LBA bits 40-47
+    } else {
+        // Port 1F6h head/drive # bits: 7: always set(1), 6 = CHS(0) or LBA(1), 5 = always set(1), 4 = drive # (0 = primary, 1 = secondary),
+        //   3-0: Head # OR LBA bits 24-27
+        outb(ATA_DRIVE_HEAD,   (0xE0 | ((lba >> 24) & 0x0F)));
+    }
+    outb(ATA_SECTOR_COUNT, request->command_sectors_left & 0xFF);   // # of sectors to read/write, 0 = 256
+    outb(ATA_LBA_LOW,      lba & 0xFF);             // LBA bits 0-7
+    outb(ATA_LBA_MID,      ((lba >> 8)  & 0xFF));   // LBA bits 8-15
+    outb(ATA_LBA_HIGH,     ((lba >> 16) & 0xFF));   // LBA bits 16-23
+
+    if (request->dma) {
+        // Send DMA read/write command, then start the bus master in the same direction
+        if (request->lba48) outb(ATA_COMMAND, read ? READ_DMA_EXT : WRITE_DMA_EXT);
+        else                outb(ATA_COMMAND, read ? READ_DMA : WRITE_DMA);
+
+        outb(ata_bm_port + BM_COMMAND, (read ? BM_CMD_READ : 0) | BM_CMD_START);
+        return;     // Drive will send IRQ14 when all sectors are transferred
+    }
+
+    if (request->sectors_per_drq > 1) {
+        if (request->lba48) outb(ATA_COMMAND, read ? READ_MULTIPLE_EXT : WRITE_MULTIPLE_EXT);
+        else                outb(ATA_COMMAND, read ? READ_MULTIPLE : WRITE_MULTIPLE);
+    } else {
+        if (request->lba48) outb(ATA_COMMAND, read ? READ_SECTORS_EXT : WRITE_SECTORS_EXT);
+        else                outb(ATA_COMMAND, request->command);
+    }
+
+    if (!read) {
+        // Drive does not send an IRQ for the first block of a write, wait until it
+        //   is ready for data and send it here. The rest are sent from IRQs
+        ata_delay_400ns();
+        uint8_t status = inb(ATA_ALT_STATUS);
+        while ((status & ATA_SR_BSY) || !(status & (ATA_SR_DRQ | ATA_SR_ERR | ATA_SR_DF)))
+            status = inb(ATA_ALT_STATUS);
+
+        if (status & (ATA_SR_ERR | ATA_SR_DF)) return; // Error will be picked up in ata_service()
+
+        ata_pio_transfer_block(request);
+    }
+}
+
+// Send the drive a cache flush command for a request, drive sends IRQ14 when done
+void ata_send_flush(ata_request_t *request) {
+    request->state        = ATA_REQ_FLUSHING;
+    request->command_tick = *timer_ticks;
+
+    outb(ATA_DRIVE_HEAD, 0xE0);
+    outb(ATA_COMMAND, ata_device.flush_cache_ext ? CACHE_FLUSH_EXT : CACHE_FLUSH);
+    ata_stats.flushes++;
+    ata_delay_400ns();
+}
+
+void ata_complete(ata_request_t *request, const ata_request_state_t state);
+bool ata_set_multiple_mode(const uint8_t sectors);
+
+// Software reset the drive, then set multiple mode again. Polls with drive interrupts off,
+//   can be called from the IRQ14 handler
+void ata_soft_reset(void) {
+    outb(ATA_DEVICE_CONTROL, ATA_DC_NIEN | ATA_DC_SRST);
+    for (uint32_t i = 0; i < 13; i++) ata_delay_400ns();   // Hold SRST for at least 5us
+    outb(ATA_DEVICE_CONTROL, ATA_DC_NIEN);
+    for (uint32_t i = 0; i < 5000; i++) ata_delay_400ns(); // Drive sets BSY within 2ms
+
+    for (uint32_t i = 0; i < ATA_RESET_POLLS && (inb(ATA_ALT_STATUS) & ATA_SR_BSY); i++)
+        ;
+
+    if (ata_multiple_sectors > 1) ata_set_multiple_mode(ata_multiple_sectors);
+
+    outb(ATA_DEVICE_CONTROL, ata_irq_enabled ? 0 : ATA_DC_NIEN);
+    ata_stats.resets++;
+}
+
+// Send the active request's current drive command again after an error or timeout, soft 
+//   resetting the drive first if it faulted or stopped responding. Sectors already 
+//   transferred are not sent again
+// Returns: false if the request is out of retries and should fail
+bool ata_retry(ata_request_t *request, const bool reset) {
+    if (request->dma) outb(ata_bm_port + BM_COMMAND, 0);    // Stop bus master
+    if (request->retries >= ATA_MAX_RETRIES) return false;
+
+    request->retries++;
+    ata_stats.retries++;
+    if (reset) ata_soft_reset();
+
+    if (request->state == ATA_REQ_FLUSHING) ata_send_flush(request);
+    else                                    ata_send_command(request);
+    return true;
+}
+
+// Start the next queued request
+void ata_start_next(void) {
+    if (ata_queue_head == ata_queue_tail) return;   // Nothing queued
+
+    ata_request_t *request = &ata_queue[ata_queue_head];
+    if (request->state != ATA_REQ_QUEUED) return;   // Already started
+
+    request->dma             = ata_dma_enabled;
+    request->sectors_per_drq = ata_multiple_sectors;
+    request->state           = ATA_REQ_ACTIVE;
+
+    if (request->sectors_left == 0) {
+        // Flush only request
+        if (ata_device.present && !ata_device.write_cache) {
+            ata_complete(request, ATA_REQ_DONE);
+            return;
+        }
+
+        request->dma = false;
+        ata_send_flush(request);
+        return;     // Drive sends IRQ14 when done
+    }
+
+    ata_send_command(request);
+}
+
+// Finish the active request, and start the next one in the queue
+void ata_complete(ata_request_t *request, const ata_request_state_t state) {
+    request->complete_tick = *timer_ticks;
+
+    const uint32_t latency = request->complete_tick - request->submit_tick;
+    ata_stats.requests++;
+    ata_stats.sectors += request->size_in_sectors - request->sectors_left;
+    ata_stats.last_latency = latency;
+    ata_stats.total_latency += latency;
+    if (latency > ata_stats.max_latency) ata_stats.max_latency = latency;
+    if (state == ATA_REQ_ERROR) ata_stats.errors++;
+    if (request->dma) ata_stats.dma_requests++;
+
+    ata_queue_head = (ata_queue_head + 1) % ATA_REQUEST_QUEUE_SIZE;
+    ata_stats.queue_depth--;
+
+    request->state = state;
+
+    // Requests with callbacks are not waited on, free the slot after the callback is done
+    if (request->callback) {
+        request->callback(request);
+        request->state = ATA_REQ_FREE;
+    }
+
+    ata_start_next();
+}
+
+// Move the active request along after the drive signals it's ready; called from the
+//   IRQ14 handler, or polled from ata_wait()
+void ata_service(void) {
+    ata_request_t *request = ata_active_request();
+    uint8_t status = inb(ATA_STATUS);   // Also acknowledges the IRQ
+
+    if (!request) return;               // Spurious or late IRQ, nothing to do
+    if (status & ATA_SR_BSY) return;    // Drive is not ready yet
+
+    if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+        request->error = inb(ATA_ERROR);
+        ata_stats.last_error = request->error;
+
+        // Drive fault needs a reset, other errors e.g. a bad CRC or unreadable sector may
+        //   work on a 2nd try
+        if (!ata_retry(request, status & ATA_SR_DF)) ata_complete(request, ATA_REQ_ERROR);
+        return;
+    }
+
+    if (request->state == ATA_REQ_FLUSHING) {
+        ata_complete(request, ATA_REQ_DONE);
+        return;
+    }
+
+    if (request->dma) {
+        // Whole command is done in 1 go, wait until bus master is finished
+        const uint8_t bm_status = inb(ata_bm_port + BM_STATUS);
+        if ((bm_status & BM_SR_ACTIVE) && !(bm_status & BM_SR_IRQ)) return;
+
+        if (!ata_dma_finish(request)) {
+            if (!ata_retry(request, false)) ata_complete(request, ATA_REQ_ERROR);
+            return;
+        }
+
+    } else if (request->command == READ_WITH_RETRY) {
+        if (!(status & ATA_SR_DRQ)) return;
+
+        ata_pio_transfer_block(request);
+        if (request->command_sectors_left > 0) return;  // More blocks to come for this command
+
+    } else if (request->command_sectors_left > 0) {
+        if (!(status & ATA_SR_DRQ)) return;
+
+        ata_pio_transfer_block(request);
+        return;     // Drive sends another IRQ after it takes the block
+    }
+
+    // Current drive command is done, send the next one for the rest of the request
+    if (request->sectors_left > 0) {
+        ata_send_command(request);
+        return;
+    }
+
+    // Drives without a write cache enabled have the data on disk already
+    if (request->command == WRITE_WITH_RETRY && request->flush && 
+        (!ata_device.present || ata_device.write_cache)) {
+        // Send cache flush command after write command is finished.
+        //   Drive will send another IRQ when done
+        ata_send_flush(request);
+        return;
+    }
+
+    ata_complete(request, ATA_REQ_DONE);
+}
+
+// Retry the active request's drive command if it's taking too long, e.g. the drive is hung
+//   with BSY set. Called from the wait loops with interrupts disabled
+void ata_check_timeout(void) {
+    ata_request_t *request = ata_active_request();
+    if (!request || *timer_ticks - request->command_tick < ATA_TIMEOUT_TICKS) return;
+
+    ata_stats.timeouts++;
+    if (!ata_retry(request, true)) ata_complete(request, ATA_REQ_ERROR);
+}
+
+// Queue a read/write request. If callback is 0, caller needs to ata_wait() on the
+//   returned request, otherwise callback will be called from the IRQ14 handler when done
+ata_request_t *ata_submit(const uint32_t size_in_sectors, const uint32_t starting_sector, const uint32_t address,
+                          const uint8_t command, ata_callback_t callback, void *callback_data) {
+
+    uint32_t eflags = ata_save_flags_cli();
+
+    // Wait for a slot if queue is full
+    while (ata_queue[ata_queue_tail].state != ATA_REQ_FREE) {
+        if (ata_irq_enabled) __asm__ __volatile__ ("sti;hlt;cli");
+        if (ata_active_request() && !(inb(ATA_ALT_STATUS) & ATA_SR_BSY)) ata_service();
+        ata_check_timeout();
+    }
+
+    ata_request_t *request = &ata_queue[ata_queue_tail];
+    request->lba             = starting_sector;
+    request->size_in_sectors = size_in_sectors;
+    request->sectors_left    = size_in_sectors;
+    request->next_lba        = starting_sector;
+    request->command_sectors_left = 0;
+    request->buffer          = (uint16_t *)address;
+    request->command         = (command == WRITE_AND_FLUSH || command == FLUSH_ONLY) ? WRITE_WITH_RETRY : command;
+    request->flush           = (command == WRITE_AND_FLUSH || command == FLUSH_ONLY);
+    request->callback        = callback;
+    request->callback_data   = callback_data;
+    request->submit_tick     = *timer_ticks;
+    request->complete_tick   = 0;
+    request->retries         = 0;
+    request->error           = 0;
+    request->state           = ATA_REQ_QUEUED;
+
+    // A flush covers every write queued before it
+    if (request->command == WRITE_WITH_RETRY) ata_unflushed_writes = !request->flush;
+
+    ata_queue_tail = (ata_queue_tail + 1) % ATA_REQUEST_QUEUE_SIZE;
+
+    if (++ata_stats.queue_depth > ata_stats.max_queue_depth)
+        ata_stats.max_queue_depth = ata_stats.queue_depth;
+
+    ata_start_next();   // Start request now if drive is idle
+
+    ata_restore_flags(eflags);
+    return request;
+}
+
+// Block until a request without a callback is done, then free its queue slot.
+//   Other IRQs e.g. timer and keyboard keep running while waiting
+// Returns: true if request completed without an error
+bool ata_wait(ata_request_t *request) {
+    uint32_t eflags = ata_save_flags_cli();
+
+    while (request->state != ATA_REQ_DONE && request->state != ATA_REQ_ERROR) {
+        if (ata_irq_enabled) __asm__ __volatile__ ("sti;hlt;cli");
+
+        // IRQ14 can't get through while a higher priority IRQ is being handled, e.g. the
+        //   keyboard IRQ1 writing to stdin, so also check on the drive from here
+        if (ata_active_request() && !(inb(ATA_ALT_STATUS) & ATA_SR_BSY)) ata_service();
+        ata_check_timeout();
+    }
+
+    const bool result = (request->state == ATA_REQ_DONE);
+    request->state = ATA_REQ_FREE;
+
+    ata_restore_flags(eflags);
+    return result;
+}
+
+// Block until a count of outstanding requests with callbacks drops to 0; their callbacks
+//   decrement it. Other IRQs keep running while waiting, like ata_wait()
+void ata_wait_for(volatile uint32_t *pending) {
+    uint32_t eflags = ata_save_flags_cli();
+
+    while (*pending > 0) {
+        if (ata_irq_enabled) __asm__ __volatile__ ("sti;hlt;cli");
+        if (ata_active_request() && !(inb(ATA_ALT_STATUS) & ATA_SR_BSY)) ata_service();
+        ata_check_timeout();
+    }
+
+    ata_restore_flags(eflags);
+}
+
+// Flush the drive's write cache and wait, e.g. after a batch of writes. Does nothing if
+//   nothing was written since the last flush
+// Returns: true if flush completed without an error
+bool ata_flush(void) {
+    if (!ata_unflushed_writes) return true;
+    return ata_wait(ata_submit(0, 0, 0, FLUSH_ONLY, 0, 0));
+}
+
+// Set # of sectors per DRQ block for READ/WRITE MULTIPLE, polling until the drive is done.
+//   Drive aborts the command if it doesn't support that many; then single sector commands are used
+// Returns: true if multiple mode is set
+bool ata_set_multiple_mode(const uint8_t sectors) {
+    outb(ATA_DRIVE_HEAD,   0xE0);
+    outb(ATA_SECTOR_COUNT, sectors);
+    outb(ATA_COMMAND,      SET_MULTIPLE_MODE);
+    ata_delay_400ns();
+
+    uint8_t status = inb(ATA_STATUS);
+    while (status & ATA_SR_BSY) status = inb(ATA_STATUS);
+
+    ata_multiple_sectors = (status & (ATA_SR_ERR | ATA_SR_DF)) ? 1 : sectors;
+    return ata_multiple_sectors > 1;
+}
+
+// Get drive capabilities with IDENTIFY DEVICE, polling until the drive is done
+// Returns: true if there's an ATA drive, and fills out ata_device
+bool ata_identify(void) {
+    uint16_t data[256];
+
+    memset(&ata_device, 0, sizeof ata_device);
+
+    outb(ATA_DRIVE_HEAD,   0xA0);   // Drive 0
+    outb(ATA_SECTOR_COUNT, 0);
+    outb(ATA_LBA_LOW,      0);
+    outb(ATA_LBA_MID,      0);
+    outb(ATA_LBA_HIGH,     0);
+    outb(ATA_COMMAND,      IDENTIFY_DEVICE);
+    ata_delay_400ns();
+
+    uint8_t status = inb(ATA_STATUS);
+    if (status == 0 || status == 0xFF) return false;    // No drive, or floating bus
+
+    while (status & ATA_SR_BSY) status = inb(ATA_STATUS);
+
+    // ATAPI/SATA devices set these and abort IDENTIFY DEVICE
+    if (inb(ATA_LBA_MID) || inb(ATA_LBA_HIGH)) return false;
+
+    while (!(status & (ATA_SR_DRQ | ATA_SR_ERR))) status = inb(ATA_STATUS);
+    if (status & ATA_SR_ERR) return false;
+
+    for (uint32_t i = 0; i < 256; i++)
+        data[i] = inw(ATA_DATA);
+
+    // Model string is stored as big endian words
+    for (uint32_t i = 0; i < 20; i++) {
+        ata_device.model[i*2]   = data[27+i] >> 8;
+        ata_device.model[i*2+1] = data[27+i] & 0xFF;
+    }
+    for (int32_t i = 39; i >= 0 && ata_device.model[i] == ' '; i--)
+        ata_device.model[i] = '\0';    // Trim trailing spaces
+
+    ata_device.sectors_28      = data[60] | ((uint32_t)data[61] << 16);
+    ata_device.max_multiple    = data[47] & 0xFF;
+    ata_device.dma             = (data[49] & (1 << 8)) != 0;
+    ata_device.lba48           = (data[83] & (1 << 10)) != 0;
+    ata_device.flush_cache_ext = ata_device.lba48 && (data[83] & (1 << 13));
+    ata_device.write_cache     = (data[85] & (1 << 5)) != 0;
+
+    if (ata_device.lba48) {
+        ata_device.sectors_48 = data[100] | ((uint64_t)data[101] << 16) | 
+                                ((uint64_t)data[102] << 32) | ((uint64_t)data[103] << 48);
+    }
+
+    ata_device.present = true;
+    return true;
+}
+
+// Total # of sectors on the drive that can be addressed with 32 bit sector #s, 0 if unknown
+uint32_t ata_total_sectors(void) {
+    if (!ata_device.present) return 0;
+    if (!ata_device.lba48) return ata_device.sectors_28;
+    if (ata_device.sectors_48 > 0xFFFFFFFF) return 0xFFFFFFFF;
+
+    return (uint32_t)ata_device.sectors_48;
+}
+
+// Probe the drive, enable drive interrupts & multi sector PIO transfers; IRQ14 handler should be 
+//   in the IDT before calling this, and no requests should be queued
+void ata_init(void) {
+    if (ata_identify()) {
+        if (ata_device.max_multiple > 1) ata_set_multiple_mode(ata_device.max_multiple);
+    } else {
+        ata_set_multiple_mode(ATA_DEFAULT_MULTIPLE);    // Try anyway, drive will abort if not supported
+    }
+
+    outb(ATA_DEVICE_CONTROL, 0);    // Clear nIEN bit 1 to have the drive send IRQs
+    ata_irq_enabled = true;
+}
+
+// Find a PCI IDE controller that can bus master, and set up PRD table & DMA buffer pages
+//   for it. Buffer addresses are used as both physical & virtual addresses, so need to be
+//   in the identity mapped 1st 1MB of memory; call this early before that is used up
+// Returns: true if DMA can be used, otherwise disk transfers stay PIO
+bool ata_dma_init(void) {
+    pci_device_t ide;
+
+    if (ata_device.present && !ata_device.dma) return false;    // Drive can't do DMA
+    if (!pci_find_class(0x01, 0x01, &ide)) return false;    // Class 1 = mass storage, subclass 1 = IDE
+    if (!(ide.prog_if & 0x80)) return false;                // Prog IF bit 7 = bus mastering supported
+
+    const uint32_t bar4 = pci_config_read_32(ide.bus, ide.device, ide.function, PCI_BAR4);
+    if (!(bar4 & 1)) return false;                          // Bus master registers should be in I/O space
+
+    // Get DMA memory, PRD table can't cross a 64KB boundary so 1 page is fine
+    bool ok = true;
+    ata_prdt = allocate_blocks(1);
+    if (!ata_prdt || (uint32_t)ata_prdt >= 0x100000) ok = false;
+
+    for (uint32_t i = 0; i < ATA_DMA_PAGES; i++) {
+        ata_dma_pages[i] = (uint32_t)allocate_blocks(1);
+        if (!ata_dma_pages[i] || ata_dma_pages[i] >= 0x100000) ok = false;
+    }
+
+    if (!ok) {
+        // Not enough low memory, give it back and use PIO
+        if (ata_prdt) free_blocks((uint32_t *)ata_prdt, 1);
+        for (uint32_t i = 0; i < ATA_DMA_PAGES; i++)
+            if (ata_dma_pages[i]) free_blocks((uint32_t *)ata_dma_pages[i], 1);
+
+        ata_prdt = 0;
+        memset(ata_dma_pages, 0, sizeof ata_dma_pages);
+        return false;
+    }
+
+    // Enable I/O space & bus mastering for the controller
+    const uint16_t command = pci_config_read_16(ide.bus, ide.device, ide.function, PCI_COMMAND);
+    pci_config_write_16(ide.bus, ide.device, ide.function, PCI_COMMAND,
+                        command | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+    ata_bm_port = bar4 & 0xFFFC;
+    ata_dma_available = true;
+    ata_dma_enabled = true;
+    return true;
+}
@@ -6,14 +6,10 @@
 #include "C/stdio.h"
 #include "C/string.h"
 #include "ports/io.h"
+#include "disk/ata.h"
 
 #define MAX_FILENAME_LENGTH 10
 
-enum {
-    READ_WITH_RETRY = 0x20,
-    WRITE_WITH_RETRY = 0x30,
-} ata_pio_commands;
-
 //-------------------------------------
 // Check for filename in filetable
 // Input 1: File name to check
@@ -49,87 +45,17 @@ uint8_t *check_filename(uint8_t *filename, const uint16_t filename_length)
 //   3: Address to Read/Write data from/to
 //   4: Command to perform (Reading or Writing)
 //-----------------------------------------------
+// Queues the request for the IRQ14 driver in disk/ata.h and blocks until it's done;
+//   use ata_submit() with a callback to not block
 void rw_sectors(const uint32_t size_in_sectors, uint32_t starting_sector, uint32_t address, const uint8_t command) {
-    //uint8_t head = 0;
-    //uint16_t cylinder = 0;
-
-    // Convert given starting sector to correct CHS values
-    // "Typical" disk limits are Cylinder: 0-1023, Head: 0-15, Sector: 1-63 (sector is 1-based!)
-    //if (starting_sector > 63) {
-    //    head = starting_sector / 63;
-    //    starting_sector %= 63;
-    //    if (starting_sector == 0) {
-    //        starting_sector = 63;
-    //        head--;
-    //    }
-    //    cylinder = head / 16;
-    //    head %= 16;
-    //}
-
-    //if (cylinder >= 1024) {
-    //    // TODO: Error for disk limit reached
-    //}
-    
-    // TODO: Change to LBA later on? Either 28/48bit LBA
-    // CHS -> LBA = ((cylinder * 16 + head) * 63) + sector - 1
-    // LBA -> CHS =
-    //   cylinder = LBA / (16 * 63);
-    //   temp     = LBA % (16 * 63);
-    //   head     = temp / 63;
-    //   sector   = temp % 63 + 1;
-    
-    // TODO: If size in sectors > 256, then loop and "chunk" to send 256 sectors at a time until all is read/written
-    // Port 1F6h head/drive # bits: 7: always set(1), 6 = CHS(0) or LBA(1), 5 = always set(1), 4 = drive # (0 = primary, 1 = secondary),
-    //   3-0: Head # OR LBA bits 24-27
-    outb(0x1F6, (0xE0 | ((starting_sector >> 24) & 0x0F))); // Head/drive # port - send head/drive #
-    outb(0x1F2, size_in_sectors);                           // Sector count port - # of sectors to read/write
-    outb(0x1F3, starting_sector & 0xFF);                    // Sector number port / LBA low bits 0-7
-    outb(0x1F4, ((starting_sector >> 8)  & 0xFF));          // Cylinder low port / LBA mid bits 8-15
-    outb(0x1F5, ((starting_sector >> 16) & 0xFF));          // Cylinder high port / LBA high bits 16-23
-    outb(0x1F7, command);                                   // Command port - send read/write command
-                                                            
-    uint16_t *address_ptr = (uint16_t *)address;                                                           
-
-    if (command == READ_WITH_RETRY) {
-        for (uint8_t i = size_in_sectors; i > 0; i--) {
-            // Poll status port after reading 1 sector
-            while (inb(0x1F7) & (1 << 7)) // Wait until BSY bit is clear 
-                ;
-
-            // Read 256 words from data port into memory
-            for (uint32_t j = 0; j < 256; j++)
-                *address_ptr++ = inw(0x1F0);
-
-            // 400ns delay - Read alternate status register
-            for (uint8_t k = 0; k < 4; k++)
-                inb(0x3F6);
-        }
-
-    } else if (command == WRITE_WITH_RETRY) {
-        for (uint8_t i = size_in_sectors; i > 0; i--) {
-            // Poll status port after reading 1 sector
-            while (inb(0x1F7) & (1 << 7)) // Wait until BSY bit is clear 
-                ;
-
-            // Write 256 words from memory to data port
-            for (uint32_t j = 0; j < 256; j++)
-                outw(0x1F0, *address_ptr++);
-
-            // 400ns delay - Read alternate status register
-            for (uint8_t k = 0; k < 4; k++)
-                inb(0x3F6);
-        }
-
-        // Send cache flush command after write command is finished
-        outb(0x1F7, 0xE7);
-
-        // Wait until BSY bit is clear after cache flush
-        while (inb(0x1F7) & (1 << 7)) 
-            ;
-    }
+    if (size_in_sectors == 0) return;   // Sector count of 0 would mean 256 sectors to the drive
+
+    // Driver splits this into commands of up to 256 sectors
+    ata_request_t *request = ata_submit(size_in_sectors, starting_sector, address, command, 0, 0);
 
     // TODO: Handle disk write error for file table here...
     //   Check error ata pio register here...
+    ata_wait(request);
 }
 
 // delete_file: Delete a file from the disk
@@ -6,7 +6,7 @@
 #include "C/stdint.h"
 #include "C/string.h"
 #include "C/stddef.h"
-#include "memory/malloc.h"
+#include "memory/sbrk.h"
 
 typedef uint16_t Elf32_Half;
 typedef uint32_t Elf32_Word;
@@ -133,12 +133,13 @@ void *load_elf_file(uint8_t *file_address, void **pgm_buf, uint32_t *pgm_size) {
     uint32_t buffer_size = mem_max - mem_min;
     printf("\r\nMemory needed for file: %x\r\n", buffer_size);
 
-    // Create buffer for file
-    *pgm_buf = malloc(buffer_size);
+    // Create buffer for file at the start of program memory
+    *pgm_buf = program_sbrk(buffer_size);
     *pgm_size = buffer_size;
 
-    if (*pgm_buf == NULL) {
-        printf("\r\nError: Could not malloc() enough memory for program\r\n");
+    if (*pgm_buf == (void *)-1) {
+        *pgm_buf = NULL;
+        printf("\r\nError: Could not get enough memory for program\r\n");
         return NULL;
     }
 
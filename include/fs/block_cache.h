@@ -0,0 +1,259 @@
+/*
+ * fs/block_cache.h: Write back cache of disk blocks for file system metadata,
+ *   e.g. bitmaps, inode blocks, directory blocks. Least recently used clean blocks are
+ *   reused first. Dirty blocks are written to disk together by the commit callback, e.g. as a
+ *   journal transaction, when too many are dirty or before they're read around the cache
+ */
+#pragma once
+
+#include "C/stdint.h"
+#include "C/stdbool.h"
+#include "C/string.h"
+#include "fs/fs.h"
+#include "disk/file_ops.h"
+
+#define BLOCK_CACHE_NONE    0xFFFF  // End of list/chain
+#define BLOCK_CACHE_BUCKETS 64      // Hash buckets for looking up blocks, power of 2
+
+typedef struct {
+    uint32_t block;         // Disk block # cached in this entry
+    uint8_t *data;          // FS_BLOCK_SIZE bytes of block data
+    bool valid;             // Entry holds a block
+    bool dirty;             // Data has changed since it was read/written
+    uint16_t prev;          // Next more recently used entry
+    uint16_t next;          // Next less recently used entry
+    uint16_t hash_next;     // Next entry in the same hash bucket
+} block_cache_entry_t;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t write_backs;   // # of dirty blocks written to disk
+} block_cache_stats_t;
+
+// Storage for entries & block data is given in block_cache_init(), kernel & 3rd stage use different sizes
+block_cache_entry_t *block_cache = 0;
+uint32_t block_cache_size = 0;
+uint16_t block_cache_mru = BLOCK_CACHE_NONE;    // Most recently used entry
+uint16_t block_cache_lru = BLOCK_CACHE_NONE;    // Least recently used entry, reused first
+uint16_t block_cache_buckets[BLOCK_CACHE_BUCKETS];
+block_cache_stats_t block_cache_stats = {0};
+uint32_t block_cache_dirty_blocks = 0;          // # of dirty entries
+uint32_t block_cache_dirty_limit = 0;           // Most dirty entries before they're committed
+
+// Writes all dirty blocks to disk and leaves them clean. If 0, dirty blocks are written 1 at a
+//   time when their entry is reused or their range is synced
+void (*block_cache_commit)(void) = 0;
+
+// Set up cache with given entries, and FS_BLOCK_SIZE * count bytes of data for them
+void block_cache_init(block_cache_entry_t *entries, uint8_t *data, const uint32_t count) {
+    block_cache = entries;
+    block_cache_size = count;
+
+    for (uint32_t i = 0; i < BLOCK_CACHE_BUCKETS; i++)
+        block_cache_buckets[i] = BLOCK_CACHE_NONE;
+
+    // All entries start out in the LRU list in order, unused
+    for (uint32_t i = 0; i < count; i++) {
+        block_cache[i] = (block_cache_entry_t){
+            .data      = data + (i * FS_BLOCK_SIZE),
+            .prev      = (i == 0) ? BLOCK_CACHE_NONE : i-1,
+            .next      = (i == count-1) ? BLOCK_CACHE_NONE : i+1,
+            .hash_next = BLOCK_CACHE_NONE,
+        };
+    }
+
+    block_cache_mru = 0;
+    block_cache_lru = count-1;
+    block_cache_dirty_blocks = 0;
+    block_cache_dirty_limit = count;
+}
+
+// Get entry index for a cached block, or BLOCK_CACHE_NONE if not cached
+uint16_t block_cache_find(const uint32_t block) {
+    uint16_t i = block_cache_buckets[block % BLOCK_CACHE_BUCKETS];
+
+    while (i != BLOCK_CACHE_NONE && block_cache[i].block != block)
+        i = block_cache[i].hash_next;
+
+    return i;
+}
+
+// Move entry to front of LRU list as the most recently used
+void block_cache_touch(const uint16_t i) {
+    block_cache_entry_t *entry = &block_cache[i];
+    if (block_cache_mru == i) return;
+
+    // Unlink
+    block_cache[entry->prev].next = entry->next;
+    if (entry->next != BLOCK_CACHE_NONE) block_cache[entry->next].prev = entry->prev;
+    else block_cache_lru = entry->prev;
+
+    // Relink at front
+    entry->prev = BLOCK_CACHE_NONE;
+    entry->next = block_cache_mru;
+    block_cache[block_cache_mru].prev = i;
+    block_cache_mru = i;
+}
+
+// Remove entry from its hash bucket chain
+void block_cache_unhash(const uint16_t i) {
+    uint16_t *link = &block_cache_buckets[block_cache[i].block % BLOCK_CACHE_BUCKETS];
+
+    while (*link != BLOCK_CACHE_NONE && *link != i)
+        link = &block_cache[*link].hash_next;
+
+    if (*link == i) *link = block_cache[i].hash_next;
+    block_cache[i].hash_next = BLOCK_CACHE_NONE;
+}
+
+// Write entry's block to disk if it's dirty
+void block_cache_write_back(const uint16_t i) {
+    block_cache_entry_t *entry = &block_cache[i];
+    if (!entry->valid || !entry->dirty) return;
+
+    entry->dirty = false;
+    block_cache_dirty_blocks--;
+    rw_sectors(SECTORS_PER_BLOCK, entry->block * SECTORS_PER_BLOCK, (uint32_t)entry->data, WRITE_WITH_RETRY);
+    block_cache_stats.write_backs++;
+}
+
+// Commit dirty blocks if they're at the limit, so they are written together
+void block_cache_check_limit(void) {
+    if (block_cache_commit && block_cache_dirty_blocks >= block_cache_dirty_limit) block_cache_commit();
+}
+
+// Get an entry for a block that isn't cached, reusing the least recently used clean entry.
+//   Dirty blocks are left for the next sync to write together; if every entry is dirty, they
+//   are committed first
+uint16_t block_cache_new_entry(const uint32_t block) {
+    if (block_cache_dirty_blocks >= block_cache_size) block_cache_check_limit();
+
+    uint16_t i = block_cache_lru;
+    while (i != BLOCK_CACHE_NONE && block_cache[i].valid && block_cache[i].dirty)
+        i = block_cache[i].prev;
+
+    if (i == BLOCK_CACHE_NONE) i = block_cache_lru;
+    block_cache_entry_t *entry = &block_cache[i];
+
+    if (entry->valid) {
+        block_cache_write_back(i);
+        block_cache_unhash(i);
+    }
+
+    entry->block = block;
+    entry->valid = true;
+    entry->dirty = false;
+
+    const uint32_t bucket = block % BLOCK_CACHE_BUCKETS;
+    entry->hash_next = block_cache_buckets[bucket];
+    block_cache_buckets[bucket] = i;
+
+    block_cache_touch(i);
+    return i;
+}
+
+// Get a block's data, reading it from disk if not cached. Pointer is good until enough
+//   other blocks are read to reuse its entry
+uint8_t *block_cache_read(const uint32_t block) {
+    uint16_t i = block_cache_find(block);
+
+    if (i != BLOCK_CACHE_NONE) {
+        block_cache_stats.hits++;
+        block_cache_touch(i);
+        return block_cache[i].data;
+    }
+
+    block_cache_stats.misses++;
+    i = block_cache_new_entry(block);
+    rw_sectors(SECTORS_PER_BLOCK, block * SECTORS_PER_BLOCK, (uint32_t)block_cache[i].data, READ_WITH_RETRY);
+
+    return block_cache[i].data;
+}
+
+// Get a block's data, all 0s and dirty, without reading it from disk; for newly used blocks
+uint8_t *block_cache_zero(const uint32_t block) {
+    uint16_t i = block_cache_find(block);
+    if (i == BLOCK_CACHE_NONE || !block_cache[i].dirty) {
+        block_cache_check_limit();
+        i = block_cache_find(block);
+    }
+
+    if (i == BLOCK_CACHE_NONE) i = block_cache_new_entry(block);
+    else block_cache_touch(i);
+
+    if (!block_cache[i].dirty) block_cache_dirty_blocks++;
+
+    memset(block_cache[i].data, 0, FS_BLOCK_SIZE);
+    block_cache[i].dirty = true;
+
+    return block_cache[i].data;
+}
+
+// Mark a cached block as changed, to write to disk later
+void block_cache_mark_dirty(const uint32_t block) {
+    const uint16_t i = block_cache_find(block);
+    if (i == BLOCK_CACHE_NONE || block_cache[i].dirty) return;
+
+    block_cache[i].dirty = true;
+    block_cache_dirty_blocks++;
+    block_cache_check_limit();   // Block's changes are synced too
+}
+
+// Write dirty cached blocks in a range of disk blocks to disk, e.g. before reading them
+//   from disk without the cache. If any are dirty, all dirty blocks are committed together
+void block_cache_sync_range(const uint32_t first_block, const uint32_t length_blocks) {
+    for (uint16_t i = 0; block_cache_commit && i < block_cache_size; i++) {
+        const block_cache_entry_t *entry = &block_cache[i];
+
+        if (entry->valid && entry->dirty &&
+            entry->block >= first_block && entry->block - first_block < length_blocks) {
+            block_cache_commit();
+            break;
+        }
+    }
+
+    for (uint16_t i = 0; i < block_cache_size; i++) {
+        if (block_cache[i].block >= first_block && block_cache[i].block - first_block < length_blocks)
+            block_cache_write_back(i);
+    }
+}
+
+// Drop cached blocks in a range of disk blocks, e.g. after writing them to disk without the cache
+void block_cache_invalidate_range(const uint32_t first_block, const uint32_t length_blocks) {
+    for (uint16_t i = 0; i < block_cache_size; i++) {
+        block_cache_entry_t *entry = &block_cache[i];
+
+        if (entry->valid && entry->block >= first_block && entry->block - first_block < length_blocks) {
+            block_cache_unhash(i);
+            if (entry->dirty) block_cache_dirty_blocks--;
+            entry->valid = false;
+            entry->dirty = false;
+        }
+    }
+}
+
+// Write all dirty cached blocks to disk
+void block_cache_sync(void) {
+    for (uint16_t i = 0; i < block_cache_size; i++)
+        block_cache_write_back(i);
+}
+
+// Hand each dirty cached block to a function, e.g. to add it to a journal transaction, and
+//   mark it clean. Block data must be written before it changes again
+void block_cache_take_dirty(void (*take)(const uint32_t block, uint8_t *data)) {
+    for (uint16_t i = 0; i < block_cache_size; i++) {
+        block_cache_entry_t *entry = &block_cache[i];
+        if (!entry->valid || !entry->dirty) continue;
+
+        entry->dirty = false;
+        block_cache_dirty_blocks--;
+        take(entry->block, entry->data);
+        block_cache_stats.write_backs++;
+    }
+}
+
+// Get # of dirty blocks in the cache
+uint32_t block_cache_dirty_count(void) {
+    return block_cache_dirty_blocks;
+}
@@ -0,0 +1,152 @@
+/*
+ * fs/defrag.h: Defragment files & directories: move all of a file's blocks into 1 run of free
+ *   blocks and rewrite its extents, so it loads with 1 disk read. Also counts how fragmented
+ *   the file system is, for the defrag command
+ */
+#pragma once
+
+#include "C/stdint.h"
+#include "C/stdbool.h"
+#include "fs/fs_impl.h"
+
+#define DEFRAG_COPY_BLOCKS 16   // Blocks copied per disk request, 64KB buffer
+#define DEFRAG_STEP_INODES 64   // Most inodes checked per background step
+
+typedef struct {
+    uint32_t files;             // # of files & directories checked
+    uint32_t fragmented;        // # of files in more than 1 extent
+    uint32_t extents;           // Total # of extents
+    uint32_t blocks;            // Total # of blocks in extents
+    uint32_t moved;             // # of files moved into 1 extent
+    uint32_t failed;            // # of fragmented files not moved: open, or no free run big enough
+} defrag_report_t;
+
+uint8_t defrag_buffer[DEFRAG_COPY_BLOCKS * FS_BLOCK_SIZE];
+uint32_t defrag_next_inode = 1;     // Next inode for fs_defrag_step() to check
+
+// Get # of extents in a file, and *blocks = total blocks in them
+uint32_t file_extent_count(const inode_t *inode, uint32_t *blocks) {
+    uint32_t count = 0;
+    extent_t extent = {0};
+
+    *blocks = 0;
+    for (; fs_file_extent(inode, count, &extent); count++) *blocks += extent.length_blocks;
+
+    return count;
+}
+
+// Copy a run of disk blocks to another place on disk, through the defrag buffer
+void defrag_copy_blocks(uint32_t from, uint32_t to, uint32_t length) {
+    while (length > 0) {
+        const uint32_t count = length < DEFRAG_COPY_BLOCKS ? length : DEFRAG_COPY_BLOCKS;
+
+        rw_sectors(count * SECTORS_PER_BLOCK, from * SECTORS_PER_BLOCK, (uint32_t)defrag_buffer, READ_WITH_RETRY);
+        rw_sectors(count * SECTORS_PER_BLOCK, to * SECTORS_PER_BLOCK, (uint32_t)defrag_buffer, WRITE_WITH_RETRY);
+
+        from += count;
+        to += count;
+        length -= count;
+    }
+}
+
+// Move a file's blocks into 1 contiguous run. The new copy is on disk before the file's
+//   extents point to it, and the extent change & freed blocks are 1 journal transaction
+// RETURNS:
+//   true if file is in 1 extent now; false if it is open, or there is no free run big enough
+bool fs_defrag_file(inode_t *inode) {
+    uint32_t blocks = 0;
+    if (file_extent_count(inode, &blocks) <= 1) return true;
+
+    if (inode->ref_count > 0) return false;     // Open file's pages could be newer than the disk
+
+    fs_sync();  // Changed cached blocks of this file, e.g. directory entries, go to disk first
+
+    uint32_t length = 0;
+    const uint32_t first = fs_alloc_blocks(0, blocks, blocks, &length);
+    if (!first) return false;
+
+    if (length < blocks) {
+        fs_free_blocks(first, length);
+        return false;   // Only shorter runs are free
+    }
+
+    // Copy file's extents in order into the new run
+    uint32_t to = first;
+    extent_t extent = {0};
+
+    for (uint32_t i = 0; fs_file_extent(inode, i, &extent); i++) {
+        defrag_copy_blocks(extent.first_block, to, extent.length_blocks);
+        to += extent.length_blocks;
+    }
+    ata_flush();
+
+    // Free old blocks & indirect extent blocks, and point the file at its new run
+    for (uint32_t i = 0; fs_file_extent(inode, i, &extent); i++)
+        fs_free_blocks(extent.first_block, extent.length_blocks);
+
+    fs_free_indirect_blocks(inode);
+
+    for (uint32_t i = 0; i < superblock.direct_extents_per_inode; i++)
+        inode->extent[i] = (extent_t){0};
+
+    inode->extent[0] = (extent_t){ .first_block = first, .length_blocks = blocks };
+    inode_mark_dirty(inode);
+
+    update_superblock();
+    fs_sync();
+    return true;
+}
+
+// Check if an inode is in use in the inode bitmap
+bool inode_in_use(const uint32_t id) {
+    return id < superblock.num_inodes && (inode_bitmap.words[id / 32] & (1 << (id % 32)));
+}
+
+// Count an inode's fragmentation in a report, and move it into 1 extent if move = true.
+//   Fragmented files are printed if print = true
+void defrag_inode(const uint32_t id, defrag_report_t *report, const bool move, const bool print) {
+    inode_t *inode = inode_get(id);
+    if (!inode) return;
+
+    uint32_t blocks = 0;
+    const uint32_t count = file_extent_count(inode, &blocks);
+
+    report->files++;
+    report->extents += count;
+    report->blocks += blocks;
+
+    if (count > 1) {
+        report->fragmented++;
+
+        if (print)
+            printf("Inode %u: %u extents, %u blocks, avg run %u blocks\r\n", id, count, blocks, blocks / count);
+
+        if (move) {
+            if (fs_defrag_file(inode)) report->moved++;
+            else report->failed++;
+        }
+    }
+
+    inode_put(inode);
+}
+
+// Check every file & directory, moving fragmented ones into 1 extent if move = true
+void fs_defrag_all(defrag_report_t *report, const bool move, const bool print) {
+    *report = (defrag_report_t){0};
+
+    for (uint32_t id = 1; id < superblock.num_inodes; id++)
+        if (inode_in_use(id)) defrag_inode(id, report, move, print);
+}
+
+// Background defrag: check the next few inodes, and move at most 1 fragmented file. Called
+//   when the system is idle
+void fs_defrag_step(void) {
+    defrag_report_t report = {0};
+
+    for (uint32_t i = 0; i < DEFRAG_STEP_INODES && report.fragmented == 0; i++) {
+        if (defrag_next_inode >= superblock.num_inodes) defrag_next_inode = 1;
+
+        if (inode_in_use(defrag_next_inode)) defrag_inode(defrag_next_inode, &report, true, false);
+        defrag_next_inode++;
+    }
+}
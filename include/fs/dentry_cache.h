@@ -0,0 +1,70 @@
+/*
+ * fs/dentry_cache.h: Cache of directory entry lookups, (parent dir inode id, name) -> inode id,
+ *   so resolving paths doesn't read directory blocks again. Names that were not found are
+ *   cached too, with inode id 0. Entries are direct mapped by hash, a new lookup replaces
+ *   whatever was in its slot
+ */
+#pragma once
+
+#include "C/stdint.h"
+#include "C/stdbool.h"
+#include "C/string.h"
+#include "fs/fs.h"
+
+#define DENTRY_CACHE_SIZE 128   // Power of 2
+
+typedef struct {
+    uint32_t parent_id;         // Directory inode id, 0 = unused entry
+    uint32_t inode_id;          // Inode id for name in directory, 0 = name not in directory
+    char name[sizeof ((dir_entry_t *)0)->name];
+} dentry_cache_entry_t;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t negative_hits;     // Hits for names not in their directory
+    uint32_t misses;
+} dentry_cache_stats_t;
+
+dentry_cache_entry_t dentry_cache[DENTRY_CACHE_SIZE];
+dentry_cache_stats_t dentry_cache_stats = {0};
+
+// Get cache slot for a parent dir & name
+dentry_cache_entry_t *dentry_cache_slot(const uint32_t parent_id, const char *name) {
+    return &dentry_cache[(dir_name_hash(name) ^ (parent_id * 2654435761u)) % DENTRY_CACHE_SIZE];
+}
+
+// Look up a name in a directory
+// RETURNS:
+//   true if cached, with *inode_id = inode id for name, or 0 if name is not in directory
+bool dentry_cache_find(const uint32_t parent_id, const char *name, uint32_t *inode_id) {
+    const dentry_cache_entry_t *entry = dentry_cache_slot(parent_id, name);
+
+    if (entry->parent_id != parent_id || strcmp(entry->name, name) != 0) {
+        dentry_cache_stats.misses++;
+        return false;
+    }
+
+    if (entry->inode_id == 0) dentry_cache_stats.negative_hits++;
+    else dentry_cache_stats.hits++;
+
+    *inode_id = entry->inode_id;
+    return true;
+}
+
+// Add result of a directory lookup, inode_id = 0 if name was not found
+void dentry_cache_add(const uint32_t parent_id, const char *name, const uint32_t inode_id) {
+    if (parent_id == 0 || strlen(name) >= sizeof dentry_cache[0].name) return;
+
+    dentry_cache_entry_t *entry = dentry_cache_slot(parent_id, name);
+    entry->parent_id = parent_id;
+    entry->inode_id = inode_id;
+    strcpy(entry->name, name);
+}
+
+// Drop cached lookup of a name in a directory, when a file is created, deleted, or renamed
+void dentry_cache_remove(const uint32_t parent_id, const char *name) {
+    dentry_cache_entry_t *entry = dentry_cache_slot(parent_id, name);
+
+    if (entry->parent_id == parent_id && !strcmp(entry->name, name))
+        entry->parent_id = 0;
+}
@@ -11,6 +11,8 @@
                             
 #define SUPERBLOCK_DISK_SECTOR 8    // Sectors 0-7 are for boot block
 
+#define BLOCK_CACHE_SIZE 64 // Kernel's metadata block cache entries, journal region holds all of them
+
 const uint8_t SECTORS_PER_BLOCK = FS_BLOCK_SIZE / FS_SECTOR_SIZE; 
 const uint32_t BITS_PER_BLOCK  = 8 * FS_BLOCK_SIZE; // 1 byte = 8 bits
 
@@ -56,8 +58,10 @@ typedef struct {
     uint32_t first_free_data_bit;           // First 0 bit in inode bitmap
     uint16_t device_number;
     uint8_t first_unreserved_inode;
+    uint32_t first_journal_block;           // Metadata journal, 0 blocks = no journal
+    uint16_t num_journal_blocks;
 
-    uint8_t padding[14];                    // Unused
+    uint8_t padding[8];                     // Unused
 } __attribute__ ((packed)) superblock_t;    // sizeof(superblock_t) = 64
 
 typedef struct {
@@ -75,9 +79,15 @@ typedef struct {
     uint32_t single_indirect_block;         // Disk block for holding more extents
     uint32_t double_indirect_block;         // Disk block for holding more extents
     uint8_t ref_count;                      // # of open uses of this file
+    uint8_t flags;                          // INODE_FLAG_*
 
-    uint8_t padding[2];                     // Unused
+    uint8_t padding;                        // Unused
 } __attribute__ ((packed)) inode_t;         // sizeof(inode_t) should = 64
+
+// Inode flags
+enum {
+    INODE_FLAG_HASH_INDEX = 0x01,   // Directory has a hashed name index in its first block
+};
                                             
 const uint8_t INODES_PER_SECTOR = FS_SECTOR_SIZE / sizeof(inode_t);
 const uint8_t INODES_PER_BLOCK = FS_BLOCK_SIZE / sizeof(inode_t);
@@ -89,6 +99,39 @@ typedef struct {
                                             
 const uint8_t DIR_ENTRIES_PER_BLOCK = FS_BLOCK_SIZE / sizeof(dir_entry_t);
 
+// Hashed directory index: block 0 of an indexed directory maps ranges of name hashes to the
+//   "leaf" blocks holding their dir_entries. Each leaf holds names with hashes from its entry's
+//   hash up to the next entry's hash. Index records start with a 0 id, so code that reads the
+//   directory linearly sees them as empty dir_entries
+typedef struct {
+    uint32_t hash;                          // Lowest name hash in leaf
+    uint32_t block;                         // Leaf's block # within the directory's data
+} __attribute__ ((packed)) dir_index_entry_t;
+
+#define DIR_INDEX_ENTRIES_PER_RECORD 7
+
+typedef struct {
+    uint32_t id;                            // Always 0
+    dir_index_entry_t entry[DIR_INDEX_ENTRIES_PER_RECORD];
+    uint32_t count;                         // 1st record only: # of index entries in use
+} __attribute__ ((packed)) dir_index_record_t;  // sizeof(dir_index_record_t) = 64 bytes
+
+#define DIR_INDEX_MAX_ENTRIES ((FS_BLOCK_SIZE / sizeof(dir_index_record_t)) * DIR_INDEX_ENTRIES_PER_RECORD)
+#define DIR_INDEX_ENTRY(records, i) \
+    ((records)[(i) / DIR_INDEX_ENTRIES_PER_RECORD].entry[(i) % DIR_INDEX_ENTRIES_PER_RECORD])
+
+// Hash a file name for the directory index (32 bit FNV-1a)
+uint32_t dir_name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t i = 0; i < sizeof ((dir_entry_t *)0)->name && name[i]; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
 typedef struct {
     uint8_t *address;           // Base virtual address file is loaded to
     int32_t offset;             // Current file position; used with seek()
@@ -96,8 +139,8 @@ typedef struct {
     uint32_t ref_count;         // Reference count, used for dup() or similar syscalls
     uint32_t flags;             // Open flags e.g. O_CREAT, O_RDONLY, O_WRONLY, O_RDWR, ...
     uint32_t pages_allocated;   // # of pages currently allocated
-                            
-    uint8_t padding[8];         // Unused
+    uint32_t next_page;         // Page a sequential reader would fault on next
+    uint32_t readahead_pages;   // Current read-ahead window, 0 = not reading sequentially
 } __attribute__ ((packed)) open_file_table_t;       // sizeof(open_file_table_t) should = 32 bytes
                                                     
 // Convert bytes to blocks
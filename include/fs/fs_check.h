@@ -0,0 +1,184 @@
+/*
+ * fs/fs_check.h: Walk a file system's superblock, bitmaps & inodes to get usage and
+ *   fragmentation stats, and check that the data bitmap matches the blocks files use.
+ *   Used by the kernel's fsstat command and by make_disk on an image file, so this only
+ *   needs fs.h; disk blocks are read with a function the caller gives
+ */
+#pragma once
+
+#include "C/stdint.h"
+#include "fs/fs.h"
+
+#define FS_CHECK_HISTOGRAM 7    // Files with 0 (empty), 1, 2, 3, 4, 5-8, 9+ extents
+
+// Where to read a file system from
+typedef struct {
+    const superblock_t *superblock;
+    const uint32_t *inode_bitmap;               // Whole inode bitmap
+    const uint32_t *data_bitmap;                // Whole data bitmap
+    uint32_t total_blocks;                      // # of disk blocks, data bitmap bits past this are ignored
+    uint8_t *(*read_block)(const uint32_t block);
+    uint32_t *seen;                             // Scratch bitmap with total_blocks bits, for blocks files use
+} fs_check_disk_t;
+
+typedef struct {
+    // Space
+    uint32_t total_blocks;
+    uint32_t free_blocks;
+    uint32_t free_runs;                         // # of runs of free blocks
+    uint32_t largest_free_run;
+
+    // Files
+    uint32_t files;
+    uint32_t dirs;
+    uint32_t extents;
+    uint32_t extent_histogram[FS_CHECK_HISTOGRAM];  // # of files & dirs by # of extents
+    uint32_t dir_blocks;
+    uint32_t dir_entries;                       // Entries in use in all directories
+    uint32_t largest_dir_entries;
+    uint32_t largest_dir_id;                    // Inode id of directory with the most entries
+
+    // Errors
+    uint32_t bad_inodes;                        // In use in inode bitmap, but inode has a different id
+    uint32_t bad_extents;                       // Extents outside of the data blocks
+    uint32_t shared_blocks;                     // Blocks used by more than 1 extent
+    uint32_t unmarked_blocks;                   // Used by a file, but free in data bitmap
+    uint32_t leaked_blocks;                     // In use in data bitmap, but no file uses them
+} fs_check_t;
+
+// Test a bit in a bitmap
+uint32_t fs_check_bit(const uint32_t *bitmap, const uint32_t bit) {
+    return bitmap[bit / 32] & (1u << (bit % 32));
+}
+
+// Count blocks of 1 extent of a file as used, and directory entries in them
+void fs_check_extent(const fs_check_disk_t *disk, fs_check_t *check, const extent_t extent,
+                     const uint32_t is_dir, uint32_t *dir_entries) {
+    check->extents++;
+
+    if (extent.first_block < disk->superblock->first_data_block ||
+        extent.first_block >= disk->total_blocks ||
+        extent.length_blocks > disk->total_blocks - extent.first_block) {
+        check->bad_extents++;
+        return;
+    }
+
+    for (uint32_t block = extent.first_block; block < extent.first_block + extent.length_blocks; block++) {
+        if (fs_check_bit(disk->seen, block)) check->shared_blocks++;
+        disk->seen[block / 32] |= 1u << (block % 32);
+
+        if (!fs_check_bit(disk->data_bitmap, block)) check->unmarked_blocks++;
+
+        if (is_dir) {
+            const dir_entry_t *entry = (dir_entry_t *)disk->read_block(block);
+
+            for (uint32_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++)
+                if (entry[i].id != 0) (*dir_entries)++;
+        }
+    }
+}
+
+// Count an indirect block as used, and the extents in it
+void fs_check_extent_block(const fs_check_disk_t *disk, fs_check_t *check, const uint32_t block,
+                           const uint32_t is_dir, uint32_t *dir_entries) {
+    // Block itself is counted like a 1 block extent, but is not one of the file's extents
+    fs_check_extent(disk, check, (extent_t){ .first_block = block, .length_blocks = 1 }, 0, 0);
+    check->extents--;
+
+    if (block < disk->superblock->first_data_block || block >= disk->total_blocks) return;
+
+    // Read block again for each extent, directory reads can reuse the caller's buffer
+    for (uint32_t i = 0; i < disk->superblock->extents_per_indirect_block; i++) {
+        const extent_t extent = ((const extent_t *)disk->read_block(block))[i];
+        if (extent.length_blocks == 0) break;
+
+        fs_check_extent(disk, check, extent, is_dir, dir_entries);
+    }
+}
+
+// Walk 1 in use inode's extents
+void fs_check_inode(const fs_check_disk_t *disk, fs_check_t *check, const inode_t inode) {
+    const superblock_t *sb = disk->superblock;
+    const uint32_t is_dir = (inode.type == FILETYPE_DIR);
+    const uint32_t extents_before = check->extents;
+    uint32_t dir_entries = 0;
+
+    for (uint32_t i = 0; i < sb->direct_extents_per_inode && inode.extent[i].length_blocks > 0; i++)
+        fs_check_extent(disk, check, inode.extent[i], is_dir, &dir_entries);
+
+    if (inode.single_indirect_block != 0)
+        fs_check_extent_block(disk, check, inode.single_indirect_block, is_dir, &dir_entries);
+
+    const uint32_t double_block = inode.double_indirect_block;
+    if (double_block != 0) {
+        // Double indirect block holds disk blocks of extents
+        fs_check_extent(disk, check, (extent_t){ .first_block = double_block, .length_blocks = 1 }, 0, 0);
+        check->extents--;
+
+        for (uint32_t i = 0; double_block >= sb->first_data_block && double_block < disk->total_blocks &&
+                             i < FS_BLOCK_SIZE / sizeof(uint32_t); i++) {
+            const uint32_t block = ((const uint32_t *)disk->read_block(double_block))[i];
+            if (block == 0) break;
+
+            fs_check_extent_block(disk, check, block, is_dir, &dir_entries);
+        }
+    }
+
+    const uint32_t count = check->extents - extents_before;
+    const uint32_t bucket = count <= 4 ? count : (count <= 8 ? 5 : 6);
+    check->extent_histogram[bucket]++;
+
+    if (is_dir) {
+        check->dirs++;
+        check->dir_blocks += bytes_to_blocks(inode.size_bytes);
+        check->dir_entries += dir_entries;
+
+        if (dir_entries > check->largest_dir_entries) {
+            check->largest_dir_entries = dir_entries;
+            check->largest_dir_id = inode.id;
+        }
+    } else {
+        check->files++;
+    }
+}
+
+// Walk the whole file system. disk->seen is cleared here
+void fs_check(const fs_check_disk_t *disk, fs_check_t *check) {
+    const superblock_t *sb = disk->superblock;
+
+    *check = (fs_check_t){0};
+    check->total_blocks = disk->total_blocks;
+
+    for (uint32_t i = 0; i < (disk->total_blocks + 31) / 32; i++) disk->seen[i] = 0;
+
+    // Boot block, superblock, bitmaps, inode blocks & journal are in use, not part of files
+    for (uint32_t block = 0; block < sb->first_data_block && block < disk->total_blocks; block++)
+        disk->seen[block / 32] |= 1u << (block % 32);
+
+    for (uint32_t id = 1; id < sb->num_inodes; id++) {
+        if (!fs_check_bit(disk->inode_bitmap, id)) continue;
+
+        const inode_t inode = ((inode_t *)disk->read_block(sb->first_inode_block + (id / INODES_PER_BLOCK)))[id % INODES_PER_BLOCK];
+
+        if (inode.id != id) {
+            check->bad_inodes++;
+            continue;
+        }
+
+        fs_check_inode(disk, check, inode);
+    }
+
+    // Free space & blocks marked in use that no file uses
+    uint32_t run = 0;
+    for (uint32_t block = 0; block < disk->total_blocks; block++) {
+        if (fs_check_bit(disk->data_bitmap, block)) {
+            if (!fs_check_bit(disk->seen, block)) check->leaked_blocks++;
+            run = 0;
+            continue;
+        }
+
+        check->free_blocks++;
+        if (run++ == 0) check->free_runs++;
+        if (run > check->largest_free_run) check->largest_free_run = run;
+    }
+}
@@ -7,189 +7,436 @@
 #include "C/stdio.h"
 #include "fs/fs.h"
 #include "disk/file_ops.h"              // rw_sectors(), etc.
-#include "sys/syscall_wrappers.h" 
+#include "fs/block_cache.h"             // block_cache_read(), etc.
+#include "fs/inode_cache.h"             // inode_get(), etc.
+#include "fs/dentry_cache.h"            // dentry_cache_find(), etc.
+#include "fs/journal.h"                 // journal_add(), etc.
+#include "sys/syscall_wrappers.h"
 
 #define MAX_PATH_SIZE 256
 
+#define BLOCK_GROUP_SIZE    1024    // Disk blocks per group for free block counts, 4MB
+#define MAX_BLOCK_GROUPS    1024    // Up to 4GB of disk blocks
+#define MAX_PREALLOC_BLOCKS 16      // Most extra blocks reserved for a growing file, 64KB
+
+#define EXTENT_CACHE_INODES  8      // Files with cached indirect extents
+#define EXTENT_CACHE_EXTENTS 64     // Indirect extents cached per file
+
+#define MAX_BITMAP_BLOCKS 32        // Blocks per bitmap kept in memory, 32 data bitmap blocks = 4GB disk
+#define WORDS_PER_BITMAP_BLOCK (FS_BLOCK_SIZE / sizeof(uint32_t))
+
 static char current_dir[512];           // "Current working directory" string, from kernel.c
-inode_t current_dir_inode;              // Inode for current working dir
-inode_t current_parent_inode;
-uint8_t temp_sector[FS_SECTOR_SIZE];    // Temporary work sector
-uint8_t temp_block[FS_BLOCK_SIZE];      // Temporary work block
-inode_t root_inode;                     // Static place to put root dir 
+inode_t *current_dir_inode;             // Inode for current working dir, held from inode_get()
+inode_t *current_parent_inode;
+inode_t *root_inode;                    // Root dir inode, stays cached
 superblock_t superblock;
 
-// Load a file from disk to memory 
+// Inode or data bitmap, kept in memory and written to disk a block at a time when changed
+typedef struct {
+    uint32_t first_block;                   // First disk block of bitmap
+    uint32_t num_blocks;                    // # of bitmap blocks in memory
+    uint32_t *words;                        // num_blocks * FS_BLOCK_SIZE bytes of bitmap
+    uint32_t dirty;                         // Bit per bitmap block changed since written to disk
+    uint16_t next_free[MAX_BITMAP_BLOCKS];  // Per block: all words before this one are full
+} fs_bitmap_t;
+
+fs_bitmap_t inode_bitmap = {0};
+fs_bitmap_t data_bitmap = {0};
+
+// Indirect extents of recently used files, flattened into a list so their indirect blocks
+//   are not read on every access
+typedef struct {
+    uint32_t inode_id;                          // 0 = unused entry
+    uint32_t count;                             // # of indirect extents cached
+    uint32_t last_used;                         // Value of extent_cache_uses when last used
+    extent_t extents[EXTENT_CACHE_EXTENTS];     // File's first indirect extents, in order
+} extent_cache_entry_t;
+
+extent_cache_entry_t extent_cache[EXTENT_CACHE_INODES];
+uint32_t extent_cache_uses = 0;
+
+// Get the disk block holding a file's indirect extent # index (0 = first extent after the
+//   direct extents), and the extent's position in that block
+// RETURNS:
+//   disk block, or 0 if the indirect block(s) for this extent are not allocated
+uint32_t indirect_extent_block(const inode_t *inode, const uint32_t index, uint32_t *position) {
+    const uint32_t per_block = superblock.extents_per_indirect_block;
+
+    if (index < per_block) {
+        // Single indirect block: extents
+        *position = index;
+        return inode->single_indirect_block;
+    }
+
+    // Double indirect block: disk blocks of extents
+    const uint32_t i = index - per_block;
+    if (inode->double_indirect_block == 0 || i / per_block >= FS_BLOCK_SIZE / sizeof(uint32_t))
+        return 0;
+
+    *position = i % per_block;
+    return ((uint32_t *)block_cache_read(inode->double_indirect_block))[i / per_block];
+}
+
+// Read a file's indirect extent through the block cache
+extent_t read_indirect_extent(const inode_t *inode, const uint32_t index) {
+    uint32_t position = 0;
+    const uint32_t block = indirect_extent_block(inode, index, &position);
+    if (block == 0) return (extent_t){0};
+
+    return ((extent_t *)block_cache_read(block))[position];
+}
+
+// Get a file's cached indirect extents, filling the least recently used entry if not cached
+extent_cache_entry_t *cached_indirect_extents(const inode_t *inode) {
+    extent_cache_entry_t *entry = &extent_cache[0];
+
+    for (uint32_t i = 0; i < EXTENT_CACHE_INODES; i++) {
+        if (extent_cache[i].inode_id == inode->id) {
+            entry = &extent_cache[i];
+            entry->last_used = ++extent_cache_uses;
+            return entry;
+        }
+        if (extent_cache[i].last_used < entry->last_used) entry = &extent_cache[i];
+    }
+
+    // Not cached, read file's indirect extents until the first empty one
+    entry->inode_id = inode->id;
+    entry->last_used = ++extent_cache_uses;
+
+    for (entry->count = 0; entry->count < EXTENT_CACHE_EXTENTS; entry->count++) {
+        const extent_t extent = read_indirect_extent(inode, entry->count);
+        if (extent.length_blocks == 0) break;
+
+        entry->extents[entry->count] = extent;
+    }
+
+    return entry;
+}
+
+// Drop a file's cached indirect extents, e.g. after they change
+void extent_cache_invalidate(const uint32_t inode_id) {
+    for (uint32_t i = 0; i < EXTENT_CACHE_INODES; i++)
+        if (extent_cache[i].inode_id == inode_id) extent_cache[i] = (extent_cache_entry_t){0};
+}
+
+// Get a file's extent # index, in order of direct extents, then single indirect and double
+//   indirect extents
+// RETURNS:
+//   false if file has no extent at index
+bool fs_file_extent(const inode_t *inode, const uint32_t index, extent_t *extent) {
+    const uint32_t direct = superblock.direct_extents_per_inode;
+
+    if (index < direct) {
+        *extent = inode->extent[index];
+    } else if (inode->single_indirect_block == 0) {
+        return false;
+    } else {
+        const extent_cache_entry_t *entry = cached_indirect_extents(inode);
+        const uint32_t i = index - direct;
+
+        if (i < entry->count)
+            *extent = entry->extents[i];
+        else if (entry->count == EXTENT_CACHE_EXTENTS)
+            *extent = read_indirect_extent(inode, i);   // Past the cached extents
+        else
+            return false;
+    }
+
+    return extent->length_blocks > 0;
+}
+
+// Load a file from disk to memory
 bool fs_load_file(inode_t *inode, uint32_t address) {
     // Read all of the file's blocks to memory
     uint32_t total_blocks = bytes_to_blocks(inode->size_bytes);
     uint32_t address_offset = 0;
 
-    // Read inode direct extents
-    for (uint32_t i = 0; i < superblock.direct_extents_per_inode && total_blocks > 0; i++) {
-        rw_sectors(inode->extent[i].length_blocks * SECTORS_PER_BLOCK,
-                   inode->extent[i].first_block * SECTORS_PER_BLOCK,
+    extent_t extent = {0};
+
+    // Read inode extents, not preallocated blocks past the end of the file
+    for (uint32_t i = 0; total_blocks > 0 && fs_file_extent(inode, i, &extent); i++) {
+        uint32_t length_blocks = extent.length_blocks;
+        if (length_blocks > total_blocks) length_blocks = total_blocks;
+
+        // Cache could have newer data for these blocks, e.g. directory entries
+        block_cache_sync_range(extent.first_block, length_blocks);
+
+        rw_sectors(length_blocks * SECTORS_PER_BLOCK,
+                   extent.first_block * SECTORS_PER_BLOCK,
                    address + address_offset,
                    READ_WITH_RETRY);
 
-        address_offset += inode->extent[i].length_blocks * FS_BLOCK_SIZE;
-        total_blocks -= inode->extent[i].length_blocks;
+        address_offset += length_blocks * FS_BLOCK_SIZE;
+        total_blocks -= length_blocks;
     }
 
-    if (total_blocks > 0) {
-        // TODO: Also load single & double indirect extents as needed
+    return true;
+}
+
+// Get the disk block holding a given block of a file, or 0 if the file has no block there
+uint32_t disk_block_for_file_block(const inode_t *inode, const uint32_t file_block) {
+    uint32_t extent_start = 0;  // File block at start of current extent
+    extent_t extent = {0};
+
+    for (uint32_t i = 0; fs_file_extent(inode, i, &extent); i++) {
+        if (file_block - extent_start < extent.length_blocks)
+            return extent.first_block + (file_block - extent_start);
+
+        extent_start += extent.length_blocks;
     }
 
+    return 0;
+}
+
+// Load 1 block of a file from disk to memory, e.g. for a page of a demand paged file on
+//   first access. Bytes past the end of the file are 0s
+bool fs_load_file_block(inode_t *inode, uint32_t address, const uint32_t file_block) {
+    const uint32_t file_offset = file_block * FS_BLOCK_SIZE;
+    const uint32_t disk_block = disk_block_for_file_block(inode, file_block);
+
+    if (disk_block == 0 || file_offset >= inode->size_bytes) {
+        // Past end of file, nothing to read
+        memset((void *)address, 0, FS_BLOCK_SIZE);
+        return true;
+    }
+
+    // Cache could have newer data for this block, e.g. directory entries
+    block_cache_sync_range(disk_block, 1);
+    rw_sectors(SECTORS_PER_BLOCK, disk_block * SECTORS_PER_BLOCK, address, READ_WITH_RETRY);
+
+    // Clear rest of the last block of the file
+    const uint32_t bytes_in_block = inode->size_bytes - file_offset;
+    if (bytes_in_block < FS_BLOCK_SIZE)
+        memset((uint8_t *)address + bytes_in_block, 0, FS_BLOCK_SIZE - bytes_in_block);
+
     return true;
 }
 
-// Save a file from memory to disk 
+// Save a file from memory to disk
 bool fs_save_file(inode_t *inode, uint32_t address) {
     // Write all of the file's blocks to disk
     uint32_t total_blocks = bytes_to_blocks(inode->size_bytes);
     uint32_t address_offset = 0;
 
-    // Write inode direct extents
-    for (uint32_t i = 0; i < superblock.direct_extents_per_inode && total_blocks > 0; i++) {
-        rw_sectors(inode->extent[i].length_blocks * SECTORS_PER_BLOCK,
-                   inode->extent[i].first_block * SECTORS_PER_BLOCK,
+    extent_t extent = {0};
+
+    // Write inode extents, not preallocated blocks past the end of the file
+    for (uint32_t i = 0; total_blocks > 0 && fs_file_extent(inode, i, &extent); i++) {
+        uint32_t length_blocks = extent.length_blocks;
+        if (length_blocks > total_blocks) length_blocks = total_blocks;
+
+        rw_sectors(length_blocks * SECTORS_PER_BLOCK,
+                   extent.first_block * SECTORS_PER_BLOCK,
                    address + address_offset,
                    WRITE_WITH_RETRY);
 
-        address_offset += inode->extent[i].length_blocks * FS_BLOCK_SIZE;
-        total_blocks -= inode->extent[i].length_blocks;
+        // Cached copies of these blocks are out of date now
+        block_cache_invalidate_range(extent.first_block, length_blocks);
+
+        address_offset += length_blocks * FS_BLOCK_SIZE;
+        total_blocks -= length_blocks;
     }
 
-    if (total_blocks > 0) {
-        // TODO: Also write single & double indirect extents as needed
+    return true;
+}
+
+// Save part of a file from memory to disk: only the blocks holding bytes [start, end) of the file
+bool fs_save_file_range(inode_t *inode, uint32_t address, const uint32_t start, const uint32_t end) {
+    if (end <= start) return true;  // Nothing to write
+
+    const uint32_t first = start / FS_BLOCK_SIZE;       // First file block to write
+    const uint32_t last  = (end - 1) / FS_BLOCK_SIZE;   // Last file block to write
+    uint32_t file_block = 0;                            // File block at start of current extent
+    extent_t extent = {0};
+
+    // Write the part of each extent that overlaps the range, as 1 run of sectors
+    for (uint32_t i = 0; file_block <= last && fs_file_extent(inode, i, &extent); i++) {
+        const uint32_t length = extent.length_blocks;
+
+        const uint32_t run_start = first > file_block ? first : file_block;
+        const uint32_t run_end   = last+1 < file_block + length ? last+1 : file_block + length;
+
+        if (run_start < run_end) {
+            const uint32_t disk_block = extent.first_block + (run_start - file_block);
+
+            rw_sectors((run_end - run_start) * SECTORS_PER_BLOCK,
+                       disk_block * SECTORS_PER_BLOCK,
+                       address + (run_start * FS_BLOCK_SIZE),
+                       WRITE_WITH_RETRY);
+
+            // Cached copies of these blocks are out of date now
+            block_cache_invalidate_range(disk_block, run_end - run_start);
+        }
+
+        file_block += length;
     }
 
     return true;
 }
 
+// Find the leaf block for a name hash in an indexed directory
+// RETURNS:
+//   leaf's block # within the directory, and its index entry # in *position
+uint32_t dir_index_leaf(const inode_t *dir, const uint32_t hash, uint32_t *position) {
+    const dir_index_record_t *records =
+        (dir_index_record_t *)block_cache_read(disk_block_for_file_block(dir, 0));
+
+    // Binary search for the last index entry with hash <= name hash
+    uint32_t low = 0, high = records[0].count;
+    while (high - low > 1) {
+        const uint32_t mid = (low + high) / 2;
+
+        if (DIR_INDEX_ENTRY(records, mid).hash <= hash) low = mid;
+        else high = mid;
+    }
+
+    *position = low;
+    return DIR_INDEX_ENTRY(records, low).block;
+}
+
+// Find the dir_entry for a name in an indexed directory
+// RETURNS:
+//   pointer to dir_entry in its cached block, or 0 if not found; *disk_block = block holding it
+dir_entry_t *dir_index_find(const inode_t *dir, const char *name, uint32_t *disk_block) {
+    uint32_t position = 0;
+    const uint32_t leaf = dir_index_leaf(dir, dir_name_hash(name), &position);
+
+    *disk_block = disk_block_for_file_block(dir, leaf);
+    dir_entry_t *dir_entry = (dir_entry_t *)block_cache_read(*disk_block);
+
+    for (uint32_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++, dir_entry++)
+        if (dir_entry->id != 0 && !strcmp(dir_entry->name, name)) return dir_entry;
+
+    return 0;
+}
+
 // Get inode for a given string/file name contained in a given directory inode
-inode_t inode_for_name_in_directory(const inode_t directory_inode, char *file_name) {
-    uint32_t total_blocks = bytes_to_blocks(directory_inode.size_bytes);
+// RETURNS:
+//   cached inode from inode_get(), to release with inode_put(); or 0 if not found
+inode_t *inode_for_name_in_directory(const inode_t *directory_inode, char *file_name) {
+    if (!directory_inode || directory_inode->type != FILETYPE_DIR) return 0;
+
+    uint32_t id = 0;
+    if (dentry_cache_find(directory_inode->id, file_name, &id)) return inode_get(id);
+
+    if (directory_inode->flags & INODE_FLAG_HASH_INDEX) {
+        // Only need to check the 1 leaf block for this name's hash
+        uint32_t disk_block = 0;
+        const dir_entry_t *dir_entry = dir_index_find(directory_inode, file_name, &disk_block);
+        id = dir_entry ? dir_entry->id : 0;
+
+        dentry_cache_add(directory_inode->id, file_name, id);
+        return inode_get(id);
+    }
+
+    uint32_t total_blocks = bytes_to_blocks(directory_inode->size_bytes);
     dir_entry_t *dir_entry = 0;
+    extent_t extent = {0};
 
-    for (uint8_t i = 0; i < superblock.direct_extents_per_inode; i++) {
+    for (uint32_t i = 0; total_blocks > 0 && fs_file_extent(directory_inode, i, &extent); i++) {
         // Search inode's extent's data blocks for file_name
-        for (uint32_t next_block = directory_inode.extent[i].first_block; 
-             next_block < directory_inode.extent[i].first_block + directory_inode.extent[i].length_blocks && 
-                total_blocks > 0;
+        for (uint32_t next_block = extent.first_block;
+             next_block < extent.first_block + extent.length_blocks && total_blocks > 0;
              next_block++, total_blocks--) {
-        
+
             // Load next block to check
-            rw_sectors(SECTORS_PER_BLOCK, 
-                       next_block*SECTORS_PER_BLOCK, 
-                       (uint32_t)temp_block, 
-                       READ_WITH_RETRY);
+            uint8_t *block = block_cache_read(next_block);
 
             uint32_t count = 0;
 
-            for (dir_entry = (dir_entry_t *)temp_block;
-                 strncmp(dir_entry->name, file_name, strlen(file_name)) != 0 && 
-                 count < DIR_ENTRIES_PER_BLOCK;
+            // Whole name has to match, not only its start, or e.g. "a" would find "abc"
+            for (dir_entry = (dir_entry_t *)block;
+                 count < DIR_ENTRIES_PER_BLOCK &&
+                 (dir_entry->id == 0 || strcmp(dir_entry->name, file_name) != 0);
                  dir_entry++, count++)
                 ;
 
-            if (dir_entry->id == 0 || strncmp(dir_entry->name, file_name, strlen(file_name)) != 0) {
+            if (count == DIR_ENTRIES_PER_BLOCK) {
                 // Did not find the file in this block, keep checking
                 continue;
             }
 
-            // Load inode for found file; 8 inode ids in 1 sector, offset from start of all
-            //   inode sectors on disk.
-            rw_sectors(1,
-                       (superblock.first_inode_block*SECTORS_PER_BLOCK) + (dir_entry->id / SECTORS_PER_BLOCK),
-                       (uint32_t)temp_sector,
-                       READ_WITH_RETRY);
-
-            // Get inode from sector
-            return *((inode_t *)temp_sector + (dir_entry->id % SECTORS_PER_BLOCK));
+            // Load inode for found file
+            dentry_cache_add(directory_inode->id, file_name, dir_entry->id);
+            return inode_get(dir_entry->id);
         }
     }
 
     // Did not find file in directory
-    return (inode_t){0};
+    dentry_cache_add(directory_inode->id, file_name, 0);
+    return 0;
 }
 
 // Get inode for last file in given path
 // e.g. /folderA/./.././fileB -> fileB's inode
-inode_t inode_from_path(char *starting_path) {
-    char *pos = (char *)starting_path;  
-    inode_t current_inode;
+// RETURNS:
+//   cached inode from inode_get(), to release with inode_put(); or 0 if not found
+inode_t *inode_from_path(char *starting_path) {
+    char *pos = (char *)starting_path;
+    inode_t *current_inode;
 
-    // Traverse path, walking down each inode and resolving relative references as needed
+    // Traverse path, walking down each inode and resolving relative references as needed;
+    //   each directory is held only until the next name in it is found
     // Special case, starting at root
     if (*pos == '/') {
         pos++;
         // Set current traversing dir to root
-        current_inode = root_inode;
+        current_inode = inode_get(root_inode->id);
     } else {
         // Not starting at root, assume starting at
         //  current directory
-        current_inode = current_dir_inode;
+        current_inode = inode_get(current_dir_inode->id);
     }
 
-    while (*pos != '\0') {
+    while (current_inode && *pos != '\0') {
         if (*pos == '/') {
             pos++; // Skip dir separator
             continue;
         }
-                           
+
         // Relative current directory
         if (pos[0] == '.' && (pos[1] == '\0' || pos[1] == '/')) {
-            pos++; 
+            pos++;
             continue;
         }
 
+        inode_t *next_inode = 0;
+
         // Relative parent directory
         if (!strncmp(pos, "..", 2) && (pos[3] == '\0' || pos[3] == '/')) {
-            current_inode = inode_for_name_in_directory(current_inode, "..");
-
+            next_inode = inode_for_name_in_directory(current_inode, "..");
             pos += 2;
-            continue;
-        }
+        } else {
+            // Not relative current/working directory, get next full name and load its inode
+            char *name = pos;
+            while (*pos != '/' && *pos != '\0') pos++;
+
+            char temp = *pos;
+            *pos = '\0';    // Set to null to properly null-terminate name string as needed
 
-        // Not relative current/working directory, get next full name and load its inode
-        char *name = pos; 
-        while (*pos != '/' && *pos != '\0') pos++; 
+            next_inode = inode_for_name_in_directory(current_inode, name);
 
-        char temp = *pos;
-        *pos = '\0';    // Set to null to properly null-terminate name string as needed
-        
-        current_inode = inode_for_name_in_directory(current_inode, name);
+            *pos = temp;    // Restore slash/other character
+        }
 
-        *pos = temp;    // Restore slash/other character
+        inode_put(current_inode);
+        current_inode = next_inode;
     }
 
     return current_inode;
 }
 
-// Get inode for a given inode(file) id
-inode_t inode_from_id(const uint32_t id) {
-    if (id == 0) return (inode_t){0};
-
-    // Load sector containing inode with given id
-    rw_sectors(1,
-               (superblock.first_inode_block*SECTORS_PER_BLOCK) + (id / INODES_PER_SECTOR),
-               (uint32_t)temp_sector,
-               READ_WITH_RETRY);
-
-    // Return inode from sector
-    return *((inode_t *)temp_sector + (id % INODES_PER_SECTOR));
-}
-
 // Get inode for parent directory of last file in given path
 // e.g. /folderA/./.././folderB/folderC -> folderB's inode
-inode_t parent_inode_from_path(char *starting_path) {
+// RETURNS:
+//   cached inode from inode_get(), to release with inode_put(); or 0 if not found
+inode_t *parent_inode_from_path(char *starting_path) {
     char *pos = (char *)starting_path;
 
     pos = strrchr(pos, '/'); // Get end of last directory in path
     if (!pos) {
         // No slashes in path, parent is assumed to be current dir
-        return current_dir_inode;
+        return inode_get(current_dir_inode->id);
     }
 
     *pos = '\0';     // Cut off last name
@@ -197,11 +444,11 @@ inode_t parent_inode_from_path(char *starting_path) {
     if (strlen(starting_path) == 0) {
         // parent was root dir/1st char in path
         *pos = '/'; // Restore root dir
-        return inode_from_id(1); // Return root inode, id = 1
+        return inode_get(1); // Return root inode, id = 1
     }
 
-    inode_t result = inode_from_path(starting_path);   // Inode for last name in path
-    *pos = '/';  // Restore last name 
+    inode_t *result = inode_from_path(starting_path);   // Inode for last name in path
+    *pos = '/';  // Restore last name
 
     return result;
 }
@@ -210,7 +457,7 @@ inode_t parent_inode_from_path(char *starting_path) {
 char *last_name_in_path(char *path) {
     char *pos = (char *)path;
     pos = strrchr(path, '/'); // End of last dir in path
-                              
+
     if (pos) {
         return pos+1;   // Start of last name in path
     } else {
@@ -223,312 +470,762 @@ fs_datetime_t current_timestamp(void) {
     return *(fs_datetime_t *)RTC_DATETIME_AREA;
 }
 
-// Generic helper function to set a given bit in a chunk
-//  of data
-void set_bit_in_disk_block(const uint32_t block, uint32_t bit) {
-    // Load block to memory
-    rw_sectors(SECTORS_PER_BLOCK, block * SECTORS_PER_BLOCK, (uint32_t)temp_block, READ_WITH_RETRY);
+// Read a bitmap into memory. Its blocks are dropped from the block cache, the copy in memory is used
+void fs_bitmap_load(fs_bitmap_t *bitmap, const uint32_t first_block, const uint32_t num_blocks,
+                    uint32_t *words) {
+    block_cache_sync_range(first_block, num_blocks);
+    block_cache_invalidate_range(first_block, num_blocks);
 
-    // Set bit in block, using correct 4 byte chunk of bits
-    bit %= BITS_PER_BLOCK; // Constrain bit number to this BITS_PER_BLOCK sized block
-    uint32_t *chunk = (uint32_t *)temp_block;
+    *bitmap = (fs_bitmap_t){ .first_block = first_block, .num_blocks = num_blocks, .words = words };
 
-    chunk[bit / 32] |= 1 << (bit % 32);
+    for (uint32_t i = 0; i < num_blocks; i++)
+        rw_sectors(SECTORS_PER_BLOCK, (first_block + i) * SECTORS_PER_BLOCK,
+                   (uint32_t)&words[i * WORDS_PER_BITMAP_BLOCK], READ_WITH_RETRY);
+}
+
+// Set up inode & data bitmaps in memory, from storage_blocks * FS_BLOCK_SIZE bytes of storage
+void fs_bitmaps_init(uint32_t *storage, const uint32_t storage_blocks) {
+    uint32_t inode_blocks = superblock.num_inode_bitmap_blocks;
+    if (inode_blocks > MAX_BITMAP_BLOCKS) inode_blocks = MAX_BITMAP_BLOCKS;
+    if (inode_blocks > storage_blocks) inode_blocks = storage_blocks;
+
+    uint32_t data_blocks = superblock.num_data_bitmap_blocks;
+    if (data_blocks > MAX_BITMAP_BLOCKS) data_blocks = MAX_BITMAP_BLOCKS;
+    if (data_blocks > storage_blocks - inode_blocks) data_blocks = storage_blocks - inode_blocks;
 
-    // Write updated block back to disk
-    rw_sectors(SECTORS_PER_BLOCK, block * SECTORS_PER_BLOCK, (uint32_t)temp_block, WRITE_WITH_RETRY);
+    fs_bitmap_load(&inode_bitmap, superblock.first_inode_bitmap_block, inode_blocks, storage);
+    fs_bitmap_load(&data_bitmap, superblock.first_data_bitmap_block, data_blocks,
+                   storage + (inode_blocks * WORDS_PER_BITMAP_BLOCK));
 }
 
-// Generic helper function to clear a given bit in a chunk of data
-void clear_bit_in_disk_block(const uint32_t block, uint32_t bit) {
-    // Load block to memory
-    rw_sectors(SECTORS_PER_BLOCK, block * SECTORS_PER_BLOCK, (uint32_t)temp_block, READ_WITH_RETRY);
+// Set or clear a bit in a bitmap
+void fs_bitmap_set(fs_bitmap_t *bitmap, const uint32_t bit, const bool in_use) {
+    const uint32_t block = bit / BITS_PER_BLOCK;
+    if (block >= bitmap->num_blocks) return;
 
-    // Set bit in block, using correct 4 byte chunk of bits
-    bit %= BITS_PER_BLOCK; // Constrain bit number to this BITS_PER_BLOCK sized block
-    uint32_t *chunk = (uint32_t *)temp_block;
+    if (in_use) {
+        bitmap->words[bit / 32] |= 1 << (bit % 32);
+    } else {
+        bitmap->words[bit / 32] &= ~(1 << (bit % 32));
 
-    chunk[bit / 32] &= ~(1 << (bit % 32));
+        // Word has a 0 bit now, search from it next time
+        const uint16_t word = (bit % BITS_PER_BLOCK) / 32;
+        if (word < bitmap->next_free[block]) bitmap->next_free[block] = word;
+    }
 
-    // Write updated block back to disk
-    rw_sectors(SECTORS_PER_BLOCK, block * SECTORS_PER_BLOCK, (uint32_t)temp_block, WRITE_WITH_RETRY);
+    bitmap->dirty |= 1 << block;
 }
 
 // Set a bit in the inode bitmap
 void set_bit_in_inode_bitmap(const uint32_t bit) {
-    set_bit_in_disk_block(superblock.first_inode_bitmap_block + (bit / BITS_PER_BLOCK),
-                          bit % BITS_PER_BLOCK);
+    fs_bitmap_set(&inode_bitmap, bit, true);
 }
 
 // Set a bit in the data bitmap
 void set_bit_in_data_bitmap(const uint32_t bit) {
-    set_bit_in_disk_block(superblock.first_data_bitmap_block + (bit / BITS_PER_BLOCK),
-                            bit % BITS_PER_BLOCK);
+    fs_bitmap_set(&data_bitmap, bit, true);
 }
 
 // Clear a bit in the inode bitmap
 void clear_bit_in_inode_bitmap(const uint32_t bit) {
-    clear_bit_in_disk_block(superblock.first_inode_bitmap_block + (bit / BITS_PER_BLOCK),
-                            bit % BITS_PER_BLOCK);
+    fs_bitmap_set(&inode_bitmap, bit, false);
 }
 
 // Clear a bit in the data bitmap
 void clear_bit_in_data_bitmap(const uint32_t bit) {
-    clear_bit_in_disk_block(superblock.first_data_bitmap_block + (bit / BITS_PER_BLOCK),
-                            bit % BITS_PER_BLOCK);
-}
-
-// Generic helper function to find the first unset bit within
-//  a chunk of data
-uint32_t find_first_free_bit_in_disk_blocks(const uint32_t start_block, const uint32_t length_blocks) {
-    for (uint32_t i = 0; i < length_blocks; i++) {
-        // Read next block to memory
-        rw_sectors(SECTORS_PER_BLOCK, 
-                   (start_block + i) * SECTORS_PER_BLOCK, 
-                   (uint32_t)temp_block, 
-                   READ_WITH_RETRY);
+    fs_bitmap_set(&data_bitmap, bit, false);
+}
 
-        const uint32_t *chunk = (uint32_t *)temp_block;
-        for (uint32_t j = 0; j < FS_BLOCK_SIZE / sizeof(uint32_t); j++) {
-           if (chunk[j] != 0xFFFFFFFF) {
-               // Found at least 1 bit that is not set/1
-               for (uint8_t k = 0; k < 32; k++) {
-                   // Check if each bit is 0, not set  
-                   if (!(chunk[j] & (1 << k))) {
-                       // Found free bit
-                       return (j*32) + k;
-                   }
-               }
-           }
+// Find the first 0 bit at or after a given bit, a word at a time, skipping the full words
+//   at the start of each bitmap block
+// RETURNS:
+//   bit #, or 0 if there are no free bits
+uint32_t fs_bitmap_find_free(fs_bitmap_t *bitmap, const uint32_t start_bit) {
+    for (uint32_t block = start_bit / BITS_PER_BLOCK; block < bitmap->num_blocks; block++) {
+        const uint32_t first_word = block * WORDS_PER_BITMAP_BLOCK;
+        const uint32_t end_word = first_word + WORDS_PER_BITMAP_BLOCK;
+
+        // Start at the hint if it's past start_bit; the hint can move up while scanning
+        //   full words from it
+        uint32_t word = first_word + bitmap->next_free[block];
+        bool from_hint = word >= start_bit / 32;
+        if (!from_hint) word = start_bit / 32;
+
+        for (; word < end_word; word++) {
+            uint32_t free_bits = ~bitmap->words[word];
+            if (word == start_bit / 32) free_bits &= 0xFFFFFFFF << (start_bit % 32);
+
+            if (free_bits) return (word * 32) + __builtin_ctz(free_bits);
+
+            if (from_hint && bitmap->words[word] == 0xFFFFFFFF)
+                bitmap->next_free[block] = word+1 - first_word;
+            else
+                from_hint = false;
         }
     }
 
     return 0;   // Could not find free bit, error
 }
 
-// Update superblock on disk
+// Add a bitmap's changed blocks to the current journal transaction
+void fs_bitmap_sync(fs_bitmap_t *bitmap) {
+    for (uint32_t i = 0; i < bitmap->num_blocks; i++) {
+        if (!(bitmap->dirty & (1 << i))) continue;
+
+        journal_add(bitmap->first_block + i, (uint8_t *)&bitmap->words[i * WORDS_PER_BITMAP_BLOCK]);
+    }
+
+    bitmap->dirty = 0;
+}
+
+// Update superblock in memory, and in its cached disk block to write with the next fs_sync()
 void update_superblock(void) {
     // Update memory with current data
-    *(superblock_t *)SUPERBLOCK_ADDRESS = superblock;   
+    *(superblock_t *)SUPERBLOCK_ADDRESS = superblock;
+
+    const uint32_t block = SUPERBLOCK_DISK_SECTOR / SECTORS_PER_BLOCK;
+    memcpy(block_cache_read(block), &superblock, sizeof superblock);
+    block_cache_mark_dirty(block);
+}
 
-    // Write updated memory to disk
-    rw_sectors(1, SUPERBLOCK_DISK_SECTOR, SUPERBLOCK_ADDRESS, WRITE_WITH_RETRY);
+bool fs_syncing = false;    // fs_sync() is running
+
+// Write all changed metadata to disk as 1 journal transaction: cached inodes, inode & data
+//   bitmaps, and cached metadata blocks incl. directories & the superblock. File data written
+//   before this is on disk after it too
+void fs_sync(void) {
+    fs_syncing = true;
+    inode_cache_sync();     // Into their cached inode blocks
+    fs_bitmap_sync(&inode_bitmap);
+    fs_bitmap_sync(&data_bitmap);
+    block_cache_take_dirty(journal_add);
+
+    // Committing flushes the drive's cache; without metadata to commit, flush it for file data
+    if (journal_count > 0) journal_commit();
+    else ata_flush();
+    fs_syncing = false;
 }
 
-// Helper function to update an inode on disk, in the inode disk blocks
-void update_inode_on_disk(const inode_t inode) {
-    rw_sectors(1, 
-               (superblock.first_inode_block * SECTORS_PER_BLOCK) + 
-                   (inode.id / INODES_PER_SECTOR),
-               (uint32_t)temp_sector,
-               READ_WITH_RETRY);
+// Block cache commit callback, for when too many cached blocks are dirty or dirty blocks are
+//   read around the cache: sync all metadata, so dirty blocks are only written home after
+//   they're in the journal. While fs_sync() writes inodes, blocks only need committing if
+//   every cache entry is dirty; then the cached blocks get a transaction of their own
+void fs_sync_cache(void) {
+    if (!fs_syncing) {
+        fs_sync();
+        return;
+    }
+
+    if (block_cache_dirty_blocks < block_cache_size) return;
+
+    block_cache_take_dirty(journal_add);
+    journal_commit();
+}
+
+// Get the most dirty cached blocks to allow before syncing: the dirty blocks and all bitmap
+//   blocks have to fit in 1 journal transaction, including the inode blocks fs_sync() writes
+//   cached inodes into; those also need clean cache entries to be read into
+uint32_t fs_dirty_block_limit(void) {
+    const uint32_t bitmap_blocks = superblock.num_inode_bitmap_blocks + superblock.num_data_bitmap_blocks;
+    const uint32_t inode_blocks = superblock.num_inode_blocks < block_cache_size / 2 ?
+                                  superblock.num_inode_blocks : block_cache_size / 2;
 
-    inode_t *tmp_inode = (inode_t *)temp_sector + (inode.id % INODES_PER_SECTOR);
-    *tmp_inode = inode;
+    uint32_t limit = journal_capacity() > bitmap_blocks ? journal_capacity() - bitmap_blocks : 1;
+    if (limit > block_cache_size) limit = block_cache_size;
 
-    rw_sectors(1, 
-               (superblock.first_inode_block * SECTORS_PER_BLOCK) + 
-                   (inode.id / INODES_PER_SECTOR),
-               (uint32_t)temp_sector,
-               WRITE_WITH_RETRY);
+    return limit > inode_blocks ? limit - inode_blocks : 1;
+}
+
+// Number of free data blocks in each group of BLOCK_GROUP_SIZE data bitmap bits, so the block
+//   allocator can skip full parts of the disk without reading their bitmap words
+uint16_t block_group_free[MAX_BLOCK_GROUPS];
+uint32_t num_block_groups = 0;      // 0 = free counts not set up yet
+uint32_t total_disk_blocks = 0;     // Data bitmap bits that are actual blocks on the disk
+
+// Get the data bitmap word holding the bit for a disk block
+uint32_t *data_bitmap_word(const uint32_t block) {
+    return &data_bitmap.words[block / 32];
+}
+
+// Check if a disk block is in use in the data bitmap
+bool data_block_in_use(const uint32_t block) {
+    return *data_bitmap_word(block) & (1 << (block % 32));
+}
+
+// Count free blocks in each group of the data bitmap, for the block allocator
+void init_block_groups(void) {
+    // Bitmap can have bits past the end of the disk
+    total_disk_blocks = data_bitmap.num_blocks * BITS_PER_BLOCK;
+    const uint32_t disk_blocks = ata_total_sectors() / SECTORS_PER_BLOCK;
+    if (disk_blocks > 0 && disk_blocks < total_disk_blocks) total_disk_blocks = disk_blocks;
+    if (total_disk_blocks > MAX_BLOCK_GROUPS * BLOCK_GROUP_SIZE) total_disk_blocks = MAX_BLOCK_GROUPS * BLOCK_GROUP_SIZE;
+
+    num_block_groups = (total_disk_blocks + BLOCK_GROUP_SIZE-1) / BLOCK_GROUP_SIZE;
+
+    for (uint32_t group = 0; group < num_block_groups; group++) {
+        block_group_free[group] = 0;
+
+        for (uint32_t block = group * BLOCK_GROUP_SIZE;
+             block < (group+1) * BLOCK_GROUP_SIZE && block < total_disk_blocks;
+             block += 32) {
+
+            // Count 0 bits in word, only for blocks on the disk
+            uint32_t free_bits = ~*data_bitmap_word(block);
+            if (total_disk_blocks - block < 32) free_bits &= (1 << (total_disk_blocks - block)) - 1;
+
+            for (; free_bits; free_bits &= free_bits-1) block_group_free[group]++;
+        }
+    }
+}
+
+// Mark a run of disk blocks as in use or free, in the data bitmap & group free counts
+void set_data_blocks_in_use(const uint32_t first_block, const uint32_t length_blocks, const bool in_use) {
+    const uint32_t bitmap_bits = data_bitmap.num_blocks * BITS_PER_BLOCK;
+
+    for (uint32_t block = first_block; block < first_block + length_blocks && block < bitmap_bits; block++) {
+        uint32_t *word = data_bitmap_word(block);
+        const uint32_t mask = 1 << (block % 32);
+
+        if (in_use == ((*word & mask) != 0)) continue;  // Already set/cleared
+
+        fs_bitmap_set(&data_bitmap, block, in_use);
+
+        if (block < total_disk_blocks) {
+            if (in_use) block_group_free[block / BLOCK_GROUP_SIZE]--;
+            else        block_group_free[block / BLOCK_GROUP_SIZE]++;
+        }
+    }
+}
+
+// Get length of the run of free blocks starting at a block, up to max_length
+uint32_t free_run_length(const uint32_t first_block, const uint32_t max_length) {
+    uint32_t length = 0;
+
+    // Count a bitmap word at a time, up to the first block in use
+    while (length < max_length && first_block + length < total_disk_blocks) {
+        const uint32_t block = first_block + length;
+        const uint32_t used_bits = *data_bitmap_word(block) >> (block % 32);
+
+        if (used_bits) {
+            length += __builtin_ctz(used_bits);
+            break;
+        }
+
+        length += 32 - (block % 32);
+    }
+
+    if (length > max_length) length = max_length;
+    if (first_block + length > total_disk_blocks) length = total_disk_blocks - first_block;
+
+    return length;
+}
+
+// Find the first run of at least min_length free blocks at or after goal, wrapping around to
+//   the first data block
+// RETURNS:
+//   first block of run or 0 if none found, and *length = run length, up to max_length
+uint32_t find_free_run(const uint32_t goal, const uint32_t min_length, const uint32_t max_length,
+                       uint32_t *length) {
+    const uint32_t first_data_block = superblock.first_data_block;
+    if (first_data_block >= total_disk_blocks) return 0;
+
+    const uint32_t span = total_disk_blocks - first_data_block;
+    uint32_t block = (goal >= first_data_block && goal < total_disk_blocks) ? goal : first_data_block;
+
+    for (uint32_t checked = 0; checked < span; ) {
+        uint32_t skip = 1;
+
+        if (block_group_free[block / BLOCK_GROUP_SIZE] == 0) {
+            // Full group, move to start of next group
+            skip = BLOCK_GROUP_SIZE - (block % BLOCK_GROUP_SIZE);
+        } else {
+            const uint32_t free_bits = ~*data_bitmap_word(block) >> (block % 32);
+
+            if (free_bits == 0) {
+                // Rest of bitmap word is in use, move to start of next word
+                skip = 32 - (block % 32);
+            } else if (free_bits & 1) {
+                *length = free_run_length(block, max_length);
+                if (*length >= min_length) return block;
+                skip = *length;
+            } else {
+                // Move to next free block in word
+                skip = __builtin_ctz(free_bits);
+            }
+        }
+
+        // Move on, wrapping around at end of disk
+        checked += skip;
+        block += skip;
+        if (block >= total_disk_blocks) block = first_data_block;
+    }
+
+    return 0;
+}
+
+// Allocate up to max_length contiguous disk blocks: the free run at goal if there is one, e.g.
+//   to grow a file in place, else the first run of at least min_length blocks after goal, else
+//   any shorter free run
+// RETURNS:
+//   first block allocated or 0 if the disk is full, and *length = # of blocks allocated
+uint32_t fs_alloc_blocks(const uint32_t goal, const uint32_t min_length, const uint32_t max_length,
+                         uint32_t *length) {
+    if (num_block_groups == 0) init_block_groups();
+
+    uint32_t first = 0;
+    *length = 0;
+
+    if (goal >= superblock.first_data_block && goal < total_disk_blocks && !data_block_in_use(goal)) {
+        first = goal;
+        *length = free_run_length(goal, max_length);
+    }
+
+    if (!first) first = find_free_run(goal, min_length, max_length, length);
+    if (!first) first = find_free_run(goal, 1, max_length, length);
+    if (!first) return 0;   // Error: disk is full
+
+    set_data_blocks_in_use(first, *length, true);
+
+    // Keep first free data bit hint up to date
+    if (superblock.first_free_data_bit >= first && superblock.first_free_data_bit < first + *length) {
+        uint32_t unused = 0;
+        superblock.first_free_data_bit = find_free_run(first + *length, 1, 1, &unused);
+    }
+
+    return first;
+}
+
+// Free a run of disk blocks
+void fs_free_blocks(const uint32_t first_block, const uint32_t length_blocks) {
+    if (length_blocks == 0) return;
+    if (num_block_groups == 0) init_block_groups();
+
+    set_data_blocks_in_use(first_block, length_blocks, false);
+
+    // Cached copies of freed blocks must not be written back over the blocks' next use
+    block_cache_invalidate_range(first_block, length_blocks);
+    journal_revoke(first_block, length_blocks);
+
+    if (first_block < superblock.first_free_data_bit || superblock.first_free_data_bit == 0)
+        superblock.first_free_data_bit = first_block;
+}
+
+// Allocate & zero a block for a file's indirect extents
+// RETURNS:
+//   disk block, or 0 if disk is full
+uint32_t alloc_indirect_block(void) {
+    uint32_t length = 0;
+    const uint32_t block = fs_alloc_blocks(superblock.first_free_data_bit, 1, 1, &length);
+
+    if (block) block_cache_zero(block);
+    return block;
+}
+
+// Set a file's extent # index, allocating indirect blocks as needed
+// RETURNS:
+//   false if the file can't have more extents, or the disk is full
+bool fs_set_file_extent(inode_t *inode, const uint32_t index, const extent_t extent) {
+    const uint32_t direct = superblock.direct_extents_per_inode;
+    const uint32_t per_block = superblock.extents_per_indirect_block;
+
+    if (index < direct) {
+        inode->extent[index] = extent;
+        return true;
+    }
+
+    extent_cache_invalidate(inode->id);
+
+    const uint32_t i = index - direct;
+    if (i >= per_block) {
+        // Double indirect block: disk blocks of extents
+        const uint32_t pointer = (i - per_block) / per_block;
+        if (pointer >= FS_BLOCK_SIZE / sizeof(uint32_t)) return false; // Out of extents
+
+        if (inode->double_indirect_block == 0) {
+            inode->double_indirect_block = alloc_indirect_block();
+            if (inode->double_indirect_block == 0) return false;
+        }
+
+        if (((uint32_t *)block_cache_read(inode->double_indirect_block))[pointer] == 0) {
+            const uint32_t block = alloc_indirect_block();
+            if (block == 0) return false;
+
+            ((uint32_t *)block_cache_read(inode->double_indirect_block))[pointer] = block;
+            block_cache_mark_dirty(inode->double_indirect_block);
+        }
+    } else if (inode->single_indirect_block == 0) {
+        // Single indirect block: extents
+        inode->single_indirect_block = alloc_indirect_block();
+        if (inode->single_indirect_block == 0) return false;
+    }
+
+    uint32_t position = 0;
+    const uint32_t block = indirect_extent_block(inode, i, &position);
+
+    ((extent_t *)block_cache_read(block))[position] = extent;
+    block_cache_mark_dirty(block);
+    return true;
+}
+
+// Free a file's indirect extent blocks, when it has no more indirect extents
+void fs_free_indirect_blocks(inode_t *inode) {
+    if (inode->double_indirect_block != 0) {
+        for (uint32_t i = 0; i < FS_BLOCK_SIZE / sizeof(uint32_t); i++) {
+            const uint32_t block = ((uint32_t *)block_cache_read(inode->double_indirect_block))[i];
+            if (block != 0) fs_free_blocks(block, 1);
+        }
+
+        fs_free_blocks(inode->double_indirect_block, 1);
+        inode->double_indirect_block = 0;
+    }
+
+    if (inode->single_indirect_block != 0) {
+        fs_free_blocks(inode->single_indirect_block, 1);
+        inode->single_indirect_block = 0;
+    }
+
+    extent_cache_invalidate(inode->id);
+}
+
+// Add disk blocks to a file's extents until it has at least blocks_needed blocks. Blocks right
+//   after the file's last block are used when free, to keep the file in few extents. Growing
+//   files can get extra preallocated blocks, released again by fs_trim_file()
+bool fs_grow_file(inode_t *inode, const uint32_t blocks_needed, const bool preallocate) {
+    uint32_t blocks = 0;
+    uint32_t count = 0;         // # of extents in use
+    extent_t last = {0};        // Last extent in use
+    extent_t extent = {0};
+
+    for (; fs_file_extent(inode, count, &extent); count++) {
+        blocks += extent.length_blocks;
+        last = extent;
+    }
+
+    if (blocks >= blocks_needed) return true;
+
+    // Preallocate as many blocks as the file has, up to a limit
+    uint32_t extra = 0;
+    if (preallocate) extra = blocks < MAX_PREALLOC_BLOCKS ? blocks : MAX_PREALLOC_BLOCKS;
+
+    while (blocks < blocks_needed) {
+        const uint32_t wanted = blocks_needed - blocks;
+        const uint32_t goal = (count > 0) ? last.first_block + last.length_blocks
+                                          : superblock.first_free_data_bit;
+        uint32_t length = 0;
+        const uint32_t first = fs_alloc_blocks(goal, wanted, wanted + extra, &length);
+        if (!first) return false;   // Error: disk is full
+
+        extra = 0;
+
+        if (count > 0 && first == goal) {
+            last.length_blocks += length;   // Grow last extent in place
+            fs_set_file_extent(inode, count-1, last);
+        } else {
+            last = (extent_t){ .first_block = first, .length_blocks = length };
+
+            if (!fs_set_file_extent(inode, count, last)) {
+                // Error: out of extents or disk is full
+                fs_free_blocks(first, length);
+                return false;
+            }
+            count++;
+        }
+
+        blocks += length;
+    }
+
+    update_superblock();
+    return true;
+}
+
+// Free blocks past the end of a file's data, e.g. preallocated blocks it did not use. Files
+//   keep at least 1 block
+// RETURNS:
+//   true if the file's extents changed
+bool fs_trim_file(inode_t *inode) {
+    uint32_t keep = bytes_to_blocks(inode->size_bytes);
+    if (keep == 0) keep = 1;
+
+    uint32_t blocks = 0;
+    uint32_t count = 0;
+    bool trimmed = false;
+    extent_t extent = {0};
+
+    for (; fs_file_extent(inode, count, &extent); count++) blocks += extent.length_blocks;
+
+    // Go from the last extent back, so cleared extents never come before extents still to check
+    for (uint32_t i = count; i > 0 && blocks > keep; i--) {
+        fs_file_extent(inode, i-1, &extent);
+        const uint32_t length = extent.length_blocks;
+        const uint32_t start = blocks - length;     // File block at start of this extent
+        const uint32_t used = (keep > start) ? keep - start : 0;
+
+        fs_free_blocks(extent.first_block + used, length - used);
+        extent.length_blocks = used;
+        if (used == 0) extent.first_block = 0;
+        fs_set_file_extent(inode, i-1, extent);
+
+        blocks = start;
+        trimmed = true;
+    }
+
+    // Indirect blocks are not needed if all extents fit in the inode again
+    if (trimmed && !fs_file_extent(inode, superblock.direct_extents_per_inode, &extent))
+        fs_free_indirect_blocks(inode);
+
+    if (trimmed) update_superblock();
+    return trimmed;
+}
+
+// Split a full leaf block of an indexed directory in 2, moving entries with the upper half of
+//   its name hashes to a new block at the end of the directory
+// RETURNS:
+//   false if the leaf can't be split, or the index or disk is full
+bool dir_index_split(inode_t *dir, const uint32_t leaf, const uint32_t position) {
+    const uint32_t index_block = disk_block_for_file_block(dir, 0);
+    if (((dir_index_record_t *)block_cache_read(index_block))[0].count >= DIR_INDEX_MAX_ENTRIES)
+        return false;
+
+    // Sort leaf's name hashes to split at the median
+    const uint32_t leaf_block = disk_block_for_file_block(dir, leaf);
+    dir_entry_t *entries = (dir_entry_t *)block_cache_read(leaf_block);
+    uint32_t hashes[DIR_ENTRIES_PER_BLOCK];
+
+    for (uint32_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        const uint32_t hash = dir_name_hash(entries[i].name);
+        uint32_t j = i;
+
+        for (; j > 0 && hashes[j-1] > hash; j--) hashes[j] = hashes[j-1];
+        hashes[j] = hash;
+    }
+
+    // Both halves need at least 1 entry, names with the same hash stay together
+    uint32_t split = DIR_ENTRIES_PER_BLOCK / 2;
+    while (split < DIR_ENTRIES_PER_BLOCK && hashes[split] == hashes[0]) split++;
+    if (split == DIR_ENTRIES_PER_BLOCK) return false;   // All names have the same hash
+    const uint32_t split_hash = hashes[split];
+
+    // Add new leaf block at end of directory
+    const uint32_t new_leaf = bytes_to_blocks(dir->size_bytes);
+    if (!fs_grow_file(dir, new_leaf + 1, false)) return false;
+
+    dir->size_bytes += FS_BLOCK_SIZE;
+    dir->size_sectors = bytes_to_sectors(dir->size_bytes);
+
+    const uint32_t new_block = disk_block_for_file_block(dir, new_leaf);
+    dir_entry_t *new_entries = (dir_entry_t *)block_cache_zero(new_block);
+    entries = (dir_entry_t *)block_cache_read(leaf_block);
+
+    for (uint32_t i = 0, moved = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        if (dir_name_hash(entries[i].name) < split_hash) continue;
+
+        new_entries[moved++] = entries[i];
+        memset(&entries[i], 0, sizeof(dir_entry_t));
+    }
+
+    block_cache_mark_dirty(leaf_block);
+    block_cache_mark_dirty(new_block);
+
+    // Add new leaf to index, after the leaf that was split
+    dir_index_record_t *records = (dir_index_record_t *)block_cache_read(index_block);
+
+    for (uint32_t i = records[0].count; i > position+1; i--)
+        DIR_INDEX_ENTRY(records, i) = DIR_INDEX_ENTRY(records, i-1);
+
+    DIR_INDEX_ENTRY(records, position+1) = (dir_index_entry_t){ .hash = split_hash, .block = new_leaf };
+    records[0].count++;
+    block_cache_mark_dirty(index_block);
+
+    return true;
+}
+
+// Add a dir_entry to an indexed directory, in the leaf block for its name hash. If the leaf is
+//   full and can't be split, the directory drops its index and is used as a linear directory
+// RETURNS:
+//   false if the entry was not added, and the directory is no longer indexed
+bool dir_index_add(inode_t *dir, const dir_entry_t *new_entry) {
+    const uint32_t hash = dir_name_hash(new_entry->name);
+
+    // After 1 split, both halves of the leaf have space
+    for (uint32_t tries = 0; tries < 2; tries++) {
+        uint32_t position = 0;
+        const uint32_t leaf = dir_index_leaf(dir, hash, &position);
+        const uint32_t leaf_block = disk_block_for_file_block(dir, leaf);
+        dir_entry_t *dir_entry = (dir_entry_t *)block_cache_read(leaf_block);
+
+        for (uint32_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++, dir_entry++) {
+            if (dir_entry->id != 0) continue;
+
+            *dir_entry = *new_entry;
+            block_cache_mark_dirty(leaf_block);
+            return true;
+        }
+
+        if (!dir_index_split(dir, leaf, position)) break;
+    }
+
+    dir->flags &= ~INODE_FLAG_HASH_INDEX;
+    return false;
 }
 
 // Create a new file in the filesystem given a file path
 // including: new inode, updating inode bitmap blocks, data bitmap blocks,
 // inode blocks, and data blocks for new file. Will probably need to also
 // update superblock
-inode_t fs_create_file(char *path) {
-    // Disallow creating files with special names 
-    if (!memcmp(path, ".", 2)  || 
+// RETURNS:
+//   new file's cached inode from inode_get(), to release with inode_put(); or 0 on error
+inode_t *fs_create_file(char *path) {
+    // Disallow creating files with special names
+    if (!memcmp(path, ".", 2)  ||
         !memcmp(path, "..", 3) ||
         !memcmp(path, "/", 2))
-        return (inode_t){0};
+        return 0;
 
-    // Get parent directory of file at path
-    inode_t parent_inode = parent_inode_from_path(path);
-
-    if (parent_inode.id == 0) 
-        return (inode_t){0};  // Did not find containing dir, error
-                              
     char *file_name = last_name_in_path(path);  // Will use later for dir_entry->name
-    if (!file_name) return (inode_t){0};        // No final name in path or other error
+    if (!file_name) return 0;                   // No final name in path or other error
 
-    // Make new inode for file
-    inode_t new_inode = {0};
+    // Get parent directory of file at path
+    inode_t *parent_inode = parent_inode_from_path(path);
 
-    // Get next free inode bit, use as new inode.id
-    new_inode.id = superblock.first_free_inode_bit;
+    if (!parent_inode)
+        return 0;   // Did not find containing dir, error
+
+    // Get next free inode bit, use as new inode's id
+    const uint32_t id = superblock.first_free_inode_bit;
+    inode_t *new_inode = inode_get(id);
+    if (!new_inode) {
+        inode_put(parent_inode);
+        return 0;   // Error: no free inodes, or all cached inodes are in use
+    }
 
     // Set inode bit as in use in inode bitmap blocks
-    set_bit_in_disk_block(superblock.first_inode_bitmap_block + (new_inode.id / BITS_PER_BLOCK), 
-                          new_inode.id);
+    set_bit_in_inode_bitmap(id);
+
+    // Find next free inode bit, this updates superblock
+    superblock.first_free_inode_bit = fs_bitmap_find_free(&inode_bitmap, id);
+
+    // Make new inode for file, in the inode cache
+    *new_inode = (inode_t){ .id = id };
+    new_inode->type = FILETYPE_FILE;
+    new_inode->last_modified_timestamp = current_timestamp();
+
+    // Allocate first data block for file
+    if (!fs_grow_file(new_inode, 1, false)) {
+        // Error: disk is full
+        inode_cache_drop(id);
+        clear_bit_in_inode_bitmap(id);
+        superblock.first_free_inode_bit = id;
+        inode_put(parent_inode);
+        return 0;
+    }
 
-    // Find next free inode bit, this updates superblock 
-    superblock.first_free_inode_bit = find_first_free_bit_in_disk_blocks(superblock.first_inode_bitmap_block,
-                                                                         superblock.num_inode_bitmap_blocks);
-    new_inode.type = FILETYPE_FILE;
-    new_inode.last_modified_timestamp = current_timestamp();
+    // Inode is written to its inode block with other cached metadata
+    inode_mark_dirty(new_inode);
 
-    // Get next free data bit, use as extent[0].first_block value
-    new_inode.extent[0].first_block = superblock.first_free_data_bit;
-    new_inode.extent[0].length_blocks = 1;
+    // Name may be cached as not found
+    dentry_cache_remove(parent_inode->id, file_name);
 
-    // Set data bit as in use in data bitmap blocks
-    set_bit_in_disk_block(superblock.first_data_bitmap_block + (superblock.first_free_data_bit / BITS_PER_BLOCK), 
-                          superblock.first_free_data_bit);
+    // Indexed directory: add dir_entry to the leaf block for its name, size is kept in whole blocks
+    if (parent_inode->flags & INODE_FLAG_HASH_INDEX) {
+        dir_entry_t new_dir_entry = { .id = id };
+        strcpy(new_dir_entry.name, file_name);
 
-    // Find & set next free data bit, this updates superblock
-    superblock.first_free_data_bit = find_first_free_bit_in_disk_blocks(superblock.first_data_bitmap_block,
-                                                                         superblock.num_data_bitmap_blocks);
+        const bool added = dir_index_add(parent_inode, &new_dir_entry);
+        parent_inode->last_modified_timestamp = current_timestamp();
+        inode_mark_dirty(parent_inode);
 
-    // Update inode blocks for new file/inode
-    update_inode_on_disk(new_inode);
+        if (added) goto updated_parent;
+    }
 
     // Update fs info for parent directory inode
     // Update data bitmap blocks for new file/inode in parent dir,
     //   if it takes up another block of data from adding new dir_entry
-    const uint32_t current_blocks = bytes_to_blocks(parent_inode.size_bytes);
-    const uint32_t new_blocks = bytes_to_blocks(parent_inode.size_bytes + sizeof(dir_entry_t));
+    const uint32_t current_blocks = bytes_to_blocks(parent_inode->size_bytes);
+    const uint32_t new_blocks = bytes_to_blocks(parent_inode->size_bytes + sizeof(dir_entry_t));
 
     if (new_blocks > current_blocks) {
-        // TODO: Abstract this code out into a general helper function,
-        //   as there is more than 1 place this logic can be used,
-        //   e.g. adding an additional block for files being written to in
-        //     write() syscall
-
         // TODO: Add new file dir_entry data in new block being added, vs. at first found location
         //   in dir's data blocks
-        
-        // Find the end of the last used extent's data blocks in parent inode
-        uint32_t last_used_block = 0;   // Start of last used area on disk for file data
-        uint8_t last_used_extent = 0;
-        for (last_used_extent = 0; last_used_extent < superblock.direct_extents_per_inode; last_used_extent++) {
-            if (parent_inode.extent[last_used_extent].first_block != 0)
-                last_used_block = (parent_inode.extent[last_used_extent].first_block + 
-                                   parent_inode.extent[last_used_extent].length_blocks) - 1;
-        }
-
-        // TODO: Also check single and double indirect extents
-
-        // Check if next block at end of extent's data is available
-        // Convert bit to byte to sector
-        const uint32_t bit_to_check = last_used_block+1;    // 1 based indexing
-        const uint32_t data_bitmap_sector = ((bit_to_check) / 8) / FS_SECTOR_SIZE;
-        rw_sectors(1, 
-                   (superblock.first_data_bitmap_block * SECTORS_PER_BLOCK) + data_bitmap_sector,
-                   (uint32_t)temp_sector,
-                   READ_WITH_RETRY);
-        
-        // Set new bit/data block if NOT in use
-        if (!(temp_sector[bit_to_check / 8] & (1 << (bit_to_check % 8)))) {
-            parent_inode.extent[last_used_extent].length_blocks++;
-            temp_sector[bit_to_check / 8] |= (1 << (bit_to_check % 8));
-
-            rw_sectors(1, 
-                       (superblock.first_data_bitmap_block * SECTORS_PER_BLOCK) + data_bitmap_sector,
-                       (uint32_t)temp_sector,
-                       WRITE_WITH_RETRY);
-        } else {
-            // Find a new data bitmap bit for a new data block,
-            //   and add new extent to parent_inode's extents, first block = new data bit found,
-            //   length_blocks = 1
-            // Add to next direct extent if available
-            if (last_used_extent < superblock.direct_extents_per_inode-1) {
-                last_used_extent++;
-                parent_inode.extent[last_used_extent].first_block = superblock.first_free_data_bit;
-                parent_inode.extent[last_used_extent].length_blocks = 1;
-            } else {
-                // TODO: Use single or double indirect extents
-            }
-
-            // Set data bit as in use in data bitmap blocks
-            set_bit_in_disk_block(superblock.first_data_bitmap_block + (superblock.first_free_data_bit / BITS_PER_BLOCK), 
-                                  superblock.first_free_data_bit);
-
-            superblock.first_free_data_bit = find_first_free_bit_in_disk_blocks(superblock.first_data_bitmap_block,
-                                                                                superblock.num_data_bitmap_blocks);
-        }
+        if (!fs_grow_file(parent_inode, new_blocks, false)) goto error;   // Error: disk is full
 
         // Initialize new data block on disk so that checking for free dir_entry space works later
-        const uint32_t block_to_use = (parent_inode.extent[last_used_extent].first_block +
-                                       parent_inode.extent[last_used_extent].length_blocks) - 1;
-
-        rw_sectors(SECTORS_PER_BLOCK,
-                   block_to_use * SECTORS_PER_BLOCK,
-                   (uint32_t)temp_block,
-                   READ_WITH_RETRY);
-
-        memset(temp_block, 0, sizeof temp_block);   // Init block to all 0s
-
-        rw_sectors(SECTORS_PER_BLOCK,
-                   block_to_use * SECTORS_PER_BLOCK,
-                   (uint32_t)temp_block,
-                   WRITE_WITH_RETRY);
+        block_cache_zero(disk_block_for_file_block(parent_inode, new_blocks-1));   // Init block to all 0s
     }
 
     // Update remaining parent_inode data
-    parent_inode.size_bytes += sizeof(dir_entry_t);
-    parent_inode.size_sectors = bytes_to_sectors(parent_inode.size_bytes);
-    parent_inode.last_modified_timestamp = current_timestamp();
+    parent_inode->size_bytes += sizeof(dir_entry_t);
+    parent_inode->size_sectors = bytes_to_sectors(parent_inode->size_bytes);
+    parent_inode->last_modified_timestamp = current_timestamp();
 
     // Update inode blocks for parent_dir inode
-    update_inode_on_disk(parent_inode);
-    
+    inode_mark_dirty(parent_inode);
+
     // Update data block for parent_inode, by adding new dir_entry for new file name and id
     //   use the first empty dir_entry available, or end of list
-    const uint32_t total_entries = parent_inode.size_bytes / sizeof(dir_entry_t);
+    const uint32_t total_entries = parent_inode->size_bytes / sizeof(dir_entry_t);
     uint32_t num_entries = 0;
     dir_entry_t *tmp_dir_entry = 0;
-    bool wrote_data = false;  
+    bool wrote_data = false;
+
+    extent_t tmp_extent = {0};
 
-    for (uint8_t i = 0; i < superblock.direct_extents_per_inode && num_entries < total_entries; i++) {
-        extent_t tmp_extent = parent_inode.extent[i];
+    for (uint32_t i = 0; num_entries < total_entries && fs_file_extent(parent_inode, i, &tmp_extent); i++) {
         for (uint32_t j = tmp_extent.first_block; j < tmp_extent.first_block + tmp_extent.length_blocks; j++) {
-            rw_sectors(SECTORS_PER_BLOCK, 
-                       j * SECTORS_PER_BLOCK,
-                       (uint32_t)temp_block,
-                       READ_WITH_RETRY);
+            uint8_t *block = block_cache_read(j);
 
             uint8_t entries_in_block = 0;
-            for (tmp_dir_entry = (dir_entry_t *)temp_block; 
-                 num_entries < total_entries && entries_in_block < DIR_ENTRIES_PER_BLOCK; 
+            for (tmp_dir_entry = (dir_entry_t *)block;
+                 num_entries < total_entries && entries_in_block < DIR_ENTRIES_PER_BLOCK;
                  tmp_dir_entry++, entries_in_block++) {
 
                 if (tmp_dir_entry->id != 0) num_entries++;
                 else {
                     // Found empty spot, add new file info here
-                    tmp_dir_entry->id = new_inode.id;
+                    tmp_dir_entry->id = id;
                     strcpy(tmp_dir_entry->name, file_name);
-
-                    rw_sectors(SECTORS_PER_BLOCK, 
-                               j * SECTORS_PER_BLOCK,
-                               (uint32_t)temp_block,
-                               WRITE_WITH_RETRY);
+                    block_cache_mark_dirty(j);
 
                     wrote_data = true;
                     goto done;          // End loops early
                 }
             }
-        } 
+        }
     }
 
-done:   
-    if (!wrote_data) {  
-        // TODO: Check single and double indirect extents
+done:
+    if (!wrote_data) {
+        // Error: no empty dir_entry found in dir's data blocks, undo parent's new size
+        parent_inode->size_bytes -= sizeof(dir_entry_t);
+        parent_inode->size_sectors = bytes_to_sectors(parent_inode->size_bytes);
+        fs_trim_file(parent_inode);
+        goto error;
     }
 
-    // Update current dir inode and root dir inode, in case new file 
-    //   was added to either
-    if (current_dir_inode.id == parent_inode.id)
-        current_dir_inode = parent_inode;
-
-    if (root_inode.id == parent_inode.id)
-        root_inode = parent_inode;
+updated_parent:
+    inode_put(parent_inode);
 
     // Update superblock info, at least for inode/data bitmap info
     update_superblock();
-    
+
     return new_inode;
+
+error:
+    // Free new file's data block and inode, no dir_entry points to them. Dropping the inode
+    //   from the cache drops this reference to it too
+    for (uint32_t i = 0; fs_file_extent(new_inode, i, &tmp_extent); i++)
+        fs_free_blocks(tmp_extent.first_block, tmp_extent.length_blocks);
+
+    inode_cache_drop(id);
+    memset(inode_in_block(id), 0, sizeof(inode_t));
+    block_cache_mark_dirty(superblock.first_inode_block + (id / INODES_PER_BLOCK));
+
+    clear_bit_in_inode_bitmap(id);
+    if (id < superblock.first_free_inode_bit || superblock.first_free_inode_bit == 0)
+        superblock.first_free_inode_bit = id;
+
+    inode_put(parent_inode);
+    update_superblock();
+    return 0;
 }
 
 // Read a given directory's file data, and print to screen
@@ -536,25 +1233,26 @@ bool print_dir(int argc, char **argv) {
     char *path = (argc == 1) ? current_dir : argv[1];
     if (!path) return false;
 
-    const inode_t dir = inode_from_path(path);
-    if (dir.id == 0) return false;
+    inode_t *dir = inode_from_path(path);
+    if (!dir) return false;
 
-    const uint32_t total_entries = dir.size_bytes / sizeof(dir_entry_t);
+    if (dir->type != FILETYPE_DIR) {
+        inode_put(dir);
+        return false;
+    }
+
+    const uint32_t total_entries = dir->size_bytes / sizeof(dir_entry_t);
     uint32_t num_entries = 0;
     dir_entry_t *dir_entry = 0;
 
-    if (dir.type != FILETYPE_DIR) return false;
-
     // Load dir's file data
-    for (uint8_t i = 0; i < superblock.direct_extents_per_inode; i++) {
-        for (uint32_t j = dir.extent[i].first_block; j < dir.extent[i].first_block + dir.extent[i].length_blocks; j++) {
-            rw_sectors(SECTORS_PER_BLOCK,
-                       j * SECTORS_PER_BLOCK,
-                       (uint32_t)temp_block,
-                       READ_WITH_RETRY);
+    extent_t extent = {0};
+    for (uint32_t i = 0; fs_file_extent(dir, i, &extent); i++) {
+        for (uint32_t j = extent.first_block; j < extent.first_block + extent.length_blocks; j++) {
+            uint8_t *block = block_cache_read(j);
 
             uint8_t entries_in_block = 0;
-            for (dir_entry = (dir_entry_t *)temp_block; 
+            for (dir_entry = (dir_entry_t *)block;
                  num_entries < total_entries && entries_in_block < DIR_ENTRIES_PER_BLOCK;
                  entries_in_block++, dir_entry++) {
 
@@ -562,22 +1260,17 @@ bool print_dir(int argc, char **argv) {
                     num_entries++;
 
                     // Get inode info for file
-                    rw_sectors(1,
-                               (superblock.first_inode_block * SECTORS_PER_BLOCK) + 
-                                   (dir_entry->id / INODES_PER_SECTOR),
-                               (uint32_t)temp_sector,
-                               READ_WITH_RETRY);
-
-                    inode_t *inode = (inode_t *)temp_sector + (dir_entry->id % INODES_PER_SECTOR);
+                    inode_t *inode = inode_get(dir_entry->id);
+                    if (!inode) continue;
 
                     // Name/directory type
-                    printf("\r\n%-20s%-5s ", 
-                           dir_entry->name, 
+                    printf("\r\n%-20s%-5s ",
+                           dir_entry->name,
                            inode->type == FILETYPE_DIR ? "[DIR]" : "");
 
                     // Size, date/time, reference count
-                    printf("%-10d %.2d-%.2d-%d %.2d:%.2d:%.2d  %d", 
-                           inode->size_bytes, 
+                    printf("%-10d %.2d-%.2d-%d %.2d:%.2d:%.2d  %d",
+                           inode->size_bytes,
 
                            inode->last_modified_timestamp.month,
                            inode->last_modified_timestamp.day,
@@ -587,13 +1280,14 @@ bool print_dir(int argc, char **argv) {
                            inode->last_modified_timestamp.second,
 
                            inode->ref_count);
+
+                    inode_put(inode);
                 }
             }
         }
     }
 
-    // TODO: Also load single/double indirect extents for inode
-
+    inode_put(dir);
     return true;
 }
 
@@ -606,7 +1300,7 @@ bool fs_make_dir(int32_t argc, char *argv[]) {
     // TODO: Add error if file doesn't exist and not using flag "-p" or similar
 
     // TODO: Create multiple directories in path if not exist?
-    // e.g.: mkdir /multiple/dirs/for/new/path 
+    // e.g.: mkdir /multiple/dirs/for/new/path
 
     // if (!strncmp(argv[1], "-p", 3) {
     //     // Make intermediate "parent" directories; Don't error if exists,
@@ -619,13 +1313,14 @@ bool fs_make_dir(int32_t argc, char *argv[]) {
     //         if (*pos != '/') break;
     //         *pos = '/0';     // End current dir path with null
     //
-    //         // Create new dir if not exists; 
+    //         // Create new dir if not exists;
     //         //   This function is new and does what fs_make_dir does,
     //         //     but is a callee that does the actual work.
     //         //   Could also put this code within this function anyway,
     //         //     as an alternative?
-    //         inode_t inode = inode_from_path(path);
-    //         if (inode.id == 0 && !fs_make_dir_internal(path)) return false; 
+    //         inode_t *inode = inode_from_path(path);
+    //         inode_put(inode);
+    //         if (!inode && !fs_make_dir_internal(path)) return false;
     //         *pos++ = '/';    // Restore path separator, and move on to next dir
     //     }
     // }
@@ -636,36 +1331,32 @@ bool fs_make_dir(int32_t argc, char *argv[]) {
 
     // Grab this new directory's inode and its containing directory's inode
     //   for . and .. dir_entry's
-    inode_t dir_inode = inode_from_path(path);
-    inode_t parent_inode = parent_inode_from_path(path);
+    inode_t *dir_inode = inode_from_path(path);
+    inode_t *parent_inode = parent_inode_from_path(path);
+
+    if (!dir_inode || !parent_inode) {
+        inode_put(dir_inode);
+        inode_put(parent_inode);
+        close(fd);
+        return false;
+    }
 
     // Change filetype of new file to DIR
-    dir_inode.type = FILETYPE_DIR;
+    dir_inode->type = FILETYPE_DIR;
+    inode_mark_dirty(dir_inode);
 
-    // Write default dir entries for . and ..
+    // Write default dir entries for . and .., this updates the size of the directory
     // "." = this directory itself
-    dir_entry_t dir_entry = { .id = dir_inode.id, .name = "." };
+    dir_entry_t dir_entry = { .id = dir_inode->id, .name = "." };
     write(fd, &dir_entry, sizeof dir_entry);
 
     // ".." = parent directory, which contains this new directory
-    dir_entry.id = parent_inode.id;
+    dir_entry.id = parent_inode->id;
     memcpy(&dir_entry.name, "..", 3);
     write(fd, &dir_entry, sizeof dir_entry);
 
-    // Update size of directory
-    dir_inode.size_bytes = sizeof(dir_entry) * 2;
-    dir_inode.size_sectors = bytes_to_sectors(dir_inode.size_bytes);
-
-    // Update inode for new dir on disk
-    update_inode_on_disk(dir_inode);
-
-    // Update current dir inode and root dir inode, in case new dir 
-    //   was added to either
-    if (current_dir_inode.id == parent_inode.id)
-        current_dir_inode = parent_inode;
-
-    if (root_inode.id == parent_inode.id)
-        root_inode = parent_inode;
+    inode_put(parent_inode);
+    inode_put(dir_inode);
 
     close(fd);  // Close newly created/opened file when done
     return true;
@@ -680,10 +1371,13 @@ bool fs_change_dir(int32_t argc, char *argv[]) {
     // Change directory to current directory
     if (!strncmp(path, ".", 2)) return true;
 
-    inode_t dir_inode = inode_from_path(path);
-    if (dir_inode.id == 0) return false;    // Dir does not exist
+    inode_t *new_dir_inode = inode_from_path(path);
+    if (!new_dir_inode) return false;       // Dir does not exist
 
-    if (dir_inode.type != FILETYPE_DIR) return false;   // Not a directory
+    if (new_dir_inode->type != FILETYPE_DIR) {
+        inode_put(new_dir_inode);
+        return false;   // Not a directory
+    }
 
     char *curr = current_dir;
     if (*path == '/') {
@@ -697,8 +1391,9 @@ bool fs_change_dir(int32_t argc, char *argv[]) {
         curr--; // Go back before ending null terminator
     }
 
-    // Update current directory 
-    current_dir_inode = dir_inode;
+    // Update current directory
+    inode_put(current_dir_inode);
+    current_dir_inode = new_dir_inode;
 
     for (char *p = path; *p != '\0'; p++) {
         // '/' = directory separator, skip over
@@ -709,7 +1404,7 @@ bool fs_change_dir(int32_t argc, char *argv[]) {
         if (!strncmp(p, "..", 2)) {
             if (*curr == '/') curr--;   // Go before current separator first
 
-            while (*curr != '/') curr--;    
+            while (*curr != '/') curr--;
 
             p++;
             continue;
@@ -749,113 +1444,107 @@ bool fs_delete_file(int32_t argc, char *argv[]) {
         return false;
     }
 
-    inode_t inode = inode_from_path(path);
-    inode_t parent_inode = parent_inode_from_path(path);
-    if (inode.id == 0 || parent_inode.id == 0) return false;    // Files/dirs don't exist
-    if (inode.type != FILETYPE_FILE) return false;              // Only delete a file, not dir
-
-    if (inode.ref_count > 0) inode.ref_count--;   // Reduce open uses of this file by 1
+    inode_t *inode = inode_from_path(path);
+    if (!inode) return false;                           // File doesn't exist
 
-    if (inode.ref_count > 0) return true;   // File is still open somewhere else, don't delete
-
-    // Clear out file data by clearing all data blocks in all extents used for file
-    memset(temp_block, 0, sizeof temp_block);
-    for (uint32_t i = 0; i < superblock.direct_extents_per_inode; i++) {
-        for (uint32_t j = 0; j < inode.extent[i].length_blocks; j++) {
-            rw_sectors(SECTORS_PER_BLOCK, 
-                       (inode.extent[i].first_block + j) * SECTORS_PER_BLOCK, 
-                       (uint32_t)temp_block, 
-                       WRITE_WITH_RETRY);
+    // Only delete a file, not dir; and not an open file
+    if (inode->type != FILETYPE_FILE || inode->ref_count > 0) {
+        inode_put(inode);
+        return false;
+    }
 
-            // Clear out data bit in data bitmap blocks for disk blocks
-            clear_bit_in_data_bitmap(inode.extent[i].first_block + j);
-        }
+    inode_t *parent_inode = parent_inode_from_path(path);
+    if (!parent_inode) {                                // Dir doesn't exist
+        inode_put(inode);
+        return false;
     }
-    // TODO: Also go through single/double indirect extents?
 
-    // Clear inode in inode blocks
-    rw_sectors(1, 
-               (superblock.first_inode_block * SECTORS_PER_BLOCK) + 
-                   (inode.id / INODES_PER_SECTOR),
-               (uint32_t)temp_sector,
-               READ_WITH_RETRY);
+    const uint32_t id = inode->id;
 
-    inode_t *tmp_inode = (inode_t *)temp_sector + (inode.id % INODES_PER_SECTOR);
-    memset(tmp_inode, 0, sizeof inode);
+    // Find the file's dir_entry before changing anything, so a file that can't be unlinked
+    //   is left as it was
+    dir_entry_t *dir_entry = 0;
+    uint32_t data_block = 0;
+    extent_t extent = {0};
 
-    rw_sectors(1, 
-               (superblock.first_inode_block * SECTORS_PER_BLOCK) + 
-                   (inode.id / INODES_PER_SECTOR),
-               (uint32_t)temp_sector,
-               WRITE_WITH_RETRY);
+    if (parent_inode->flags & INODE_FLAG_HASH_INDEX) {
+        // Indexed directory: entry is in the leaf block for its name
+        dir_entry = dir_index_find(parent_inode, last_name_in_path(path), &data_block);
+        if (dir_entry && dir_entry->id != id) dir_entry = 0;
+    } else {
+        // Search parent dir's data blocks for the dir_entry corresponding to inode for file;
+        //   only each block's entries, past its end is another cached block
+        for (uint32_t i = 0; !dir_entry && fs_file_extent(parent_inode, i, &extent); i++) {
+            for (uint32_t j = 0; !dir_entry && j < extent.length_blocks; j++) {
+                dir_entry_t *entries = (dir_entry_t *)block_cache_read(extent.first_block + j);
+
+                for (uint32_t k = 0; k < DIR_ENTRIES_PER_BLOCK; k++) {
+                    if (entries[k].id != id) continue;
+
+                    dir_entry = &entries[k];
+                    data_block = extent.first_block + j;
+                    break;
+                }
+            }
+        }
+    }
 
-    // Clear inode bit in inode bitmap blocks
-    clear_bit_in_inode_bitmap(inode.id);
+    if (!dir_entry) {
+        inode_put(inode);
+        inode_put(parent_inode);
+        return false;
+    }
 
-    // Clear dir_entry for file in parent dir's data blocks 
-    bool found_file = false;
-    uint32_t data_block = 0;
-    for (uint32_t i = 0; i < superblock.direct_extents_per_inode; i++) {
-        for (uint32_t j = 0; j < parent_inode.extent[i].length_blocks; j++) {
-            rw_sectors(SECTORS_PER_BLOCK, 
-                       (parent_inode.extent[i].first_block + j) * SECTORS_PER_BLOCK, 
-                       (uint32_t)temp_block, 
-                       READ_WITH_RETRY);
-
-            // Search this block for dir_entry corresponding to inode for file
-            dir_entry_t *dir_entry = (dir_entry_t *)temp_block;
-            uint32_t count = DIR_ENTRIES_PER_BLOCK;
-            while (dir_entry->id != inode.id && count > 0) {
-                dir_entry++;
-                count--;
-            }
+    // Clear dir_entry for file in its cached block
+    memset(dir_entry, 0, sizeof(dir_entry_t));
+    block_cache_mark_dirty(data_block);
+    dentry_cache_remove(parent_inode->id, last_name_in_path(path));
 
-            if (dir_entry->id == inode.id) {
-                // Found dir_entry for file, clear it on disk
-                memset(dir_entry, 0, sizeof(dir_entry_t));
+    // Free file data by clearing data bits in data bitmap blocks, for all extents used for file
+    for (uint32_t i = 0; fs_file_extent(inode, i, &extent); i++)
+        fs_free_blocks(extent.first_block, extent.length_blocks);
 
-                rw_sectors(SECTORS_PER_BLOCK, 
-                           (parent_inode.extent[i].first_block + j) * SECTORS_PER_BLOCK, 
-                           (uint32_t)temp_block, 
-                           WRITE_WITH_RETRY);
+    fs_free_indirect_blocks(inode);
 
-                data_block = parent_inode.extent[i].first_block + j;
+    // Clear inode in the cache & inode blocks, dropping it from the cache drops this reference too
+    inode_cache_drop(id);
+    memset(inode_in_block(id), 0, sizeof(inode_t));
+    block_cache_mark_dirty(superblock.first_inode_block + (id / INODES_PER_BLOCK));
 
-                found_file = true;
-                goto done;
-            }
-        }
+    // Clear inode bit in inode bitmap blocks
+    clear_bit_in_inode_bitmap(id);
+    if (id < superblock.first_free_inode_bit || superblock.first_free_inode_bit == 0)
+        superblock.first_free_inode_bit = id;
+
+    // Indexed directory keeps its blocks
+    if (parent_inode->flags & INODE_FLAG_HASH_INDEX) {
+        inode_put(parent_inode);
+        return true;
     }
-    done:
-    if (!found_file) return false;
 
     // Update parent dir's inode to reduce size by sizeof dir_entry
-    parent_inode.size_bytes -= sizeof(dir_entry_t);
-    parent_inode.size_sectors = bytes_to_sectors(parent_inode.size_bytes);
-    update_inode_on_disk(parent_inode);
+    parent_inode->size_bytes -= sizeof(dir_entry_t);
+    parent_inode->size_sectors = bytes_to_sectors(parent_inode->size_bytes);
 
     // If this file reduces parent's size to a multiple of FS_BLOCK_SIZE,
-    //   then can clear out that disk block and data bitmap bit
-    if (parent_inode.size_bytes % FS_BLOCK_SIZE == 0) {
+    //   then can clear out that disk block and data bitmap bit, if it is the dir's last block
+    if (parent_inode->size_bytes % FS_BLOCK_SIZE == 0 &&
+        data_block == disk_block_for_file_block(parent_inode, bytes_to_blocks(parent_inode->size_bytes))) {
         // Check if full block is empty
         bool is_clear = true;
+        const uint8_t *block = block_cache_read(data_block);
         for (uint32_t i = 0; i < FS_BLOCK_SIZE / 4; i++) {
-           if ((uint32_t)temp_block[i] != 0) {
+           if (((uint32_t *)block)[i] != 0) {
                is_clear = false;
                break;
            }
         }
 
-        if (is_clear) clear_bit_in_data_bitmap(data_block);
+        if (is_clear) fs_trim_file(parent_inode);
     }
 
-    // Update current dir inode and root dir inode, in case file
-    //   was deleted from either
-    if (current_dir_inode.id == parent_inode.id)
-        current_dir_inode = parent_inode;
-
-    if (root_inode.id == parent_inode.id)
-        root_inode = parent_inode;
+    inode_mark_dirty(parent_inode);
+    inode_put(parent_inode);
 
     return true;
 }
@@ -867,7 +1556,7 @@ bool fs_delete_dir(int32_t argc, char *argv[]) {
     return true;
 }
 
-// Rename a file 
+// Rename a file
 // Example argv[]/command: "ren /folderA/fileA.txt fileB.txt"
 bool fs_rename_file(int32_t argc, char *argv[]) {
     (void)argc;
@@ -888,45 +1577,71 @@ bool fs_rename_file(int32_t argc, char *argv[]) {
         return false;
     }
 
-    inode_t inode = inode_from_path(path);
-    inode_t parent_inode = parent_inode_from_path(path);
+    // Only the file's id is needed, its dir_entry is what changes
+    inode_t *inode = inode_from_path(path);
 
-    if (inode.id == 0) {
+    if (!inode) {
         printf("\r\nError: Could not get inode for %s", path);
         return false;
     }
 
-    if (parent_inode.id == 0) {
+    const uint32_t id = inode->id;
+    inode_put(inode);
+
+    inode_t *parent_inode = parent_inode_from_path(path);
+    if (!parent_inode) {
         printf("\r\nError: Could not get parent dir inode for %s", path);
         return false;
     }
 
-    bool renamed_file = false;
-    for (uint32_t i = 0; i < superblock.direct_extents_per_inode; i++) {
-        for (uint32_t j = 0; j < parent_inode.extent[i].length_blocks; j++) {
-            rw_sectors(SECTORS_PER_BLOCK, 
-                       (parent_inode.extent[i].first_block + j) * SECTORS_PER_BLOCK, 
-                       (uint32_t)temp_block, 
-                       READ_WITH_RETRY);
-
-            // Search this block for dir_entry corresponding to inode for file
-            dir_entry_t *dir_entry = (dir_entry_t *)temp_block;
-            uint32_t count = DIR_ENTRIES_PER_BLOCK;
-            while (dir_entry->id != inode.id && count > 0) {
-                dir_entry++;
-                count--;
+    dentry_cache_remove(parent_inode->id, last_name_in_path(path));
+    dentry_cache_remove(parent_inode->id, new_name);
+
+    // Indexed directory: move dir_entry to the leaf block for its new name
+    if (parent_inode->flags & INODE_FLAG_HASH_INDEX) {
+        char *old_name = last_name_in_path(path);
+        dir_entry_t new_dir_entry = { .id = id };
+        strcpy(new_dir_entry.name, new_name);
+
+        uint32_t data_block = 0;
+        bool moved = dir_index_find(parent_inode, old_name, &data_block) &&
+                     dir_index_add(parent_inode, &new_dir_entry);
+
+        if (moved) {
+            // Find old entry again, adding the new one may have split its block
+            dir_entry_t *dir_entry = dir_index_find(parent_inode, old_name, &data_block);
+            if (dir_entry) {
+                memset(dir_entry, 0, sizeof(dir_entry_t));
+                block_cache_mark_dirty(data_block);
             }
+        }
+
+        // Directory may have grown, or is no longer indexed and entry gets renamed in place below
+        inode_mark_dirty(parent_inode);
+
+        if (moved) {
+            inode_put(parent_inode);
+            return true;
+        }
+    }
+
+    bool renamed_file = false;
+    extent_t extent = {0};
+    for (uint32_t i = 0; fs_file_extent(parent_inode, i, &extent); i++) {
+        for (uint32_t j = 0; j < extent.length_blocks; j++) {
+            uint8_t *block = block_cache_read(extent.first_block + j);
+
+            // Search this block for dir_entry corresponding to inode for file; only this
+            //   block's entries, past its end is another cached block
+            dir_entry_t *dir_entry = (dir_entry_t *)block;
+            for (uint32_t k = 0; k < DIR_ENTRIES_PER_BLOCK; k++, dir_entry++) {
+                if (dir_entry->id != id) continue;
 
-            if (dir_entry->id == inode.id) {
                 // Found dir_entry for file, rename it
                 memset(dir_entry, 0, sizeof(dir_entry_t));
-                dir_entry->id = inode.id;   // Use same id 
+                dir_entry->id = id;         // Use same id
                 strcpy(dir_entry->name, new_name);
-
-                rw_sectors(SECTORS_PER_BLOCK, 
-                           (parent_inode.extent[i].first_block + j) * SECTORS_PER_BLOCK, 
-                           (uint32_t)temp_block, 
-                           WRITE_WITH_RETRY);
+                block_cache_mark_dirty(extent.first_block + j);
 
                 renamed_file = true;
                 goto done;
@@ -934,6 +1649,8 @@ bool fs_rename_file(int32_t argc, char *argv[]) {
         }
     }
     done:
+    inode_put(parent_inode);
+
     if (!renamed_file) {
         printf("\r\nError: Could not find file '%s' in disk blocks to rename.", path);
         return false;
@@ -0,0 +1,140 @@
+/*
+ * fs/inode_cache.h: Reference counted cache of inodes in memory. inode_get() hands out a
+ *   pointer to the one cached copy of an inode, which stays in place until its last user calls
+ *   inode_put(). Changed inodes are written to their cached inode blocks when synced or when
+ *   their entry is reused, so updates to inodes in the same block go to disk together
+ */
+#pragma once
+
+#include "C/stdint.h"
+#include "C/stdbool.h"
+#include "C/string.h"
+#include "fs/fs.h"
+#include "fs/block_cache.h"
+
+extern superblock_t superblock;
+
+typedef struct {
+    uint32_t refs;          // # of users holding a pointer from inode_get()
+    uint32_t last_used;     // Value of inode_cache_uses when last used, unreferenced LRU entry is reused
+    bool dirty;             // Inode changed since it was read from/written to its inode block
+} inode_cache_info_t;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t write_backs;   // # of dirty inodes written to inode blocks
+} inode_cache_stats_t;
+
+// Storage for inodes & their info is given in inode_cache_init(), kernel & 3rd stage use different sizes
+inode_t *inode_cache = 0;
+inode_cache_info_t *inode_cache_info = 0;
+uint32_t inode_cache_size = 0;
+uint32_t inode_cache_uses = 0;
+inode_cache_stats_t inode_cache_stats = {0};
+
+// Set up cache with given storage for count inodes
+void inode_cache_init(inode_t *inodes, inode_cache_info_t *info, const uint32_t count) {
+    inode_cache = inodes;
+    inode_cache_info = info;
+    inode_cache_size = count;
+
+    memset(inode_cache, 0, count * sizeof(inode_t));
+    memset(inode_cache_info, 0, count * sizeof(inode_cache_info_t));
+}
+
+// Get a pointer to an inode in its cached inode block
+inode_t *inode_in_block(const uint32_t id) {
+    uint8_t *block = block_cache_read(superblock.first_inode_block + (id / INODES_PER_BLOCK));
+    return (inode_t *)block + (id % INODES_PER_BLOCK);
+}
+
+// Get cached copy of an inode, or 0 if not cached
+inode_t *inode_cache_find(const uint32_t id) {
+    if (id == 0) return 0;
+
+    for (uint32_t i = 0; i < inode_cache_size; i++)
+        if (inode_cache[i].id == id) return &inode_cache[i];
+
+    return 0;
+}
+
+// Write entry's inode to its cached inode block if it's dirty. # of open uses is not kept on disk
+void inode_cache_write_back(const uint32_t i) {
+    if (!inode_cache_info[i].dirty) return;
+
+    inode_t *inode = inode_in_block(inode_cache[i].id);
+    *inode = inode_cache[i];
+    inode->ref_count = 0;
+
+    block_cache_mark_dirty(superblock.first_inode_block + (inode_cache[i].id / INODES_PER_BLOCK));
+    inode_cache_info[i].dirty = false;
+    inode_cache_stats.write_backs++;
+}
+
+// Get a reference to the cached copy of an inode, reading it in if needed
+// RETURNS:
+//   pointer that stays good until inode_put(), or 0 if id = 0 or all cached inodes are in use
+inode_t *inode_get(const uint32_t id) {
+    if (id == 0) return 0;
+
+    inode_t *inode = inode_cache_find(id);
+    uint32_t i = 0;
+
+    if (inode) {
+        inode_cache_stats.hits++;
+        i = inode - inode_cache;
+    } else {
+        // Reuse an empty entry, or the least recently used unreferenced one
+        uint32_t lru = inode_cache_size;
+        for (i = 0; i < inode_cache_size; i++) {
+            if (inode_cache_info[i].refs > 0) continue;
+            if (inode_cache[i].id == 0) break;
+            if (lru == inode_cache_size || inode_cache_info[i].last_used < inode_cache_info[lru].last_used)
+                lru = i;
+        }
+
+        if (i == inode_cache_size) i = lru;
+        if (i == inode_cache_size) return 0;    // Error: all cached inodes are in use
+
+        inode_cache_write_back(i);
+        inode_cache_stats.misses++;
+
+        inode = &inode_cache[i];
+        *inode = *inode_in_block(id);
+        inode->id = id;         // Unused inodes are all 0s on disk
+        inode->ref_count = 0;
+    }
+
+    inode_cache_info[i].refs++;
+    inode_cache_info[i].last_used = ++inode_cache_uses;
+    return inode;
+}
+
+// Drop a reference from inode_get(), inode stays cached until its entry is reused
+void inode_put(inode_t *inode) {
+    if (!inode) return;
+
+    inode_cache_info_t *info = &inode_cache_info[inode - inode_cache];
+    if (info->refs > 0) info->refs--;
+}
+
+// Mark a cached inode as changed, to write to its inode block later
+void inode_mark_dirty(inode_t *inode) {
+    inode_cache_info[inode - inode_cache].dirty = true;
+}
+
+// Remove an inode from the cache without writing it back, e.g. when its file is deleted
+void inode_cache_drop(const uint32_t id) {
+    inode_t *inode = inode_cache_find(id);
+    if (!inode) return;
+
+    inode_cache_info[inode - inode_cache] = (inode_cache_info_t){0};
+    memset(inode, 0, sizeof(inode_t));
+}
+
+// Write all dirty cached inodes to their inode blocks
+void inode_cache_sync(void) {
+    for (uint32_t i = 0; i < inode_cache_size; i++)
+        inode_cache_write_back(i);
+}
@@ -0,0 +1,258 @@
+/*
+ * fs/journal.h: Write ahead journal for file system metadata blocks. A transaction is a
+ *   descriptor block listing its blocks' home blocks, the blocks, and a commit block with a
+ *   checksum of it all, staged in 1 buffer and written to the journal with 1 request that
+ *   flushes the drive's cache after. Its blocks are then written home without a flush.
+ *   The journal region is 2 slots used in turn, so a transaction's slot is only written
+ *   again after the next commit's flush has put its home writes on disk too.
+ *   The complete transactions in both slots are written again at mount, oldest first
+ */
+#pragma once
+
+#include "C/stdint.h"
+#include "C/stdbool.h"
+#include "C/string.h"
+#include "fs/fs.h"
+#include "disk/file_ops.h"
+
+#define JOURNAL_MAGIC      0x324E524A   // "JRN2", 2 slot layout with revoke bits
+#define JOURNAL_MAX_BLOCKS 128          // Most blocks in 1 transaction
+#define JOURNAL_SLOTS      2
+#define JOURNAL_REVOKE_WORDS (JOURNAL_MAX_BLOCKS / 32)
+
+extern superblock_t superblock;
+
+typedef struct {
+    uint32_t magic;                     // JOURNAL_MAGIC if slot holds a transaction
+    uint32_t sequence;                  // Transaction #, slot is sequence % JOURNAL_SLOTS
+    uint32_t count;                     // # of logged blocks after this one
+    uint32_t revoked[JOURNAL_REVOKE_WORDS]; // Bit per block of the previous transaction freed since, not replayed
+    uint32_t home_block[(FS_BLOCK_SIZE / sizeof(uint32_t)) - 3 - JOURNAL_REVOKE_WORDS];  // Disk block for each logged block
+} journal_descriptor_t;                 // sizeof(journal_descriptor_t) = FS_BLOCK_SIZE
+
+typedef struct {
+    uint32_t magic;                     // JOURNAL_MAGIC
+    uint32_t sequence;                  // Same as descriptor
+    uint32_t checksum;                  // Of descriptor & logged blocks
+} journal_commit_t;
+
+typedef struct {
+    uint32_t commits;                   // # of transactions committed
+    uint32_t blocks;                    // # of blocks written in transactions
+    uint32_t replays;                   // # of transactions replayed at mount
+} journal_stats_t;
+
+// Blocks in the current transaction, their data is written when it's committed
+uint32_t journal_home[JOURNAL_MAX_BLOCKS];
+uint8_t *journal_data[JOURNAL_MAX_BLOCKS];
+uint32_t journal_count = 0;
+uint32_t journal_sequence = 0;
+journal_stats_t journal_stats = {0};
+
+// Home blocks of the last committed transaction, and which of them were freed since
+uint32_t journal_last_home[JOURNAL_MAX_BLOCKS];
+uint32_t journal_last_count = 0;
+uint32_t journal_revoked[JOURNAL_REVOKE_WORDS];
+
+// Descriptor, blocks & commit block of a transaction; at mount also a descriptor per slot
+#define JOURNAL_STAGING_BLOCKS (JOURNAL_MAX_BLOCKS + 2 + JOURNAL_SLOTS)
+uint8_t *journal_staging = 0;
+
+// Set buffer of JOURNAL_STAGING_BLOCKS to stage transactions in; without one, metadata blocks
+//   are written without the journal
+void journal_init(uint8_t *staging) {
+    journal_staging = staging;
+}
+
+// Get # of blocks in each of the journal's slots
+uint32_t journal_slot_blocks(void) {
+    return superblock.num_journal_blocks / JOURNAL_SLOTS;
+}
+
+// Check if the disk has a journal region, older disk images do not; their metadata blocks
+//   are written directly with 1 cache flush per transaction
+bool journal_enabled(void) {
+    return journal_staging && journal_slot_blocks() >= 3;
+}
+
+// Get max # of blocks in a transaction: a slot holds descriptor, blocks & commit block
+uint32_t journal_capacity(void) {
+    if (!journal_enabled() || journal_slot_blocks() - 2 > JOURNAL_MAX_BLOCKS)
+        return JOURNAL_MAX_BLOCKS;
+
+    return journal_slot_blocks() - 2;
+}
+
+// Add a block's data to a running checksum
+uint32_t journal_checksum(uint32_t checksum, const uint8_t *data) {
+    const uint32_t *words = (const uint32_t *)data;
+
+    for (uint32_t i = 0; i < FS_BLOCK_SIZE / sizeof(uint32_t); i++)
+        checksum = ((checksum << 1) | (checksum >> 31)) + words[i];
+
+    return checksum;
+}
+
+// Read/write blocks in a journal slot
+void journal_rw_blocks(const uint32_t slot, const uint32_t index, const uint32_t blocks,
+                       uint8_t *data, const uint8_t command) {
+    const uint32_t block = superblock.first_journal_block + slot * journal_slot_blocks() + index;
+    rw_sectors(blocks * SECTORS_PER_BLOCK, block * SECTORS_PER_BLOCK, (uint32_t)data, command);
+}
+
+// Note blocks being freed, so a replay of the last transaction doesn't write its copies of
+//   them over whatever they're used for next
+void journal_revoke(const uint32_t first_block, const uint32_t length_blocks) {
+    for (uint32_t i = 0; i < journal_last_count; i++) {
+        if (journal_last_home[i] >= first_block && journal_last_home[i] < first_block + length_blocks)
+            journal_revoked[i / 32] |= 1u << (i % 32);
+    }
+}
+
+// Keep the home blocks of the transaction just committed or replayed, for journal_revoke()
+void journal_set_last(const uint32_t *home_block, const uint32_t count) {
+    memcpy(journal_last_home, home_block, count * sizeof(uint32_t));
+    journal_last_count = count;
+    memset(journal_revoked, 0, sizeof journal_revoked);
+}
+
+// Write the current transaction: to the journal first if there is one, then to the blocks'
+//   home locations
+void journal_commit(void) {
+    if (journal_count == 0) return;
+
+    if (journal_enabled()) {
+        journal_descriptor_t *descriptor = (journal_descriptor_t *)journal_staging;
+        memset(descriptor, 0, FS_BLOCK_SIZE);
+        descriptor->magic = JOURNAL_MAGIC;
+        descriptor->sequence = ++journal_sequence;
+        descriptor->count = journal_count;
+        memcpy(descriptor->revoked, journal_revoked, sizeof journal_revoked);
+
+        for (uint32_t i = 0; i < journal_count; i++)
+            descriptor->home_block[i] = journal_home[i];
+
+        uint32_t checksum = journal_checksum(0, (uint8_t *)descriptor);
+        for (uint32_t i = 0; i < journal_count; i++) {
+            uint8_t *block = journal_staging + (1 + i) * FS_BLOCK_SIZE;
+            memcpy(block, journal_data[i], FS_BLOCK_SIZE);
+            checksum = journal_checksum(checksum, block);
+        }
+
+        journal_commit_t *commit = (journal_commit_t *)(journal_staging + (1 + journal_count) * FS_BLOCK_SIZE);
+        memset(commit, 0, FS_BLOCK_SIZE);
+        *commit = (journal_commit_t){
+            .magic = JOURNAL_MAGIC,
+            .sequence = journal_sequence,
+            .checksum = checksum,
+        };
+
+        // 1 request for the whole transaction. Its flush also puts the previous transaction's
+        //   home writes on disk, before that one's slot is written again by the next commit
+        journal_rw_blocks(journal_sequence % JOURNAL_SLOTS, 0, journal_count + 2, journal_staging, WRITE_AND_FLUSH);
+    }
+
+    // Write blocks to their home locations; if they don't make it to disk, a replay writes them
+    for (uint32_t i = 0; i < journal_count; i++)
+        rw_sectors(SECTORS_PER_BLOCK, journal_home[i] * SECTORS_PER_BLOCK, (uint32_t)journal_data[i], WRITE_WITH_RETRY);
+
+    if (!journal_enabled()) ata_flush();
+
+    journal_set_last(journal_home, journal_count);
+    journal_stats.commits++;
+    journal_stats.blocks += journal_count;
+    journal_count = 0;
+}
+
+// Add a block to the current transaction; its data must not change until journal_commit(). A
+//   journal slot fits every cached block & bitmap block, and fs_dirty_block_limit() keeps
+//   fewer dirty on older disk images with a smaller journal. If the transaction is full anyway,
+//   the blocks so far are committed first
+void journal_add(const uint32_t home_block, uint8_t *data) {
+    for (uint32_t i = 0; i < journal_count; i++) {
+        if (journal_home[i] == home_block) {
+            journal_data[i] = data;
+            return;
+        }
+    }
+
+    if (journal_count == journal_capacity()) journal_commit();
+
+    journal_home[journal_count] = home_block;
+    journal_data[journal_count] = data;
+    journal_count++;
+}
+
+// Read a slot's transaction into a buffer of JOURNAL_MAX_BLOCKS+2 blocks
+// RETURNS:
+//   true if the whole transaction made it to disk
+bool journal_read_slot(const uint32_t slot, uint8_t *buffer) {
+    journal_descriptor_t *descriptor = (journal_descriptor_t *)buffer;
+    journal_rw_blocks(slot, 0, 1, buffer, READ_WITH_RETRY);
+
+    if (descriptor->magic != JOURNAL_MAGIC || descriptor->count == 0 || descriptor->count > journal_capacity())
+        return false;   // Slot is empty
+
+    journal_rw_blocks(slot, 1, descriptor->count + 1, buffer + FS_BLOCK_SIZE, READ_WITH_RETRY);
+
+    uint32_t checksum = 0;
+    for (uint32_t i = 0; i <= descriptor->count; i++)
+        checksum = journal_checksum(checksum, buffer + i * FS_BLOCK_SIZE);
+
+    const journal_commit_t *commit = (journal_commit_t *)(buffer + (1 + descriptor->count) * FS_BLOCK_SIZE);
+    return commit->magic == JOURNAL_MAGIC && commit->sequence == descriptor->sequence &&
+           commit->checksum == checksum;
+}
+
+// Write a transaction read by journal_read_slot() to its home blocks, except revoked ones
+void journal_write_home(const uint8_t *buffer, const uint32_t *revoked) {
+    const journal_descriptor_t *descriptor = (const journal_descriptor_t *)buffer;
+
+    for (uint32_t i = 0; i < descriptor->count; i++) {
+        if (revoked && (revoked[i / 32] & (1u << (i % 32)))) continue;
+
+        rw_sectors(SECTORS_PER_BLOCK, descriptor->home_block[i] * SECTORS_PER_BLOCK,
+                   (uint32_t)(buffer + (1 + i) * FS_BLOCK_SIZE), WRITE_WITH_RETRY);
+    }
+
+    journal_stats.replays++;
+}
+
+// Write complete transactions left in the journal to their home blocks, at mount before any
+//   metadata is read. Their home writes may not have made it to disk, e.g. after a crash; if
+//   they did, writing them again is harmless
+// RETURNS:
+//   true if a transaction was replayed
+bool journal_replay(void) {
+    if (!journal_enabled()) return false;
+
+    // Keep each slot's descriptor after the space a slot is read into
+    journal_descriptor_t *descriptors = (journal_descriptor_t *)(journal_staging + (JOURNAL_MAX_BLOCKS + 2) * FS_BLOCK_SIZE);
+    bool complete[JOURNAL_SLOTS];
+
+    for (uint32_t slot = 0; slot < JOURNAL_SLOTS; slot++) {
+        complete[slot] = journal_read_slot(slot, journal_staging);
+        memcpy(&descriptors[slot], journal_staging, FS_BLOCK_SIZE);
+    }
+
+    // Oldest first; the transaction right after it lists its blocks freed since, not replayed
+    const uint32_t oldest = (complete[0] && complete[1] && descriptors[1].sequence < descriptors[0].sequence) ? 1 : 0;
+    bool replayed = false;
+
+    for (uint32_t n = 0; n < JOURNAL_SLOTS; n++) {
+        const uint32_t slot = (oldest + n) % JOURNAL_SLOTS;
+        const uint32_t next = (slot + 1) % JOURNAL_SLOTS;
+        if (!complete[slot]) continue;
+
+        const bool revoked = n == 0 && complete[next] && descriptors[next].sequence == descriptors[slot].sequence + 1;
+        journal_read_slot(slot, journal_staging);
+        journal_write_home(journal_staging, revoked ? descriptors[next].revoked : 0);
+
+        journal_sequence = descriptors[slot].sequence;
+        journal_set_last(descriptors[slot].home_block, descriptors[slot].count);
+        replayed = true;
+    }
+
+    if (replayed) ata_flush();
+    return replayed;
+}
@@ -5,6 +5,7 @@
 
 #define RTC_DATETIME_AREA              0x1610
 #define IRQ0_SLEEP_TIMER_TICKS_AREA    0x1700
+#define IRQ0_TIMER_TICKS_AREA          0x1704
 #define CURRENT_PAGE_DIR_ADDRESS       0x1800
 #define PHYS_MEM_MAX_BLOCKS            0x1804
 #define PHYS_MEM_USED_BLOCKS           0x1808
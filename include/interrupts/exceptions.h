@@ -9,6 +9,11 @@
 #include "memory/physical_memory_manager.h"
 #include "memory/virtual_memory_manager.h"
 
+// Page fault error code bits
+#define PF_ERR_PRESENT 0x01     // Set = protection violation on a present page, clear = page not present
+#define PF_ERR_WRITE   0x02     // Set = write, clear = read
+#define PF_ERR_USER    0x04     // Set = fault was in ring 3
+
 __attribute__ ((interrupt)) void div_by_0_handler(int_frame_32_t *frame) {
     uint32_t color = user_gfx_info->fg_color;   // Save current text color
 
@@ -53,16 +58,31 @@ __attribute__ ((interrupt)) void protection_fault_handler(int_frame_32_t *frame,
 }
 
 __attribute__ ((interrupt)) void page_fault_handler(int_frame_32_t *frame, uint32_t error_code) {
-    (void)frame, (void)error_code;    // Silence compiler warnings
+    (void)frame;    // Silence compiler warnings
                     
     uint32_t color = user_gfx_info->fg_color;   // Save current text color
     uint32_t bad_address = 0;
 
-    user_gfx_info->fg_color = convert_color(0x00FF0000);          // Red
-
     // CR2 contains bad address that caused page fault
     __asm__ __volatile__("movl %%CR2, %0" : "=r"(bad_address) );
 
+    // Open files' pages are mapped & loaded on first access, from syscalls.h. Only for
+    //   not present pages, a protection fault on a present page is a real fault
+    extern bool load_open_file_page(const uint32_t address);
+    if (!(error_code & PF_ERR_PRESENT) && load_open_file_page(bad_address)) return;
+
+    user_gfx_info->fg_color = convert_color(0x00FF0000);          // Red
+
+    // Mapping a new page over a present page would lose its data
+    if (error_code & PF_ERR_PRESENT) {
+        printf("\033X0Y0;PAGE FAULT EXCEPTION (#PF)\r\nERROR CODE: %#x", error_code);
+        printf("\r\nADDRESS: %#x", bad_address);
+        printf("\r\nPROTECTION VIOLATION ON %s FROM %s", 
+               (error_code & PF_ERR_WRITE) ? "WRITE" : "READ",
+               (error_code & PF_ERR_USER)  ? "USER MODE" : "KERNEL MODE");
+        __asm__ __volatile__("cli;hlt");
+    }
+
     // Map in bad page, and set present/read/write flags
     void *phys_address = allocate_blocks(1);
     if (!phys_address) {
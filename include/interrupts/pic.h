@@ -10,6 +10,7 @@
 #include "interrupts/idt.h"
 #include "print/print_types.h"
 #include "keyboard/keyboard.h"
+#include "disk/ata.h"
 
 #define PIC_1_CMD  0x20
 #define PIC_1_DATA 0x21
@@ -128,6 +129,8 @@ __attribute__ ((interrupt)) void timer_irq0_handler(int_frame_32_t *frame)
                     
     if (*sleep_timer_ticks > 0) (*sleep_timer_ticks)--;
 
+    (*timer_ticks)++;   // Free running ~1ms count, e.g. for disk request latency
+
     send_pic_eoi(0);
 }
 
@@ -391,3 +394,15 @@ __attribute__ ((interrupt)) void cmos_rtc_irq8_handler (int_frame_32_t *frame)
     __asm__ __volatile__ ("sti");
 }
 
+
+// Primary ATA disk IRQ14 handler
+__attribute__ ((interrupt)) void ata_irq14_handler(int_frame_32_t *frame) {
+    (void)frame;    // Silence compiler warnings
+
+    ata_stats.irqs++;
+
+    // Transfer next sector or finish the current request & start the next queued one
+    ata_service();
+
+    send_pic_eoi(14);
+}
@@ -11,21 +11,325 @@
 #include "sys/regs.h"
 #include "print/print_types.h"
 #include "interrupts/pic.h"
-#include "memory/malloc.h"
+#include "memory/sbrk.h"
 #include "memory/virtual_memory_manager.h" 
+#include "memory/virtual_ranges.h"
+#include "memory/slab.h"
 #include "terminal/terminal.h"
 #include "fs/fs_impl.h"
+#include "fs/defrag.h"
 #include "process/process.h"
 
 // These extern vars are from kernel.c
-extern open_file_table_t open_file_table[256];  
+extern open_file_table_t **open_file_table; // Open file for each FD, 0 if FD is not in use
 extern uint32_t max_open_files;
 extern uint32_t current_open_files;         // FD 0/1/2 reserved for stdin/out/err
 
-extern inode_t open_inode_table[256];
-extern uint32_t max_open_inodes;
-extern uint32_t current_open_inodes;
-extern uint32_t next_available_file_virtual_address;
+extern virtual_ranges_t file_address_space; // Virtual addresses open files are mapped to
+extern slab_cache_t open_file_cache;        // Open file table entries
+
+#define OPEN_FILE_TABLE_MIN 64      // FDs in open file table at first, doubled when full
+
+#define FILE_FLUSH_INTERVAL_MS 5000  // Max time written file data stays only in memory
+#define READAHEAD_MIN_PAGES 4       // Read-ahead window at the start of sequential reading
+#define READAHEAD_MAX_PAGES 32      // Largest read-ahead window, 128KB
+
+// Read-ahead of open file pages: sequential page faults on a file grow a window of following
+//   pages, read with queued disk requests into frames mapped at a kernel only staging range.
+//   Pages are moved into the file's range at the next page fault once the disk is done, so
+//   nothing sees a page before its data is there. 1 batch is in flight at a time
+typedef struct {
+    open_file_table_t *oft;             // File the batch is for, 0 if none in flight
+    uint32_t first_page;                // File page of frames[0]
+    uint32_t pages;                     // # of pages in batch
+    uint32_t frames[READAHEAD_MAX_PAGES];
+    uint32_t staging;                   // Virtual addresses pages are read into
+    volatile uint32_t pending;          // # of disk requests not done yet
+    volatile bool failed;               // A disk request had an error, drop the batch
+} readahead_t;
+
+typedef struct {
+    uint32_t batches;
+    uint32_t pages;                     // # of pages read ahead
+    uint32_t used;                      // # of read ahead pages moved into files
+} readahead_stats_t;
+
+uint32_t last_file_flush_tick = 0;
+readahead_t readahead = {0};
+readahead_stats_t readahead_stats = {0};
+
+// Write an open file's changed pages to disk: the mapped pages the CPU marked dirty since
+//   they were loaded or last flushed, as runs of consecutive pages
+bool flush_open_file(open_file_table_t *oft) {
+    const uint32_t address = (uint32_t)oft->address;
+    uint32_t run_start = 0, run_pages = 0;
+    bool ok = true;
+
+    for (uint32_t page = 0; page <= oft->pages_allocated; page++) {
+        const uint32_t virt = address + (page * PAGE_SIZE);
+        bool dirty = false;
+
+        // Take the dirty bit before writing the page; writes during the flush (e.g. keyboard
+        //   IRQ to stdin) set it again instead of being lost
+        if (page < oft->pages_allocated && is_address_mapped(current_page_directory, virt)) {
+            const uint32_t eflags = ata_save_flags_cli();
+            dirty = clear_page_dirty(virt);
+            ata_restore_flags(eflags);
+        }
+
+        if (dirty) {
+            if (run_pages == 0) run_start = page;
+            run_pages++;
+            continue;
+        }
+
+        // Only the pages' blocks the file has on disk are written
+        if (run_pages > 0) {
+            ok &= fs_save_file_range(oft->inode, address, run_start * PAGE_SIZE,
+                                     (run_start + run_pages) * PAGE_SIZE);
+            run_pages = 0;
+        }
+    }
+
+    return ok;
+}
+
+// Disk request callback for read-ahead, from the IRQ14 handler
+void readahead_request_done(ata_request_t *request) {
+    if (request->state == ATA_REQ_ERROR) readahead.failed = true;
+    readahead.pending--;
+}
+
+// Wait for the read-ahead batch in flight, and move its pages into its file's range
+void readahead_finish(void) {
+    open_file_table_t *oft = readahead.oft;
+    if (!oft) return;
+
+    ata_wait_for(&readahead.pending);
+
+    const uint32_t file_size = oft->inode->size_bytes;
+
+    for (uint32_t i = 0; i < readahead.pages; i++) {
+        const uint32_t page = readahead.first_page + i;
+        const uint32_t staging = readahead.staging + (i * PAGE_SIZE);
+        const uint32_t virt = (uint32_t)oft->address + (page * PAGE_SIZE);
+
+        unmap_page((void *)staging);
+        flush_tlb_entry(staging);
+
+        // Drop pages that were not read, or that the file range no longer needs
+        if (readahead.failed || page >= oft->pages_allocated || 
+            is_address_mapped(current_page_directory, virt) ||
+            !map_address(current_page_directory, readahead.frames[i], virt, 
+                         PTE_PRESENT | PTE_READ_WRITE | PTE_USER)) {
+            free_blocks((uint32_t *)readahead.frames[i], 1);
+            continue;
+        }
+
+        // Clear rest of the last block of the file
+        if ((page + 1) * PAGE_SIZE > file_size && page * PAGE_SIZE < file_size) {
+            memset((uint8_t *)virt + (file_size - (page * PAGE_SIZE)), 0, 
+                   ((page + 1) * PAGE_SIZE) - file_size);
+            clear_page_dirty(virt);     // Same as on disk, not changed
+        }
+
+        readahead_stats.used++;
+    }
+
+    readahead.oft = 0;
+}
+
+// Queue a read of a run of read-ahead pages in consecutive disk blocks
+void readahead_submit(const uint32_t first, const uint32_t disk_block, const uint32_t length) {
+    // Cache could have newer data for these blocks, e.g. directory entries
+    block_cache_sync_range(disk_block, length);
+
+    const uint32_t eflags = ata_save_flags_cli();
+    readahead.pending++;
+    ata_restore_flags(eflags);
+
+    ata_submit(length * SECTORS_PER_BLOCK, disk_block * SECTORS_PER_BLOCK, 
+               readahead.staging + (first * PAGE_SIZE), READ_WITH_RETRY, readahead_request_done, 0);
+}
+
+// Start reading up to count pages of a file from first_page on, without waiting. Stops at
+//   the end of the file, or at a page that is already mapped
+void readahead_start(open_file_table_t *oft, const uint32_t first_page, uint32_t count) {
+    const uint32_t file_pages = bytes_to_blocks(oft->inode->size_bytes);
+    if (first_page >= file_pages) return;
+    if (count > file_pages - first_page) count = file_pages - first_page;
+
+    if (!readahead.staging) {
+        // Kernel only addresses, so user code can't see pages before their data is read
+        readahead.staging = virtual_ranges_alloc(&kernel_object_space, READAHEAD_MAX_PAGES);
+        if (!readahead.staging) return;     // Out of kernel address space, no read-ahead
+    }
+
+    readahead.oft        = oft;
+    readahead.first_page = first_page;
+    readahead.pages      = 0;
+    readahead.failed     = false;
+
+    // Pages in consecutive disk blocks are read with 1 request
+    uint32_t run_first = 0, run_block = 0, run_length = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint32_t virt = (uint32_t)oft->address + ((first_page + i) * PAGE_SIZE);
+        const uint32_t disk_block = disk_block_for_file_block(oft->inode, first_page + i);
+        if (disk_block == 0 || is_address_mapped(current_page_directory, virt)) break;
+
+        void *frame = allocate_blocks(1);
+        if (!frame) break;
+
+        if (!map_address(current_page_directory, (uint32_t)frame, readahead.staging + (i * PAGE_SIZE),
+                         PTE_PRESENT | PTE_READ_WRITE)) {
+            free_blocks(frame, 1);
+            break;
+        }
+
+        readahead.frames[i] = (uint32_t)frame;
+        readahead.pages++;
+
+        if (run_length > 0 && disk_block == run_block + run_length) {
+            run_length++;
+            continue;
+        }
+
+        if (run_length > 0) readahead_submit(run_first, run_block, run_length);
+        run_first  = i;
+        run_block  = disk_block;
+        run_length = 1;
+    }
+
+    if (run_length > 0) readahead_submit(run_first, run_block, run_length);
+
+    if (readahead.pages == 0) {
+        readahead.oft = 0;
+        return;
+    }
+
+    readahead_stats.batches++;
+    readahead_stats.pages += readahead.pages;
+}
+
+// Get the open file table entry for a FD
+// RETURNS:
+//   entry, or 0 if FD is not in use
+open_file_table_t *get_open_file(const int32_t fd) {
+    if (fd < 0 || (uint32_t)fd >= max_open_files) return 0;
+    return open_file_table[fd];
+}
+
+// Double the # of FDs in the open file table
+// RETURNS:
+//   false if out of memory
+bool grow_open_file_table(void) {
+    const uint32_t new_max = max_open_files ? max_open_files * 2 : OPEN_FILE_TABLE_MIN;
+
+    open_file_table_t **new_table = kmalloc(new_max * sizeof *new_table);
+    if (!new_table) return false;
+
+    for (uint32_t i = 0; i < new_max; i++)
+        new_table[i] = (i < max_open_files) ? open_file_table[i] : 0;
+
+    kfree(open_file_table);
+    open_file_table = new_table;
+    max_open_files = new_max;
+    return true;
+}
+
+// Map in & load a page of an open file on its first access, from the page fault handler.
+//   Faults on the pages right after the last ones loaded read further ahead each time
+// RETURNS:
+//   false if address is not in any open file's reserved pages, or the page could not be mapped
+bool load_open_file_page(const uint32_t address) {
+    // Pages read ahead are moved into their files first, this could be one of them
+    readahead_finish();
+
+    for (uint32_t i = 0; i < max_open_files; i++) {
+        open_file_table_t *oft = open_file_table[i];
+        if (!oft) continue;
+
+        const uint32_t start = (uint32_t)oft->address;
+
+        if (oft->ref_count == 0 || start == 0 || 
+            address < start || address - start >= oft->pages_allocated * PAGE_SIZE)
+            continue;
+
+        const uint32_t page = (address - start) / PAGE_SIZE;
+        const uint32_t virt = start + (page * PAGE_SIZE);
+
+        if (!is_address_mapped(current_page_directory, virt)) {
+            // Map a new page: read/write and user accessible
+            void *phys_addr = allocate_blocks(1);
+            if (!phys_addr) return false;
+
+            if (!map_address(current_page_directory, (uint32_t)phys_addr, virt,
+                             PTE_PRESENT | PTE_READ_WRITE | PTE_USER)) {
+                free_blocks(phys_addr, 1);
+                return false;
+            }
+
+            if (!fs_load_file_block(oft->inode, virt, page)) return false;
+            clear_page_dirty(virt);     // Loading it is not a change to write back
+        }
+
+        // Sequential access doubles the read-ahead window, anything else turns it off
+        if (page != oft->next_page) 
+            oft->readahead_pages = 0;
+        else if (oft->readahead_pages < READAHEAD_MIN_PAGES) 
+            oft->readahead_pages = READAHEAD_MIN_PAGES;
+        else if (oft->readahead_pages < READAHEAD_MAX_PAGES) 
+            oft->readahead_pages *= 2;
+
+        // Next fault is at the first page after this one that isn't mapped yet
+        uint32_t next = page + 1;
+        while (next < oft->pages_allocated && next - page <= READAHEAD_MAX_PAGES &&
+               is_address_mapped(current_page_directory, start + (next * PAGE_SIZE)))
+            next++;
+
+        oft->next_page = next;
+        if (oft->readahead_pages > 0) readahead_start(oft, next, oft->readahead_pages);
+        return true;
+    }
+
+    return false;
+}
+
+// Move an open file's pages to a new, larger range of addresses, when its range can not 
+//   grow in place
+bool move_open_file_pages(open_file_table_t *oft, const uint32_t new_pages) {
+    const uint32_t new_address = virtual_ranges_alloc(&file_address_space, new_pages);
+    if (!new_address) return false;     // Error: out of file address space
+
+    // Map the same frames at the new addresses
+    const uint32_t old_address = (uint32_t)oft->address;
+    for (uint32_t i = 0; i < oft->pages_allocated; i++) {
+        const uint32_t old_virt = old_address + (i * PAGE_SIZE);
+        if (!is_address_mapped(current_page_directory, old_virt)) continue;
+
+        // Keep dirty bit, page's changes are still to be flushed
+        pt_entry *page = get_page(old_virt);
+        map_address(current_page_directory, PAGE_PHYS_ADDRESS(page), new_address + (i * PAGE_SIZE),
+                    PTE_PRESENT | PTE_READ_WRITE | PTE_USER | (*page & PTE_DIRTY));
+
+        unmap_page((void *)old_virt);
+        flush_tlb_entry(old_virt);
+    }
+
+    virtual_ranges_free(&file_address_space, old_address, oft->pages_allocated);
+    oft->address = (uint8_t *)new_address;
+    return true;
+}
+
+// Write all open files' changed data and dirty cached metadata blocks to disk
+void flush_open_files(void) {
+    for (uint32_t i = 0; i < max_open_files; i++)
+        if (open_file_table[i] && open_file_table[i]->ref_count > 0) flush_open_file(open_file_table[i]);
+
+    fs_sync();
+    last_file_flush_tick = *timer_ticks;
+}
 
 // Test syscall 0
 int32_t syscall_test0(syscall_regs_t *regs) {
@@ -44,38 +348,9 @@ int32_t syscall_exit(syscall_regs_t *regs) {
     close(1);
     close(2);
 
-    // Release threads
-    int32_t i = 0;
-    Thread *thread = &cur->threads[i];
-
-    // Unmap and release stack memory
-    void *stack_frame = get_physical_address(cur->page_dir, (uint32_t)thread->stack);
-    if (stack_frame) {
-        unmap_address(cur->page_dir, (uint32_t)thread->stack);
-        free_blocks(stack_frame, 1);
-    }
-
-    // Unmap and release args memory
-    void *args_frame = get_physical_address(cur->page_dir, (uint32_t)thread->stack + PAGE_SIZE);
-    if (args_frame) {
-        unmap_address(cur->page_dir, (uint32_t)thread->stack + PAGE_SIZE);
-        free_blocks(args_frame, 1);
-    }
-
-    // Unmap and release program memory
-    for (uint32_t page = 0; page < thread->pgm_size / PAGE_SIZE; page++) {
-        uint32_t virt = thread->pgm_buf + (page * PAGE_SIZE);
-        uint32_t phys = (uint32_t)get_physical_address(cur->page_dir, virt);
-
-        if (phys) {
-            unmap_address(cur->page_dir, virt);
-            free_blocks((void *)phys, 1);
-        }
-    }
-
-    // Unmap malloc memory
-    for (uint32_t p = 0, virt = malloc_start; p < total_malloc_pages; p++, virt += PAGE_SIZE) 
-        unmap_address(current_page_directory, virt);
+    // Unmap and release program memory: program, stack, args & heap are all below the
+    //   program break
+    program_memory_release();
 
     // Restore kernel selectors
     __asm__ __volatile__ ("cli\n"
@@ -97,6 +372,12 @@ int32_t syscall_exit(syscall_regs_t *regs) {
 // INPUTS:
 //  EBX = # of milliseconds
 int32_t syscall_sleep(syscall_regs_t *regs) {
+    // Idle time is a good time to write changed file data to disk, and to defragment a file
+    if (*timer_ticks - last_file_flush_tick >= FILE_FLUSH_INTERVAL_MS) {
+        flush_open_files();
+        fs_defrag_step();
+    }
+
     *sleep_timer_ticks = regs->ebx;  // Set ticks value to sleep for
 
     // Wait ("Sleep") until # of ticks is 0
@@ -104,32 +385,16 @@ int32_t syscall_sleep(syscall_regs_t *regs) {
     return EXIT_SUCCESS;
 }
 
-// Allocate uninitialized memory
+// Move the program break; malloc() in user programs gets pages for its heap with this
 // INPUT:
-//   EBX = size in bytes to allocate
-int32_t syscall_malloc(syscall_regs_t *regs) {
-    uint32_t bytes = regs->ebx;
-
-    // First malloc() from the calling program?
-    if (!malloc_list_head) malloc_init(bytes); // Yes, set up initial memory
-
-    void *ptr = malloc_next_block(bytes);
-
-    merge_free_blocks();    // Combine consecutive free blocks of memory
-
-    // Return pointer to malloc-ed memory
-    regs->edx = (uint32_t)ptr;
-    return EXIT_SUCCESS;
-}
-
-// Free allocated memory at a pointer
-// INPUT:
-//   EBX = pointer to malloc-ed bytes
-int32_t syscall_free(syscall_regs_t *regs) {
-    void *ptr = (void *)regs->ebx;
-
-    malloc_free(ptr);
-    return EXIT_SUCCESS;
+//   EBX = # of bytes to move break by, rounded up to pages; negative to release pages
+// OUTPUT:
+//   EDX = old break, or -1 if out of memory
+int32_t syscall_sbrk(syscall_regs_t *regs) {
+    void *old_break = program_sbrk((int32_t)regs->ebx);
+
+    regs->edx = (uint32_t)old_break;
+    return old_break == (void *)-1 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 // Write system call: Write bytes from a buffer to a file descriptor
@@ -151,10 +416,10 @@ int32_t syscall_write(syscall_regs_t *regs) {
         return terminal_write(buf, len);   
 
     // Get open file table entry for input FD
-    open_file_table_t *oft = open_file_table + fd;
+    open_file_table_t *oft = get_open_file(fd);
 
     // Error: file not found or is not open
-    if (oft->inode == 0 || oft->ref_count == 0) return -1;
+    if (!oft || oft->inode == 0 || oft->ref_count == 0) return -1;
 
     // Check FD's open flags
     if (!(oft->flags & O_WRONLY) && 
@@ -166,63 +431,43 @@ int32_t syscall_write(syscall_regs_t *regs) {
     // Check for O_APPEND flag, if used, set file offset to end of file (current file size)
     if (oft->flags & O_APPEND) oft->offset = oft->inode->size_bytes;
 
-    // Check if current file offset is greater than length/size of file as pages allocated 
-    //  in memory, if so, last seek() call probably went beyond end of file
-    if ((uint32_t)oft->offset > oft->pages_allocated * PAGE_SIZE) {
-        // Allocate additional pages to reach new end of file from previous seek(),
-        //   and zero pad memory 
-        const uint32_t bytes_to_allocate = oft->offset - oft->inode->size_bytes;
-        uint32_t size_in_pages = bytes_to_blocks(bytes_to_allocate);
-        if (size_in_pages == 0) size_in_pages = 1;  // Reserve 1 page by default for new/empty files
-
-        // Allocate pages/blocks for file: read/write and user accessible
-        for (uint32_t i = 0; i < size_in_pages; i++) {
-            uint32_t phys_addr = (uint32_t)allocate_blocks(1);
-            map_address(current_page_directory, phys_addr, next_available_file_virtual_address,
-                        PTE_PRESENT | PTE_READ_WRITE | PTE_USER);
-
-            //if (!map_page((void *)phys_addr, (void *)(next_available_file_virtual_address))) {
-            //    // Error: Couldn't allocate enough additional memory for file
-            //    return -1;
-            //}
-
-            next_available_file_virtual_address += PAGE_SIZE;
-            oft->pages_allocated++;  // File has another page allocated
+    // Check if writing past end of file's reserved pages, e.g. last seek() call probably 
+    //   went beyond end of file. Reserve more pages to reach new end of file; they are mapped 
+    //   and zero filled on first access
+    const uint32_t pages_needed = bytes_to_blocks(oft->offset + len);
+    if (pages_needed > oft->pages_allocated) {
+        if (!virtual_ranges_extend(&file_address_space, (uint32_t)oft->address, 
+                                   oft->pages_allocated, pages_needed) &&
+            !move_open_file_pages(oft, pages_needed)) {
+            // Error: out of file address space
+            return -1;
         }
+        oft->pages_allocated = pages_needed;
+    }
 
-        // Set allocated memory to 0 to initialize it
-        memset(oft->address + oft->inode->size_bytes, 0, bytes_to_allocate);
-
-        // Check if new file size needs another data disk block added to file's extents
-        const uint32_t current_blocks = bytes_to_blocks(oft->inode->size_bytes);
-        const uint32_t new_blocks = bytes_to_blocks(oft->offset);
-
-        if (new_blocks > current_blocks) {
-            // TODO: Allocate more disk blocks to file's extents
-        }
+    // Add disk blocks to file's extents if writing past its last block, with some extra 
+    //   blocks preallocated for further writes
+    if (!fs_grow_file(oft->inode, bytes_to_blocks(oft->offset + len), true)) {
+        // Error: disk is full
+        return -1;
     }
 
     // Write data from input buffer to FD, at file offset
     memcpy32(oft->address + oft->offset, buf, len);
 
+    // Pages written are marked dirty by the CPU, and written to disk at close(), fsync(),
+    //   or the next periodic flush
+
     // Set new file offset from data written
     oft->offset += len;
 
     bytes_written = len;    // Data written
 
-    // Set new file size from data written
+    // Set new file size from data written, inode is written back with other cached metadata
     if ((uint32_t)oft->offset > oft->inode->size_bytes) {
         oft->inode->size_bytes = oft->offset;
         oft->inode->size_sectors = bytes_to_sectors(oft->inode->size_bytes); 
-    }
-
-    // Update file's inode data
-    update_inode_on_disk(*oft->inode);
-
-    // Update file's data on disk
-    if (!fs_save_file(oft->inode, (uint32_t)oft->address)) {
-        // Error saving file
-        return -1;
+        inode_mark_dirty(oft->inode);
     }
 
     // Return number of bytes actually written to FD
@@ -235,133 +480,95 @@ int32_t syscall_open(syscall_regs_t *regs) {
     int32_t flags  = regs->ecx;
     int32_t fd     = -1;
 
-    // Grab inode for given file path
-    inode_t file_inode = inode_from_path(filepath);
+    // Grab inode for given file path, it's held in the inode cache while the file is open
+    inode_t *open_inode = inode_from_path(filepath);
 
     // If file does not exist
-    if (file_inode.id == 0) {
+    if (!open_inode) {
         if (!(flags & O_CREAT)) return fd;  // Error: No create flag for new file
 
         // File doesn't exist, and flags does have O_CREAT,
         //   create file (incl. new inode, and update inode bitmap/data bitmap,
         //   write to inode blocks, data blocks for new data (dir data would be . and ..)
-        file_inode = fs_create_file(filepath);
+        open_inode = fs_create_file(filepath);
 
-        if (file_inode.id == 0) return fd;  // Error: could not create file at path
+        if (!open_inode) return fd;     // Error: could not create file at path
     }
 
-    // Search for file inode in open inode table 
-    inode_t *tmp_inode = open_inode_table;
-    uint32_t inode_tbl_idx = 0;
-    while (inode_tbl_idx < max_open_inodes &&
-           tmp_inode->id != file_inode.id) {
+    open_inode->ref_count++;        // 1 more open use of this file
 
-        inode_tbl_idx++;
-        tmp_inode++;
-    }
-
-    if (file_inode.id == tmp_inode->id) {
-        // If already exists in inode table, increment ref_count in inode
-        tmp_inode->ref_count++;
-    } else {
-        // File is not in inode table, add it
-        // Find first open spot in inode table
-        tmp_inode = open_inode_table;
-        inode_tbl_idx = 0;
-        while (inode_tbl_idx < max_open_inodes &&
-               tmp_inode->id != 0) {
-
-            inode_tbl_idx++;
-            tmp_inode++;
-        }
-
-        //if (inode_tbl_idx == max_open_inodes) {
-        //    // Reached current end of open inode table,
-        //    //   realloc() or expand table size and add a new entry for file
-        //    void *malloc_ptr = malloc(sizeof(inode_t) * (max_open_inodes*2));
-        //    memcpy(malloc_ptr, open_inode_table, sizeof(inode_t) * max_open_inodes);
-        //    free(open_inode_table);
-        //    open_inode_table = malloc_ptr;
-
-        //    tmp_inode = open_inode_table + max_open_inodes; // Go to original max + 1
-        //    *tmp_inode = file_inode;                        // Fill new inode table element
-
-        //    inode_tbl_idx = max_open_inodes+1;
-        //    max_open_inodes *= 2;
-
-        //} else {
-            // Reached open position in inode table, add data to this position
-            *tmp_inode = file_inode; 
-        //}
-        current_open_inodes++;   
-    }
-
-    // Search for open spot in open file table
-    open_file_table_t *tmp_ft_entry = open_file_table;
+    // Search for lowest unused FD, growing the open file table if all are in use
     uint32_t file_tbl_idx = 0; 
+    while (file_tbl_idx < max_open_files && open_file_table[file_tbl_idx]) file_tbl_idx++;
 
-    while (file_tbl_idx < max_open_files &&
-           tmp_ft_entry->address   != 0  && 
-           tmp_ft_entry->ref_count != 0) {
+    open_file_table_t *tmp_ft_entry = 0;
+    if (file_tbl_idx < max_open_files || grow_open_file_table())
+        tmp_ft_entry = slab_alloc(&open_file_cache);
 
-        file_tbl_idx++; 
-        tmp_ft_entry++;
+    if (!tmp_ft_entry) {
+        // Error: out of memory
+        open_inode->ref_count--;
+        inode_put(open_inode);
+        return -1;
     }
 
-    //if (file_tbl_idx == max_open_files) {
-    //    // Reached current end of open inode table,
-    //    //   realloc() or expand table size and add a new entry for file
-    //    void *malloc_ptr = malloc(sizeof(open_file_table_t) * (max_open_files*2));
-    //    memcpy(malloc_ptr, open_file_table, sizeof(open_file_table_t) * max_open_files);
-    //    free(open_file_table);
-    //    open_file_table = malloc_ptr;
-
-    //    tmp_ft_entry = open_file_table + max_open_files;    // Go to original max + 1
-    //    
-    //    file_tbl_idx = max_open_files+1;
-    //    max_open_files *= 2;
-
-    //} 
+    open_file_table[file_tbl_idx] = tmp_ft_entry;
     current_open_files++;   
 
     // Fill out file table entry data
+    memset(tmp_ft_entry, 0, sizeof(open_file_table_t));
     tmp_ft_entry->address   = 0;
     tmp_ft_entry->offset    = 0;
-    tmp_ft_entry->inode     = tmp_inode;
+    tmp_ft_entry->inode     = open_inode;
     tmp_ft_entry->ref_count = 1;
     tmp_ft_entry->flags     = flags;
+    tmp_ft_entry->next_page = 0;
+    tmp_ft_entry->readahead_pages = 0;
 
     // Return FD, which is index of open file table position/entry
     fd = file_tbl_idx;
 
-    tmp_ft_entry->address = (uint8_t *)next_available_file_virtual_address;
-
-    // Load file from disk to memory to fill out address of file table entry
+    // Reserve virtual addresses for the whole file, pages are mapped & loaded from disk on
+    //   first access in the page fault handler
     uint32_t size_in_pages = bytes_to_blocks(tmp_ft_entry->inode->size_bytes);
     if (size_in_pages == 0) size_in_pages = 1;  // Reserve 1 page by default for new/empty files
 
-    // Allocate pages/blocks for file: read/write and user accessible
-    for (uint32_t i = 0; i < size_in_pages; i++) {
-        uint32_t phys_addr = (uint32_t)allocate_blocks(1);
-        map_address(current_page_directory, phys_addr, next_available_file_virtual_address,
-                    PTE_PRESENT | PTE_READ_WRITE | PTE_USER);
+    tmp_ft_entry->address = (uint8_t *)virtual_ranges_alloc(&file_address_space, size_in_pages);
+    tmp_ft_entry->pages_allocated = size_in_pages;
 
-        //if (!map_page((void *)phys_addr, (void *)(next_available_file_virtual_address))) {
-        //    fd = -1;
-        //    return fd;
-        //}
+    if (!tmp_ft_entry->address) {
+        // Error: out of file address space
+        open_inode->ref_count--;
+        inode_put(open_inode);
+        open_file_table[file_tbl_idx] = 0;
+        slab_free(tmp_ft_entry);
+        current_open_files--;
+        return -1;
+    }
 
-        next_available_file_virtual_address += PAGE_SIZE;
-        tmp_ft_entry->pages_allocated++;    // Another page was mapped/allocated for file
+    // Load 1 page files now, it costs the same as on first access and means IRQ handlers
+    //   writing to them (e.g. keyboard to stdin) never wait on the disk
+    if (size_in_pages == 1 && !load_open_file_page((uint32_t)tmp_ft_entry->address)) {
+        // Error: could not load file, page may be mapped without its data
+        const uint32_t file_address = (uint32_t)tmp_ft_entry->address;
+        if (is_address_mapped(current_page_directory, file_address)) {
+            free_page(get_page(file_address));
+            unmap_page((void *)file_address);
+            flush_tlb_entry(file_address);
+        }
+
+        virtual_ranges_free(&file_address_space, file_address, size_in_pages);
+        open_inode->ref_count--;
+        inode_put(open_inode);
+        open_file_table[file_tbl_idx] = 0;
+        slab_free(tmp_ft_entry);
+        current_open_files--;
+        return -1;
     }
 
     if (flags & O_APPEND) 
         tmp_ft_entry->offset = tmp_ft_entry->inode->size_bytes; // Writes will be at end of file 
 
-    // Load file to allocated addresses
-    if (!fs_load_file(tmp_ft_entry->inode, (uint32_t)tmp_ft_entry->address)) 
-      fd = -1; // Error, could not load file
-
     return fd;
 }
 
@@ -372,44 +579,80 @@ int32_t syscall_close(syscall_regs_t *regs) {
     if (fd < 0) return -1;  // Error: Invalid file descriptor
 
     // Get open file table entry corresponding to given file descriptor/fd
-    open_file_table_t *oft = open_file_table + fd;
+    open_file_table_t *oft = get_open_file(fd);
 
     // Error if file not found or is not open
-    if (oft->inode == 0 || oft->ref_count == 0) return -1;
+    if (!oft || oft->inode == 0 || oft->ref_count == 0) return -1;
 
-    // Found fd in table, decrement ref count for file in file table and inode table
+    // Write any changed file data to disk before the file's memory can be freed
+    if (oft->ref_count == 1) flush_open_file(oft);
+
+    // Found fd in table, decrement ref count for file in file table
     oft->ref_count--;
-    oft->inode->ref_count--;
 
-    // Clear open file table entry if no longer in use and free memory used
-    //   for file
-    // TODO: This assumes virtual addresses are contiguous for each file, that is not
-    //  guaranteed to be the case. Update to take this into account to get the actual virtual
-    //  addresses that were mapped/allocated for the file
+    // Clear open file table entry if no longer in use, free memory used for file and
+    //   its range of addresses; pages that were never accessed were never mapped
     if (oft->ref_count == 0) {
-        uint32_t size_in_pages = bytes_to_blocks(oft->inode->size_bytes);
-        if (size_in_pages == 0) size_in_pages = 1;  // Files use 1 page by default 
+        if (readahead.oft == oft) readahead_finish();   // Pages in flight are freed below
 
         uint32_t file_address = (uint32_t)oft->address;
 
-        while (size_in_pages-- > 0) {
+        for (uint32_t i = 0; i < oft->pages_allocated; i++, file_address += PAGE_SIZE) {
+            if (!is_address_mapped(current_page_directory, file_address)) continue;
+
             pt_entry *page = get_page(file_address);
             free_page(page);
             unmap_page((void *)file_address);
             flush_tlb_entry(file_address);  // Invalidate page as it is no longer present
-            file_address += PAGE_SIZE;
         }
 
-        // If inode ref count = 0, clear open inode table entry as file is no longer open/in use
-        if (oft->inode->ref_count == 0) 
-            memset(oft->inode, 0, sizeof(inode_t));
+        virtual_ranges_free(&file_address_space, (uint32_t)oft->address, oft->pages_allocated);
+
+        // Release preallocated blocks the file did not use, if no other open file uses its inode
+        bool inode_in_use = false;
+        for (uint32_t i = 0; i < max_open_files; i++)
+            if (open_file_table[i] && open_file_table[i]->ref_count > 0 && open_file_table[i]->inode == oft->inode) 
+                inode_in_use = true;
+
+        if (!inode_in_use && fs_trim_file(oft->inode)) inode_mark_dirty(oft->inode);
+
+        // 1 less open use of the file, inode stays cached until its entry is reused
+        oft->inode->ref_count--;
+        inode_put(oft->inode);
 
-        memset(oft, 0, sizeof(open_file_table_t));  // Clear file table entry
+        // Free file table entry, FD can be reused
+        open_file_table[fd] = 0;
+        slab_free(oft);
+        current_open_files--;
     }
 
     return 0;   // Success
 }
 
+// Fsync system call: write an open file's changed data and metadata to disk
+int32_t syscall_fsync(syscall_regs_t *regs) {
+    int32_t fd = regs->ebx;
+
+    if (fd < 0) return -1;  // Error: Invalid file descriptor
+
+    open_file_table_t *oft = get_open_file(fd);
+
+    // Error if file not found or is not open
+    if (!oft || oft->inode == 0 || oft->ref_count == 0) return -1;
+
+    if (!flush_open_file(oft)) return -1;
+
+    fs_sync();      // File's inode & other metadata
+    return 0;
+}
+
+// Sync system call: write all open files' changed data and metadata to disk
+int32_t syscall_sync(syscall_regs_t *regs) {
+    (void)regs;
+    flush_open_files();
+    return 0;
+}
+
 // Read system call: read bytes from an open file to a buffer
 int32_t syscall_read(syscall_regs_t *regs) {
     int32_t  fd   = regs->ebx;
@@ -421,10 +664,10 @@ int32_t syscall_read(syscall_regs_t *regs) {
     if (fd < 0) return -1;  // Invalid FD
 
     // Get open file table entry for FD
-    open_file_table_t *oft = open_file_table + fd;
+    open_file_table_t *oft = get_open_file(fd);
     
     // Check if file is open and valid
-    if (oft->address == 0 || oft->ref_count == 0) return -1;
+    if (!oft || oft->address == 0 || oft->ref_count == 0) return -1;
 
     // Check FD's open flags
     if (oft->flags & O_WRONLY) return -1;   // Error: FD is only open for writing
@@ -457,10 +700,10 @@ int32_t syscall_seek(syscall_regs_t *regs) {
     if (fd < 0) return -1;
 
     // Get open file table entry corresponding to given file descriptor/fd
-    open_file_table_t *oft = open_file_table + fd;
+    open_file_table_t *oft = get_open_file(fd);
 
     // Error if file not found or is not open
-    if (oft->inode == 0 || oft->ref_count == 0) return -1;
+    if (!oft || oft->inode == 0 || oft->ref_count == 0) return -1;
 
     switch(whence) {
         // Set file offset to function arg offset
@@ -500,13 +743,14 @@ int32_t (*syscalls[MAX_SYSCALLS])(syscall_regs_t *) = {
     [SYSCALL_TEST0]  = syscall_test0,
     [SYSCALL_EXIT]   = syscall_exit,
     [SYSCALL_SLEEP]  = syscall_sleep,
-    [SYSCALL_MALLOC] = syscall_malloc,
-    [SYSCALL_FREE]   = syscall_free,
+    [SYSCALL_SBRK]   = syscall_sbrk,
     [SYSCALL_OPEN]   = syscall_open,
     [SYSCALL_CLOSE]  = syscall_close,
     [SYSCALL_READ]   = syscall_read,
     [SYSCALL_WRITE]  = syscall_write,
     [SYSCALL_SEEK]   = syscall_seek,
+    [SYSCALL_FSYNC]  = syscall_fsync,
+    [SYSCALL_SYNC]   = syscall_sync,
 };
 
 // Syscall dispatcher: C function caller
@@ -515,8 +759,8 @@ int32_t (*syscalls[MAX_SYSCALLS])(syscall_regs_t *) = {
 //  all the registers/values pushed on the stack i.e. the syscall_regs_t struct *regs here,
 //  so that *regs has the correct register values for the syscall 
 syscall_regs_t *do_syscall(syscall_regs_t *regs) {
-    if (regs->syscall_num >= MAX_SYSCALLS) {
-        regs->eax = -1;         // Invalid syscall #
+    if (regs->syscall_num >= MAX_SYSCALLS || !syscalls[regs->syscall_num]) {
+        regs->eax = -1;         // Invalid or reserved syscall #
     } else {
         regs->eax = syscalls[regs->syscall_num](regs);    // Call system call
     }
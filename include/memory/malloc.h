@@ -1,137 +1,316 @@
 /*
- *  malloc.h: Malloc() & Free() C function implementations
+ *  malloc.h: Malloc() & Free() C function implementations, runs in the calling program; the
+ *    kernel is only asked for more pages with sbrk(), so most calls make no system call.
+ *    For user programs only, the kernel uses kmalloc() & kfree() from memory/slab.h
+ *
+ *  Two level segregated fit (TLSF) allocator: free blocks are kept in lists by size class, a
+ *    power of 2 range (first level) split into 16 linear steps (second level), with a bitmap
+ *    of non-empty lists for each level. Finding a free block that fits is a couple of bit
+ *    scans, and each block's header holds the size of the block before it when that block is
+ *    free (a boundary tag), so freed blocks merge with their neighbours right away. malloc()
+ *    and free() don't walk any lists.
+ *
+ *  Each thread allocates from its own arena, so threads won't need to share a lock. Programs
+ *    have 1 thread for now, so there is 1 arena, and free() gives blocks back to it
  */
 #pragma once
 
 #include "C/stdint.h"
 #include "C/stdbool.h"
-#include "memory/physical_memory_manager.h"
-#include "memory/virtual_memory_manager.h"
+#include "C/string.h"
+#include "sys/syscall_wrappers.h"
 
 #define PAGE_SIZE 4096
 
-// Singly linked list nodes for blocks of memory
+#define MALLOC_ALIGN       8
+#define MALLOC_SL_LOG2     4                            // 16 second level lists per power of 2
+#define MALLOC_SL_COUNT    (1 << MALLOC_SL_LOG2)
+#define MALLOC_FL_SHIFT    (MALLOC_SL_LOG2 + 3)         // Blocks < 128 bytes are first level 0, in 8 byte steps
+#define MALLOC_FL_COUNT    (32 - MALLOC_FL_SHIFT + 1)
+#define MALLOC_MAX_SIZE    0x3C000000                   // Program memory is below ~1GB
+#define MAX_ARENAS         1                            // 1 per thread
+
+// Block size flags, sizes are multiples of 8 so the low bits are free
+#define MALLOC_FREE        0x1  // This block is free
+#define MALLOC_PREV_FREE   0x2  // Block before this one is free, prev_size is valid
+
+// Block of memory. Allocated blocks only use the 8 byte header, the free list links are in
+//   the space malloc() returns
 typedef struct malloc_block {
-    uint32_t size;  // Size of this memory block in bytes
-    bool free;      // Is this block of memory free?
-    struct malloc_block *next;  // Next block of memory
+    uint32_t prev_size;                 // Size of block before this one, only valid if it is free
+    uint32_t size;                      // Size of this block in bytes incl. header, and flags
+    struct malloc_block *next_free;     // Free list links, only in free blocks
+    struct malloc_block *prev_free;
 } malloc_block_t;
 
-static malloc_block_t *malloc_list_head = 0;    // Start of linked list
-static uint32_t malloc_virt_address     = 0;
-static uint32_t malloc_phys_address     = 0;
-static uint32_t total_malloc_pages      = 0;
-static uint32_t malloc_start            = 0;
-
-// Initialize malloc bytes/linked list for first malloc() call from a program
-void malloc_init(const uint32_t bytes)
-{
-    total_malloc_pages = bytes / PAGE_SIZE;
-    if (bytes % PAGE_SIZE > 0) total_malloc_pages++;    // Partial page
-
-    // TODO: Change to allocate individual pages in case available physical memory is not contiguous
-    malloc_phys_address = (uint32_t)allocate_blocks(total_malloc_pages);
-    malloc_list_head    = (malloc_block_t *)malloc_virt_address;
-
-    // Map in pages
-    for (uint32_t i = 0, virt = malloc_virt_address; i < total_malloc_pages; i++, virt += PAGE_SIZE) 
-        map_address(current_page_directory, malloc_phys_address + i*PAGE_SIZE, virt,
-                    PTE_PRESENT | PTE_READ_WRITE | PTE_USER);
-
-    if (malloc_list_head) {
-        malloc_list_head->size = (total_malloc_pages * PAGE_SIZE) - sizeof(malloc_block_t);
-        malloc_list_head->free = true;
-        malloc_list_head->next = 0;
+// Heap stats from malloc_stats(). Fragmentation is how much of the free space is not in the
+//   largest free block: 1 - largest_free_block / free_bytes
+typedef struct {
+    uint32_t heap_bytes;            // Total size of heap
+    uint32_t used_bytes;            // Bytes in allocated blocks, incl. headers
+    uint32_t peak_used_bytes;
+    uint32_t free_bytes;
+    uint32_t free_blocks;
+    uint32_t largest_free_block;
+    uint32_t allocs;
+    uint32_t frees;
+} malloc_stats_t;
+
+#define MALLOC_HEADER_SIZE 8
+#define MALLOC_MIN_BLOCK   sizeof(malloc_block_t)
+
+// Free lists & heap of 1 thread. A heap is 1 or more runs of pages from sbrk(), each ending
+//   in an empty "end" block
+typedef struct {
+    malloc_block_t *free_lists[MALLOC_FL_COUNT][MALLOC_SL_COUNT];
+    uint32_t fl_bitmap;                     // Bit n = first level n has free blocks
+    uint32_t sl_bitmap[MALLOC_FL_COUNT];    // Bit n = second level list n is not empty
+    uint32_t heap_end;                      // End of last run of pages, 0 = no pages yet
+    malloc_stats_t stats;
+} malloc_arena_t;
+
+static malloc_arena_t malloc_arenas[MAX_ARENAS];
+
+// Get the calling thread's arena
+malloc_arena_t *this_thread_arena(void) {
+    return &malloc_arenas[0];
+}
+
+// Get a block's size without flags
+uint32_t malloc_block_size(const malloc_block_t *block) {
+    return block->size & ~(MALLOC_ALIGN-1);
+}
+
+// Get the block after a block in memory
+malloc_block_t *malloc_block_after(const malloc_block_t *block) {
+    return (malloc_block_t *)((uint8_t *)block + malloc_block_size(block));
+}
+
+// Get first & second level list indexes for a block size
+void malloc_mapping(const uint32_t size, uint32_t *fl, uint32_t *sl) {
+    if (size < (1 << MALLOC_FL_SHIFT)) {
+        *fl = 0;
+        *sl = size / MALLOC_ALIGN;
+    } else {
+        const uint32_t bit = 31 - __builtin_clz(size);
+        *fl = bit - MALLOC_FL_SHIFT + 1;
+        *sl = (size >> (bit - MALLOC_SL_LOG2)) ^ MALLOC_SL_COUNT;
     }
 }
 
-// Split linked list node/memory block into two by inserting a new block with
-//   the size of the difference of original block and requested size
-void malloc_split(malloc_block_t *node, const uint32_t size)
-{
-    malloc_block_t *new_node = (malloc_block_t *)((char *)node + size + sizeof(malloc_block_t));
+// Add a free block to its size class list
+void malloc_insert(malloc_arena_t *arena, malloc_block_t *block) {
+    uint32_t fl = 0, sl = 0;
+    malloc_mapping(malloc_block_size(block), &fl, &sl);
 
-    new_node->size = node->size - size - sizeof(malloc_block_t);
-    new_node->free = true;
-    new_node->next = node->next;
+    block->prev_free = 0;
+    block->next_free = arena->free_lists[fl][sl];
+    if (block->next_free) block->next_free->prev_free = block;
+    arena->free_lists[fl][sl] = block;
 
-    node->size = size;
-    node->free = false;
-    node->next = new_node;
+    arena->fl_bitmap     |= 1u << fl;
+    arena->sl_bitmap[fl] |= 1u << sl;
 }
 
-// Find & allocate next block of memory
-void *malloc_next_block(const uint32_t size)
-{
-    malloc_block_t *cur = 0;
+// Remove a free block from its size class list
+void malloc_remove(malloc_arena_t *arena, malloc_block_t *block) {
+    uint32_t fl = 0, sl = 0;
+    malloc_mapping(malloc_block_size(block), &fl, &sl);
 
-    // Nothing to malloc
-    if (size == 0) return 0;
+    if (block->prev_free) block->prev_free->next_free = block->next_free;
+    else arena->free_lists[fl][sl] = block->next_free;
 
-    // If no bytes in list to malloc, init it first
-    if (!malloc_list_head->size) malloc_init(size);
+    if (block->next_free) block->next_free->prev_free = block->prev_free;
 
-    // Find first available block in list
-    cur = malloc_list_head;
-    while (((cur->size < size) || !cur->free) && cur->next) {
-        cur = cur->next;
+    if (!arena->free_lists[fl][sl]) {
+        arena->sl_bitmap[fl] &= ~(1u << sl);
+        if (!arena->sl_bitmap[fl]) arena->fl_bitmap &= ~(1u << fl);
     }
+}
 
-    if (size == cur->size) {
-        // Node size is what we are looking for
-        cur->free = false;
-    } else if (cur->size > size + sizeof(malloc_block_t)) {
-        // Node is larger than what we need, split it into 2 nodes,
-        //   will return current node for requested size
-        malloc_split(cur, size);
-    } else {
-        // Node is too small, allocate more pages to current node, and split
-        //   to return a node of requested size
-        uint8_t num_pages = 1;
-        while (cur->size + num_pages*PAGE_SIZE < size + sizeof(malloc_block_t))
-            num_pages++;
-
-        // Allocate & map in new pages starting at next virtual address page boundary (next 0x1000/4KB)
-        uint32_t virt = malloc_virt_address + total_malloc_pages*PAGE_SIZE;
-
-        for (uint8_t i = 0; i < num_pages; i++) {
-            uint32_t temp = (uint32_t)allocate_blocks(1);
-            map_address(current_page_directory, temp, virt,
-                        PTE_PRESENT | PTE_READ_WRITE | PTE_USER);
-
-            virt += PAGE_SIZE;
-            cur->size += PAGE_SIZE;
-            total_malloc_pages++;
-        }
+// Find a free block in the size class of a size or any larger class. Every block in a class
+//   must fit, so the size is rounded up to the next class first, unless it starts one
+// RETURNS:
+//   free block, or 0 if none fit
+malloc_block_t *malloc_find_free(const malloc_arena_t *arena, const uint32_t size) {
+    uint32_t rounded = size;
+    if (size >= (1 << MALLOC_FL_SHIFT))
+        rounded += (1u << (31 - __builtin_clz(size) - MALLOC_SL_LOG2)) - 1;
+
+    uint32_t fl = 0, sl = 0;
+    malloc_mapping(rounded, &fl, &sl);
 
-        malloc_split(cur, size);
+    uint32_t sl_map = arena->sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        const uint32_t fl_map = arena->fl_bitmap & (~0u << (fl+1));
+        if (!fl_map) return 0;
+
+        fl = __builtin_ctz(fl_map);
+        sl_map = arena->sl_bitmap[fl];
     }
-        
-    // Return node pointing to requested bytes, casted to void * to remove pointer
-    //   arithmetic
-    return (char *)cur + sizeof(malloc_block_t);
+
+    return arena->free_lists[fl][__builtin_ctz(sl_map)];
 }
 
-// Merge consecutive free list nodes to prevent (some) memory fragmentation
-void merge_free_blocks(void)
-{
-    malloc_block_t *cur = malloc_list_head;
+// Mark a block free, merge it with free blocks before & after it, and add it to its list
+void malloc_release_block(malloc_arena_t *arena, malloc_block_t *block) {
+    uint32_t size = malloc_block_size(block);
+    malloc_block_t *next = malloc_block_after(block);
 
-    while (cur && cur->next) {
-        if (cur->free && cur->next->free) {
-            cur->size += (cur->next->size) + sizeof(malloc_block_t);
-            cur->next = cur->next->next;
-        }
-        cur = cur->next;
+    if (block->size & MALLOC_PREV_FREE) {
+        malloc_block_t *prev = (malloc_block_t *)((uint8_t *)block - block->prev_size);
+        malloc_remove(arena, prev);
+        size += block->prev_size;
+        block = prev;
+    }
+
+    if (next->size & MALLOC_FREE) {
+        malloc_remove(arena, next);
+        size += malloc_block_size(next);
+        next = malloc_block_after(next);
     }
+
+    // Block before a free block is never free after merging
+    block->size = size | MALLOC_FREE;
+    next->prev_size = size;
+    next->size |= MALLOC_PREV_FREE;
+
+    malloc_insert(arena, block);
+}
+
+// Get more pages from sbrk(), so the last block is free & fits a size after merging with it.
+//   If the break moved since the last call, the pages start a new run
+// RETURNS:
+//   true if last block fits, false if out of memory
+bool malloc_grow(malloc_arena_t *arena, const uint32_t size) {
+    malloc_block_t *end = (malloc_block_t *)(arena->heap_end - MALLOC_HEADER_SIZE);
+
+    // Last block can fit already when malloc_find_free() rounded the size past its class
+    if (arena->heap_end != 0 && (end->size & MALLOC_PREV_FREE) && end->prev_size >= size)
+        return true;
+
+    const bool contiguous = arena->heap_end != 0 && (uint32_t)sbrk(0) == arena->heap_end;
+    const uint32_t last_free = (contiguous && (end->size & MALLOC_PREV_FREE)) ? end->prev_size : 0;
+
+    // New pages start with the old end block, or hold a new end block in a new run
+    const uint32_t needed = size - last_free + (contiguous ? 0 : MALLOC_HEADER_SIZE);
+    const uint32_t pages = (needed + PAGE_SIZE-1) / PAGE_SIZE;
+
+    const uint32_t start = (uint32_t)sbrk(pages*PAGE_SIZE);
+    if (start == (uint32_t)-1) return false;
+
+    // Old end block becomes the start of a new block over the new pages
+    malloc_block_t *block = contiguous ? end : (malloc_block_t *)start;
+    block->size = contiguous ? (pages*PAGE_SIZE | (end->size & MALLOC_PREV_FREE))
+                             : pages*PAGE_SIZE - MALLOC_HEADER_SIZE;
+
+    arena->heap_end = start + pages*PAGE_SIZE;
+    end = (malloc_block_t *)(arena->heap_end - MALLOC_HEADER_SIZE);
+    end->prev_size = 0;
+    end->size = 0;
+
+    malloc_release_block(arena, block);
+    arena->stats.heap_bytes += pages*PAGE_SIZE;
+    return true;
 }
 
-void malloc_free(void *ptr)
-{
-    for (malloc_block_t *cur = malloc_list_head; cur->next; cur = cur->next) 
-        if ((char *)cur + sizeof(malloc_block_t) == ptr) {
-            cur->free = true;
-            merge_free_blocks();
-            break;
+// Allocate a block of memory
+// RETURNS:
+//   pointer to at least size bytes, 8 byte aligned; or 0 if size is 0 or out of memory
+void *malloc_alloc(const uint32_t bytes) {
+    if (bytes == 0 || bytes > MALLOC_MAX_SIZE) return 0;
+
+    uint32_t size = (bytes + MALLOC_HEADER_SIZE + MALLOC_ALIGN-1) & ~(MALLOC_ALIGN-1);
+    if (size < MALLOC_MIN_BLOCK) size = MALLOC_MIN_BLOCK;
+
+    malloc_arena_t *arena = this_thread_arena();
+
+    malloc_block_t *block = malloc_find_free(arena, size);
+    if (!block) {
+        // Grow heap just enough if needed, and use the free block at its end
+        if (!malloc_grow(arena, size)) return 0;
+
+        const malloc_block_t *end = (malloc_block_t *)(arena->heap_end - MALLOC_HEADER_SIZE);
+        block = (malloc_block_t *)((uint8_t *)end - end->prev_size);
+    }
+
+    malloc_remove(arena, block);
+
+    // Split off the rest of the block if it can be a free block
+    const uint32_t rest = malloc_block_size(block) - size;
+    malloc_block_t *next = malloc_block_after(block);
+
+    if (rest >= MALLOC_MIN_BLOCK) {
+        block->size = size | (block->size & MALLOC_PREV_FREE);
+
+        malloc_block_t *split = malloc_block_after(block);
+        split->size = rest | MALLOC_FREE;
+        next->prev_size = rest;
+        malloc_insert(arena, split);
+    } else {
+        block->size &= ~MALLOC_FREE;
+        next->size &= ~MALLOC_PREV_FREE;
+    }
+
+    arena->stats.allocs++;
+    arena->stats.used_bytes += malloc_block_size(block);
+    if (arena->stats.used_bytes > arena->stats.peak_used_bytes)
+        arena->stats.peak_used_bytes = arena->stats.used_bytes;
+
+    return (uint8_t *)block + MALLOC_HEADER_SIZE;
+}
+
+// Free a block of memory from malloc_alloc(). Null & unaligned pointers, and free blocks are
+//   ignored
+void malloc_free(void *ptr) {
+    const uint32_t address = (uint32_t)ptr;
+    if (!ptr || address % MALLOC_ALIGN != 0) return;
+
+    malloc_block_t *block = (malloc_block_t *)(address - MALLOC_HEADER_SIZE);
+    if (block->size & MALLOC_FREE) return;
+
+    malloc_arena_t *arena = this_thread_arena();
+    arena->stats.frees++;
+    arena->stats.used_bytes -= malloc_block_size(block);
+
+    malloc_release_block(arena, block);
+}
+
+// Get the calling thread's heap stats; free block counts are from walking the free lists
+void malloc_stats(malloc_stats_t *stats) {
+    const malloc_arena_t *arena = this_thread_arena();
+
+    *stats = arena->stats;
+
+    for (uint32_t fl = 0; fl < MALLOC_FL_COUNT; fl++) {
+        for (uint32_t sl = 0; sl < MALLOC_SL_COUNT; sl++) {
+            for (malloc_block_t *block = arena->free_lists[fl][sl]; block; block = block->next_free) {
+                const uint32_t size = malloc_block_size(block);
+
+                stats->free_blocks++;
+                stats->free_bytes += size;
+                if (size > stats->largest_free_block) stats->largest_free_block = size;
+            }
         }
+    }
+}
+
+// Allocate uninitialized memory, from the program's heap
+void *malloc(const uint32_t size) {
+    return malloc_alloc(size);
+}
+
+// Allocate memory and initialize to 0
+void *calloc(const uint32_t num, const uint32_t size) {
+    if (size != 0 && num > 0xFFFFFFFF / size) return 0;     // Overflow
+
+    void *ptr = malloc_alloc(num*size);
+
+    if (ptr) memset(ptr, 0, num*size);
+    return ptr;
+}
+
+// Free allocated memory at a pointer
+void free(const void *ptr) {
+    malloc_free((void *)ptr);
 }
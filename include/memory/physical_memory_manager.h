@@ -1,17 +1,58 @@
 /*
  *  physical_memory_manager.h: Provide functions to allocate/free or handle blocks of physical
  *      memory
+ *
+ *  The bootloader marks used & reserved blocks in a bitmap, and allocates from it with a
+ *  first fit scan. The kernel then builds a buddy allocator from the available regions
+ *  in the E820 memory map: a free block of 2^order memory blocks starts at a multiple of
+ *  2^order, and is joined with its "buddy" of the same size when both are free. The bitmap
+ *  is still kept up to date as a view of used blocks
  */
 #pragma once
 
+#include "C/stdint.h"
+#include "C/stdbool.h"
+#include "global/global_addresses.h"
+
 #define BLOCK_SIZE      4096     // Size of 1 block of memory, 4KB
 #define BLOCKS_PER_BYTE 8        // Using a bitmap, each byte will hold 8 bits/blocks
+#define BUDDY_ORDERS    11       // Free blocks of 1 to 1024 memory blocks, 4KB to 4MB
+#define MAX_CPUS        1
+#define FRAME_CACHE_SIZE  32     // Most free single blocks cached per CPU
+#define FRAME_CACHE_BATCH 16     // Blocks moved between a CPU's cache & buddy allocator at once
+
+// Words of storage for the buddy allocator's free block bitmaps, for a # of memory blocks
+#define BUDDY_MAP_WORDS(blocks) ((blocks) / 16 + BUDDY_ORDERS)
 
 // Global variables
 static uint32_t *memory_map = 0;
 static uint32_t max_blocks  = 0;
 static uint32_t used_blocks = 0;
 
+// Buddy allocator: each order has a bitmap of its free blocks, 1 bit per 2^order memory
+//   blocks. Frames above the kernel's identity mapped memory can't hold list pointers, so
+//   free "lists" are bitmaps, searched from the lowest address
+static uint32_t *buddy_map = 0;                 // 0 = not set up, allocate from bitmap
+static uint32_t buddy_offset[BUDDY_ORDERS];     // Word offset of each order's bitmap in buddy_map
+static uint32_t buddy_words[BUDDY_ORDERS];      // # of words in each order's bitmap
+static uint32_t buddy_hint[BUDDY_ORDERS];       // 1st word of each order's bitmap that can have a free block
+static uint32_t buddy_free[BUDDY_ORDERS];       // # of free blocks of each order
+
+// Per CPU cache of free single memory blocks, most recently freed last. Blocks in a cache
+//   count as used in the bitmap & used_blocks, so 1 block allocs and frees only push/pop
+typedef struct {
+    uint32_t count;
+    uint32_t blocks[FRAME_CACHE_SIZE];
+} frame_cache_t;
+
+static frame_cache_t frame_cache[MAX_CPUS];
+
+// Get current CPU's frame cache, only 1 CPU for now
+frame_cache_t *this_cpu_frame_cache(void)
+{
+    return &frame_cache[0];
+}
+
 // Sets a block/bit in the memory map (mark block as used)
 void set_block(const uint32_t bit)
 {
@@ -46,36 +87,188 @@ int32_t find_first_free_blocks(const uint32_t num_blocks)
 {
     if (num_blocks == 0) return -1; // Can't return no memory, error
 
-    // Test 32 blocks at a time
-    for (uint32_t i = 0; i < max_blocks / 32;  i++) {
-        if (memory_map[i] != 0xFFFFFFFF) {
-            // At least 1 bit is not set within this 32bit chunk of memory,
-            //   find that bit by testing each bit
-            for (int32_t j = 0; j < 32; j++) {
-                int32_t bit = 1 << j;
-
-                // If bit is unset/0, found start of a free region of memory
-                if (!(memory_map[i] & bit)) {
-                    for (uint32_t count = 0, free_blocks = 0; count < num_blocks; count++) {
-                        if ((j+count > 31) && (i+1 <= max_blocks / 32)) {
-                            if (!(memory_map[i+1] & (1 << ((j+count)-32))))
-                                free_blocks++;
-                        } else {
-                            if (!(memory_map[i] & (1 << (j+count))))
-                                free_blocks++;
-                        }
-
-                        if (free_blocks == num_blocks) // Found enough free space
-                            return i*32 + j;
-                    }
-                }
-            }
+    // Count free blocks in a row, across 32bit chunks; skip full chunks 32 blocks at a time
+    for (uint32_t bit = 0, run = 0; bit < max_blocks; bit++) {
+        if (bit % 32 == 0 && memory_map[bit/32] == 0xFFFFFFFF) {
+            run = 0;
+            bit += 31;
+            continue;
         }
+
+        if (memory_map[bit/32] & (1 << (bit % 32)))
+            run = 0;
+        else if (++run == num_blocks)
+            return bit - (num_blocks - 1);  // Found enough free space
     }
 
     return -1;  // No free region of memory large enough
 }
 
+// Test if a buddy block is free
+bool buddy_test(const uint32_t order, const uint32_t block)
+{
+    return buddy_map[buddy_offset[order] + block/32] & (1 << (block % 32));
+}
+
+// Add a free buddy block to its order's bitmap
+void buddy_set(const uint32_t order, const uint32_t block)
+{
+    buddy_map[buddy_offset[order] + block/32] |= (1 << (block % 32));
+    if (block/32 < buddy_hint[order]) buddy_hint[order] = block/32;
+    buddy_free[order]++;
+}
+
+// Remove a free buddy block from its order's bitmap
+void buddy_clear(const uint32_t order, const uint32_t block)
+{
+    buddy_map[buddy_offset[order] + block/32] &= ~(1 << (block % 32));
+    buddy_free[order]--;
+}
+
+// Free a buddy block, joining it with its buddy for each order where the buddy is free too
+void buddy_free_block(uint32_t block, uint32_t order)
+{
+    for (; order < BUDDY_ORDERS-1; order++, block /= 2) {
+        const uint32_t buddy = block ^ 1;
+
+        if (buddy >= (max_blocks >> order) || !buddy_test(order, buddy)) break;
+        buddy_clear(order, buddy);
+    }
+
+    buddy_set(order, block);
+}
+
+// Free a run of memory blocks into the buddy allocator, as the largest aligned buddy blocks
+//   that fit in it
+void buddy_free_run(uint32_t start, uint32_t num_blocks)
+{
+    while (num_blocks > 0) {
+        uint32_t order = start ? __builtin_ctz(start) : BUDDY_ORDERS-1;
+        if (order > BUDDY_ORDERS-1) order = BUDDY_ORDERS-1;
+        while ((1u << order) > num_blocks) order--;
+
+        buddy_free_block(start >> order, order);
+        start      += 1 << order;
+        num_blocks -= 1 << order;
+    }
+}
+
+// Find the free buddy block with the lowest address of an order
+int32_t buddy_find(const uint32_t order)
+{
+    for (uint32_t i = buddy_hint[order]; i < buddy_words[order]; i++) {
+        const uint32_t word = buddy_map[buddy_offset[order] + i];
+        if (word) return i*32 + __builtin_ctz(word);
+
+        buddy_hint[order] = i+1;    // Words before a nonzero one stay empty until a free
+    }
+
+    return -1;
+}
+
+// Allocate a buddy block of an order, splitting a larger one if there are none free
+int32_t buddy_alloc_block(const uint32_t order)
+{
+    for (uint32_t larger = order; larger < BUDDY_ORDERS; larger++) {
+        int32_t block = buddy_find(larger);
+        if (block == -1) continue;
+
+        buddy_clear(larger, block);
+
+        // Keep lower half of each split, upper half is free
+        for (; larger > order; larger--) {
+            block *= 2;
+            buddy_set(larger-1, block+1);
+        }
+
+        return block << order;  // 1st memory block
+    }
+
+    return -1;
+}
+
+// Allocate a run of more memory blocks than the largest buddy block: find enough free
+//   largest blocks in a row
+int32_t buddy_alloc_large(const uint32_t num_blocks)
+{
+    const uint32_t order = BUDDY_ORDERS-1;
+    const uint32_t count = (num_blocks + (1 << order)-1) >> order;
+
+    for (uint32_t block = 0, run = 0; block < (max_blocks >> order); block++) {
+        if (!buddy_test(order, block)) {
+            run = 0;
+            continue;
+        }
+
+        if (++run < count) continue;
+
+        const uint32_t first = block - (count-1);
+        for (uint32_t i = first; i <= block; i++) buddy_clear(order, i);
+        return first << order;
+    }
+
+    return -1;
+}
+
+// Allocate a run of memory blocks from the buddy allocator. Blocks past num_blocks in the
+//   buddy block are freed again, so runs do not have to be a power of 2
+int32_t buddy_alloc(const uint32_t num_blocks)
+{
+    if (num_blocks == 0) return -1;
+
+    uint32_t order = 0;
+    while (order < BUDDY_ORDERS && (1u << order) < num_blocks) order++;
+
+    int32_t start = -1;
+    uint32_t size = 0;
+
+    if (order < BUDDY_ORDERS) {
+        start = buddy_alloc_block(order);
+        size  = 1 << order;
+    } else {
+        start = buddy_alloc_large(num_blocks);
+        size  = ((num_blocks + (1 << (BUDDY_ORDERS-1))-1) >> (BUDDY_ORDERS-1)) << (BUDDY_ORDERS-1);
+    }
+
+    if (start != -1 && size > num_blocks) buddy_free_run(start + num_blocks, size - num_blocks);
+    return start;
+}
+
+// Set up buddy allocator with the blocks the bitmap has free. The bitmap already holds the
+//   available regions of the E820 memory map less reserved areas, and each block is read once,
+//   so overlapping or repeated regions can't free a block twice.
+//   Storage needs BUDDY_MAP_WORDS(max_blocks) words
+bool initialize_buddy_allocator(uint32_t *storage, const uint32_t storage_words)
+{
+    // Lay out each order's bitmap in storage
+    uint32_t words = 0;
+    for (uint32_t order = 0; order < BUDDY_ORDERS; order++) {
+        buddy_offset[order] = words;
+        buddy_words[order]  = ((max_blocks >> order) + 31) / 32;
+        buddy_hint[order]   = 0;
+        buddy_free[order]   = 0;
+        words += buddy_words[order];
+    }
+
+    if (words > storage_words) return false;    // Keep using bitmap
+
+    buddy_map = storage;
+    memset(buddy_map, 0, words * sizeof(uint32_t));
+
+    // Add runs of free blocks
+    for (uint32_t block = 0, run = 0; block <= max_blocks; block++) {
+        if (block < max_blocks && !(memory_map[block/32] & (1 << (block % 32)))) {
+            run++;
+            continue;
+        }
+
+        if (run) buddy_free_run(block - run, run);
+        run = 0;
+    }
+
+    return true;
+}
+
 // Initialize memory manager, given an address and size to put the memory map
 void initialize_memory_manager(const uint32_t start_address, const uint32_t size)
 {
@@ -110,19 +303,61 @@ void deinitialize_memory_region(const uint32_t base_address, const uint32_t size
     int32_t align      = base_address / BLOCK_SIZE;  // Convert memory address to blocks
     int32_t num_blocks = size / BLOCK_SIZE;          // Convert size to blocks
 
+    // Also reserve a partially used last block, e.g. a memory map smaller than 1 block
+    if (size % BLOCK_SIZE) num_blocks++;
+
     for (; num_blocks > 0; num_blocks--) {
         set_block(align++);
         used_blocks++;
     }
 }
 
+// Move a batch of free blocks from the buddy allocator into a frame cache, as 1 run if there
+//   is one free, lowest block on top
+void frame_cache_refill(frame_cache_t *cache)
+{
+    int32_t start = buddy_alloc(FRAME_CACHE_BATCH);
+
+    for (uint32_t i = 0; i < FRAME_CACHE_BATCH; i++) {
+        const int32_t block = (start != -1) ? start + (int32_t)(FRAME_CACHE_BATCH-1 - i) : buddy_alloc(1);
+        if (block == -1) break;
+
+        set_block(block);
+        used_blocks++;
+        cache->blocks[cache->count++] = block;
+    }
+}
+
+// Give a batch of the least recently freed blocks in a frame cache back to the buddy allocator
+void frame_cache_drain(frame_cache_t *cache)
+{
+    for (uint32_t i = 0; i < FRAME_CACHE_BATCH; i++) {
+        unset_block(cache->blocks[i]);
+        buddy_free_block(cache->blocks[i], 0);
+        used_blocks--;
+    }
+
+    cache->count -= FRAME_CACHE_BATCH;
+    for (uint32_t i = 0; i < cache->count; i++)
+        cache->blocks[i] = cache->blocks[i + FRAME_CACHE_BATCH];
+}
+
 // Allocate blocks of memory
 void *allocate_blocks(const uint32_t num_blocks)
 {
+    // Single blocks come from this CPU's cache
+    if (num_blocks == 1 && buddy_map) {
+        frame_cache_t *cache = this_cpu_frame_cache();
+        if (cache->count == 0) frame_cache_refill(cache);
+        if (cache->count == 0) return 0;    // Out of memory
+
+        return (void *)(cache->blocks[--cache->count] * BLOCK_SIZE);
+    }
+
     // If # of free blocks left is not enough, we can't allocate any more, return
     if ((max_blocks - used_blocks) <= num_blocks) return 0;   
 
-    int32_t starting_block = find_first_free_blocks(num_blocks);
+    int32_t starting_block = buddy_map ? buddy_alloc(num_blocks) : find_first_free_blocks(num_blocks);
     if (starting_block == -1) return 0;     // Couldn't find that many blocks in a row to allocate
 
     // Found free blocks, set them as used
@@ -142,9 +377,20 @@ void free_blocks(const uint32_t *address, const uint32_t num_blocks)
 {
     int32_t starting_block = (uint32_t)address / BLOCK_SIZE;   // Convert address to blocks 
 
+    // Single blocks go to this CPU's cache, still marked used
+    if (num_blocks == 1 && buddy_map) {
+        frame_cache_t *cache = this_cpu_frame_cache();
+        if (cache->count == FRAME_CACHE_SIZE) frame_cache_drain(cache);
+
+        cache->blocks[cache->count++] = starting_block;
+        return;
+    }
+
     for (uint32_t i = 0; i < num_blocks; i++) 
         unset_block(starting_block + i);    // Unset bits/blocks in memory map, to free
 
+    if (buddy_map) buddy_free_run(starting_block, num_blocks);
+
     used_blocks -= num_blocks;  // Decrease used block count
 }
 
@@ -0,0 +1,66 @@
+/*
+ * memory/sbrk.h: Program break, the end of the running program's memory. The ELF loader puts
+ *   the program & its stack at the start of this region, then user malloc() grows it with the
+ *   sbrk system call. Pages are mapped as the break moves up, and freed as it moves down or
+ *   when the program exits
+ */
+#pragma once
+
+#include "C/stdint.h"
+#include "memory/physical_memory_manager.h"
+#include "memory/virtual_memory_manager.h"
+
+#define PROGRAM_MEMORY_ADDRESS 0x400000     // 4MB
+#define PROGRAM_MEMORY_LIMIT   0x40000000   // ~1GB, open files are mapped from here
+
+uint32_t program_break = PROGRAM_MEMORY_ADDRESS;
+
+// Unmap & free pages in a range, skipping pages that aren't mapped
+void program_unmap_pages(const uint32_t start, const uint32_t end) {
+    for (uint32_t virt = start; virt < end; virt += PAGE_SIZE) {
+        if (!is_address_mapped(current_page_directory, virt)) continue;
+
+        free_page(get_page(virt));
+        unmap_page((void *)virt);
+        flush_tlb_entry(virt);
+    }
+}
+
+// Move the program break by a # of bytes, rounded up to whole pages
+// RETURNS:
+//   old break, or (void *)-1 if out of memory or address space
+void *program_sbrk(const int32_t bytes) {
+    const uint32_t old_break = program_break;
+    const uint32_t size = ((bytes < 0 ? -(uint32_t)bytes : (uint32_t)bytes) + PAGE_SIZE-1) & ~(PAGE_SIZE-1);
+
+    if (bytes < 0) {
+        if (size > program_break - PROGRAM_MEMORY_ADDRESS) return (void *)-1;
+
+        program_break -= size;
+        program_unmap_pages(program_break, old_break);
+        return (void *)old_break;
+    }
+
+    if (size > PROGRAM_MEMORY_LIMIT - program_break) return (void *)-1;
+
+    for (uint32_t virt = old_break; virt < old_break + size; virt += PAGE_SIZE) {
+        void *frame = allocate_blocks(1);
+
+        if (!frame || !map_address(current_page_directory, (uint32_t)frame, virt,
+                                   PTE_PRESENT | PTE_READ_WRITE | PTE_USER)) {
+            if (frame) free_blocks(frame, 1);
+
+            program_unmap_pages(old_break, virt);   // Undo pages mapped so far
+            return (void *)-1;
+        }
+    }
+
+    program_break += size;
+    return (void *)old_break;
+}
+
+// Unmap & free all program memory, e.g. when a program exits
+void program_memory_release(void) {
+    program_unmap_pages(PROGRAM_MEMORY_ADDRESS, program_break);
+    program_break = PROGRAM_MEMORY_ADDRESS;
+}
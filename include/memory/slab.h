@@ -0,0 +1,269 @@
+/*
+ * memory/slab.h: Object caches for kernel objects. A cache hands out objects of 1 size from
+ *   "slabs": pages mapped in the kernel object address space, each holding a slab header and
+ *   as many objects as fit. A slab's free objects are linked through a word in each object,
+ *   so alloc & free are constant time, and an object's slab is found from its page address.
+ *   A cache's constructor runs once per object when its slab is created; objects are freed
+ *   back in their constructed state. kmalloc()/kfree() use caches for sizes of 32 to 2048
+ *   bytes, larger sizes get their own pages
+ */
+#pragma once
+
+#include "C/stdint.h"
+#include "C/stdbool.h"
+#include "memory/physical_memory_manager.h"
+#include "memory/virtual_memory_manager.h"
+#include "memory/virtual_ranges.h"
+
+#define SLAB_SIZE_CLASSES 7     // kmalloc() caches for 32, 64, ... 2048 bytes
+#define SLAB_MIN_SIZE     32
+#define SLAB_MAX_SIZE     (SLAB_MIN_SIZE << (SLAB_SIZE_CLASSES-1))
+
+typedef struct slab slab_t;
+typedef struct slab_cache slab_cache_t;
+
+struct slab {
+    slab_cache_t *cache;        // 0 = large kmalloc() allocation, not a slab
+    slab_t *prev;
+    slab_t *next;
+    void *free_list;            // Free objects
+    uint32_t in_use;            // # of objects allocated, or # of pages for large allocations
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + 7) & ~7)
+
+struct slab_cache {
+    const char *name;
+    uint32_t object_size;
+    uint32_t slot_size;         // Object & free list link, 8 byte aligned
+    uint32_t link_offset;       // Offset of free list link in a free object
+    uint32_t objects_per_slab;
+    void (*constructor)(void *object);
+    slab_t *partial;            // Slabs with used & free objects, allocated from first
+    slab_t *full;
+    slab_t *empty;              // At most 1 empty slab is kept, the rest are freed
+    slab_cache_t *next_cache;   // All caches, for stats
+
+    // Stats
+    uint32_t slabs;             // # of slabs (pages) the cache has
+    uint32_t in_use;            // # of objects allocated
+    uint32_t peak_in_use;
+    uint32_t allocs;
+    uint32_t frees;
+};
+
+extern virtual_ranges_t kernel_object_space;    // Virtual addresses slabs are mapped to
+
+slab_cache_t *slab_caches = 0;
+slab_cache_t kmalloc_caches[SLAB_SIZE_CLASSES];
+const char *kmalloc_cache_names[SLAB_SIZE_CLASSES] = {
+    "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+uint32_t kmalloc_large_pages = 0;   // # of pages in large kmalloc() allocations
+
+// Set up a cache for objects of 1 size. Objects with a constructor keep the free list link
+//   after the object, so freeing does not change their constructed state
+void slab_cache_init(slab_cache_t *cache, const char *name, const uint32_t object_size,
+                     void (*constructor)(void *object)) {
+    *cache = (slab_cache_t){
+        .name        = name,
+        .object_size = object_size,
+        .constructor = constructor,
+        .next_cache  = slab_caches,
+    };
+
+    uint32_t slot_size = object_size < sizeof(void *) ? sizeof(void *) : object_size;
+    if (constructor) {
+        cache->link_offset = (object_size + 3) & ~3;
+        slot_size = cache->link_offset + sizeof(void *);
+    }
+
+    cache->slot_size = (slot_size + 7) & ~7;
+    cache->objects_per_slab = (PAGE_SIZE - SLAB_HEADER_SIZE) / cache->slot_size;
+
+    slab_caches = cache;
+}
+
+// Get/set the free list link in a free object
+void **slab_link(const slab_cache_t *cache, void *object) {
+    return (void **)((uint8_t *)object + cache->link_offset);
+}
+
+// Add a slab to the front of a list
+void slab_list_push(slab_t **list, slab_t *slab) {
+    slab->prev = 0;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+// Remove a slab from a list
+void slab_list_remove(slab_t **list, slab_t *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *list = slab->next;
+
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+// Allocate & map pages in the kernel object address space
+// RETURNS:
+//   virtual address of first page, or 0 if out of memory
+void *slab_map_pages(const uint32_t pages) {
+    const uint32_t start = virtual_ranges_alloc(&kernel_object_space, pages);
+    if (!start) return 0;
+
+    for (uint32_t i = 0, virt = start; i < pages; i++, virt += PAGE_SIZE) {
+        void *frame = allocate_blocks(1);
+
+        if (!frame || !map_address(current_page_directory, (uint32_t)frame, virt, PTE_PRESENT | PTE_READ_WRITE)) {
+            if (frame) free_blocks(frame, 1);
+
+            // Undo pages mapped so far
+            for (uint32_t addr = start; addr < virt; addr += PAGE_SIZE) {
+                free_page(get_page(addr));
+                unmap_page((void *)addr);
+                flush_tlb_entry(addr);
+            }
+
+            virtual_ranges_free(&kernel_object_space, start, pages);
+            return 0;
+        }
+    }
+
+    return (void *)start;
+}
+
+// Unmap & free pages from slab_map_pages()
+void slab_unmap_pages(void *address, const uint32_t pages) {
+    for (uint32_t i = 0, virt = (uint32_t)address; i < pages; i++, virt += PAGE_SIZE) {
+        free_page(get_page(virt));
+        unmap_page((void *)virt);
+        flush_tlb_entry(virt);
+    }
+
+    virtual_ranges_free(&kernel_object_space, (uint32_t)address, pages);
+}
+
+// Create a slab for a cache, and construct its objects
+slab_t *slab_create(slab_cache_t *cache) {
+    slab_t *slab = slab_map_pages(1);
+    if (!slab) return 0;
+
+    *slab = (slab_t){ .cache = cache };
+
+    // Link objects in address order
+    uint8_t *object = (uint8_t *)slab + SLAB_HEADER_SIZE + (cache->objects_per_slab-1) * cache->slot_size;
+    for (uint32_t i = 0; i < cache->objects_per_slab; i++, object -= cache->slot_size) {
+        if (cache->constructor) cache->constructor(object);
+
+        *slab_link(cache, object) = slab->free_list;
+        slab->free_list = object;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+// Allocate an object from a cache
+// RETURNS:
+//   object, or 0 if out of memory
+void *slab_alloc(slab_cache_t *cache) {
+    slab_t *slab = cache->partial;
+
+    if (!slab) {
+        // Use the kept empty slab, or create a new one
+        slab = cache->empty;
+        if (slab) cache->empty = 0;
+        else slab = slab_create(cache);
+
+        if (!slab) return 0;
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void *object = slab->free_list;
+    slab->free_list = *slab_link(cache, object);
+    slab->in_use++;
+
+    if (!slab->free_list) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->allocs++;
+    if (++cache->in_use > cache->peak_in_use) cache->peak_in_use = cache->in_use;
+    return object;
+}
+
+// Free an object back to its cache
+void slab_free(void *object) {
+    slab_t *slab = (slab_t *)((uint32_t)object & ~(PAGE_SIZE-1));
+    slab_cache_t *cache = slab->cache;
+
+    if (!slab->free_list) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    *slab_link(cache, object) = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+
+    cache->frees++;
+    cache->in_use--;
+
+    if (slab->in_use == 0) {
+        // Keep 1 empty slab so objects allocated & freed in a loop don't map & unmap pages
+        slab_list_remove(&cache->partial, slab);
+
+        if (!cache->empty) {
+            cache->empty = slab;
+        } else {
+            slab_unmap_pages(slab, 1);
+            cache->slabs--;
+        }
+    }
+}
+
+// Set up kmalloc() size class caches
+void slab_init(void) {
+    for (uint32_t i = 0; i < SLAB_SIZE_CLASSES; i++)
+        slab_cache_init(&kmalloc_caches[i], kmalloc_cache_names[i], SLAB_MIN_SIZE << i, 0);
+}
+
+// Allocate kernel memory: from the smallest size class cache it fits in, or whole pages
+//   after a header for larger sizes
+// RETURNS:
+//   memory, or 0 if out of memory
+void *kmalloc(const uint32_t size) {
+    if (size == 0) return 0;
+
+    if (size <= SLAB_MAX_SIZE) {
+        uint32_t i = 0;
+        while ((uint32_t)(SLAB_MIN_SIZE << i) < size) i++;
+
+        return slab_alloc(&kmalloc_caches[i]);
+    }
+
+    const uint32_t pages = (SLAB_HEADER_SIZE + size + PAGE_SIZE-1) / PAGE_SIZE;
+
+    slab_t *header = slab_map_pages(pages);
+    if (!header) return 0;
+
+    *header = (slab_t){ .cache = 0, .in_use = pages };
+    kmalloc_large_pages += pages;
+    return (uint8_t *)header + SLAB_HEADER_SIZE;
+}
+
+// Free memory from kmalloc()
+void kfree(void *ptr) {
+    if (!ptr) return;
+
+    slab_t *header = (slab_t *)((uint32_t)ptr & ~(PAGE_SIZE-1));
+
+    if (header->cache) {
+        slab_free(ptr);
+    } else {
+        kmalloc_large_pages -= header->in_use;
+        slab_unmap_pages(header, header->in_use);
+    }
+}
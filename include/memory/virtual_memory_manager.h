@@ -161,6 +161,21 @@ void flush_tlb_entry(virtual_address address)
     __asm__ __volatile__ ("cli; invlpg (%0); sti" : : "r"(address) );
 }
 
+// Clear a page's dirty bit, which the CPU sets on the first write to the page after this.
+//   Its TLB entry is flushed too, else writes through it would not set the bit again; interrupts
+//   are left as they are, callers racing IRQ handlers' writes disable them around this
+// RETURNS:
+//   true if the page was written since its dirty bit was last cleared
+bool clear_page_dirty(const virtual_address address)
+{
+    pt_entry *page = get_page(address);
+    if (!TEST_ATTRIBUTE(page, PTE_DIRTY)) return false;
+
+    CLEAR_ATTRIBUTE(page, PTE_DIRTY);
+    __asm__ __volatile__ ("invlpg (%0)" : : "r"(address) : "memory");
+    return true;
+}
+
 // Map a page
 bool map_page(void *phys_address, void *virt_address)
 {
@@ -251,6 +266,11 @@ void *get_physical_address(page_directory *dir, uint32_t virt) {
     return (void *)((uint32_t *)(pd[virt >> 22] & ~0xFFF))[virt << 10 >> 10 >> 12];
 }
 
+// Check if a virtual address is mapped to a present page
+bool is_address_mapped(page_directory *dir, uint32_t virt) {
+    return (uint32_t)get_physical_address(dir, virt) & PTE_PRESENT;
+}
+
 // Initialize virtual memory manager
 bool initialize_virtual_memory_manager(void)
 {
@@ -0,0 +1,126 @@
+/*
+ * memory/virtual_ranges.h: Allocator for page aligned ranges of virtual addresses, e.g. the
+ *   region open files are mapped to. Free ranges are kept sorted by address, allocation is
+ *   first fit, and freed ranges are merged with their free neighbors
+ */
+#pragma once
+
+#include "C/stdint.h"
+#include "C/stdbool.h"
+#include "memory/virtual_memory_manager.h"
+
+#define MAX_FREE_VIRTUAL_RANGES 128
+
+typedef struct {
+    uint32_t start;     // First virtual address in range
+    uint32_t pages;     // # of pages in range
+} virtual_range_t;
+
+typedef struct {
+    virtual_range_t free[MAX_FREE_VIRTUAL_RANGES];  // Sorted by start address
+    uint32_t count;                                 // # of free ranges
+    uint32_t pages_free;                            // Total pages in free ranges
+} virtual_ranges_t;
+
+// Set up allocator with 1 free range covering the whole region
+void virtual_ranges_init(virtual_ranges_t *ranges, const uint32_t start, const uint32_t pages) {
+    ranges->free[0] = (virtual_range_t){ .start = start, .pages = pages };
+    ranges->count = 1;
+    ranges->pages_free = pages;
+}
+
+// Remove free range at index i
+void virtual_ranges_remove(virtual_ranges_t *ranges, const uint32_t i) {
+    for (uint32_t j = i; j < ranges->count-1; j++)
+        ranges->free[j] = ranges->free[j+1];
+
+    ranges->count--;
+}
+
+// Allocate a range of pages
+// RETURNS:
+//   start address of range, or 0 if no free range is large enough
+uint32_t virtual_ranges_alloc(virtual_ranges_t *ranges, const uint32_t pages) {
+    for (uint32_t i = 0; i < ranges->count; i++) {
+        virtual_range_t *range = &ranges->free[i];
+        if (range->pages < pages) continue;
+
+        // Take pages from the front of the first range that fits
+        const uint32_t start = range->start;
+        range->start += pages * PAGE_SIZE;
+        range->pages -= pages;
+        if (range->pages == 0) virtual_ranges_remove(ranges, i);
+
+        ranges->pages_free -= pages;
+        return start;
+    }
+
+    return 0;   // Error: out of address space
+}
+
+// Grow an allocated range in place, if the pages right after it are free
+// RETURNS:
+//   true if range now has new_pages pages
+bool virtual_ranges_extend(virtual_ranges_t *ranges, const uint32_t start, const uint32_t pages,
+                           const uint32_t new_pages) {
+    if (new_pages <= pages) return true;
+
+    const uint32_t end = start + (pages * PAGE_SIZE);
+    const uint32_t extra = new_pages - pages;
+
+    for (uint32_t i = 0; i < ranges->count && ranges->free[i].start <= end; i++) {
+        virtual_range_t *range = &ranges->free[i];
+        if (range->start != end) continue;
+        if (range->pages < extra) return false;
+
+        range->start += extra * PAGE_SIZE;
+        range->pages -= extra;
+        if (range->pages == 0) virtual_ranges_remove(ranges, i);
+
+        ranges->pages_free -= extra;
+        return true;
+    }
+
+    return false;
+}
+
+// Free an allocated range, merging it with free ranges before/after it
+// RETURNS:
+//   false if range could not be tracked, when there are too many free ranges; its
+//   addresses are not reused in that case
+bool virtual_ranges_free(virtual_ranges_t *ranges, const uint32_t start, const uint32_t pages) {
+    if (pages == 0) return true;
+
+    const uint32_t end = start + (pages * PAGE_SIZE);
+
+    // Find first free range after this one
+    uint32_t i = 0;
+    while (i < ranges->count && ranges->free[i].start < start) i++;
+
+    virtual_range_t *prev = (i > 0) ? &ranges->free[i-1] : 0;
+    virtual_range_t *next = (i < ranges->count) ? &ranges->free[i] : 0;
+    const bool merge_prev = prev && prev->start + (prev->pages * PAGE_SIZE) == start;
+    const bool merge_next = next && next->start == end;
+
+    if (merge_prev && merge_next) {
+        prev->pages += pages + next->pages;
+        virtual_ranges_remove(ranges, i);
+    } else if (merge_prev) {
+        prev->pages += pages;
+    } else if (merge_next) {
+        next->start = start;
+        next->pages += pages;
+    } else {
+        if (ranges->count == MAX_FREE_VIRTUAL_RANGES) return false;
+
+        // Insert new free range at i
+        for (uint32_t j = ranges->count; j > i; j--)
+            ranges->free[j] = ranges->free[j-1];
+
+        ranges->free[i] = (virtual_range_t){ .start = start, .pages = pages };
+        ranges->count++;
+    }
+
+    ranges->pages_free += pages;
+    return true;
+}
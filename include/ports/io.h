@@ -19,6 +19,12 @@ void outw(uint16_t port, uint16_t value)
     __asm__ __volatile__ ("outw %0, %1" : : "a"(value), "Nd"(port) );
 }
 
+// Write EAX to port DX
+void outl(uint16_t port, uint32_t value)
+{
+    __asm__ __volatile__ ("outl %0, %1" : : "a"(value), "Nd"(port) );
+}
+
 // Read in value from port DX to AL & return AL
 uint8_t inb(uint16_t port)
 {
@@ -41,6 +47,16 @@ uint16_t inw(uint16_t port)
     return ret_val;
 }
 
+// Read in value from port DX to EAX & return EAX
+uint32_t inl(uint16_t port)
+{
+    uint32_t ret_val;
+
+    __asm__ __volatile__ ("inl %1, %0" : "=a"(ret_val) : "Nd"(port) );
+
+    return ret_val;
+}
+
 // Wait 1 I/O cycle for I/O operations to complete
 void io_wait(void)
 {
@@ -0,0 +1,102 @@
+/*
+ * pci.h: PCI configuration space access through I/O ports 0xCF8/0xCFC,
+ *   and finding devices by class code
+ */
+#pragma once
+
+#include "C/stdint.h"
+#include "C/stdbool.h"
+#include "ports/io.h"
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+// Configuration space register offsets (header type 0)
+#define PCI_VENDOR_ID   0x00
+#define PCI_DEVICE_ID   0x02
+#define PCI_COMMAND     0x04
+#define PCI_PROG_IF     0x09
+#define PCI_SUBCLASS    0x0A
+#define PCI_CLASS       0x0B
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR4        0x20
+
+// Command register bits
+#define PCI_COMMAND_IO          0x01    // Respond to I/O space accesses
+#define PCI_COMMAND_BUS_MASTER  0x04    // Allow device to do DMA
+
+typedef struct {
+    uint8_t bus;
+    uint8_t device;
+    uint8_t function;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class;
+    uint8_t subclass;
+    uint8_t prog_if;
+} pci_device_t;
+
+// Read 32 bits from a device's configuration space; offset is rounded down to 4 bytes
+uint32_t pci_config_read_32(const uint8_t bus, const uint8_t device, const uint8_t function, const uint8_t offset) {
+    // Address bits: 31 = enable, 23-16 = bus, 15-11 = device, 10-8 = function, 7-2 = register
+    outl(PCI_CONFIG_ADDRESS, 0x80000000 | (bus << 16) | ((device & 0x1F) << 11) | ((function & 0x07) << 8) | (offset & 0xFC));
+    return inl(PCI_CONFIG_DATA);
+}
+
+// Read 16 bits from a device's configuration space
+uint16_t pci_config_read_16(const uint8_t bus, const uint8_t device, const uint8_t function, const uint8_t offset) {
+    return (uint16_t)(pci_config_read_32(bus, device, function, offset) >> ((offset & 2) * 8));
+}
+
+// Read 8 bits from a device's configuration space
+uint8_t pci_config_read_8(const uint8_t bus, const uint8_t device, const uint8_t function, const uint8_t offset) {
+    return (uint8_t)(pci_config_read_32(bus, device, function, offset) >> ((offset & 3) * 8));
+}
+
+// Write 32 bits to a device's configuration space
+void pci_config_write_32(const uint8_t bus, const uint8_t device, const uint8_t function, const uint8_t offset, const uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, 0x80000000 | (bus << 16) | ((device & 0x1F) << 11) | ((function & 0x07) << 8) | (offset & 0xFC));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+// Write 16 bits to a device's configuration space, keeping the other 16 bits of the register
+void pci_config_write_16(const uint8_t bus, const uint8_t device, const uint8_t function, const uint8_t offset, const uint16_t value) {
+    const uint8_t shift = (offset & 2) * 8;
+    uint32_t reg = pci_config_read_32(bus, device, function, offset);
+
+    reg = (reg & ~(0xFFFF << shift)) | ((uint32_t)value << shift);
+    pci_config_write_32(bus, device, function, offset, reg);
+}
+
+// Find first device with a given class & subclass code, brute force checking every bus/device/function
+// Returns: true if found, and fills out device
+bool pci_find_class(const uint8_t class, const uint8_t subclass, pci_device_t *device) {
+    for (uint16_t bus = 0; bus < 256; bus++) {
+        for (uint8_t dev = 0; dev < 32; dev++) {
+            // Only check functions 1-7 if device is multi function (header type bit 7)
+            uint8_t num_functions = 1;
+            if (pci_config_read_16(bus, dev, 0, PCI_VENDOR_ID) == 0xFFFF) continue; // No device here
+            if (pci_config_read_8(bus, dev, 0, PCI_HEADER_TYPE) & 0x80) num_functions = 8;
+
+            for (uint8_t func = 0; func < num_functions; func++) {
+                const uint16_t vendor_id = pci_config_read_16(bus, dev, func, PCI_VENDOR_ID);
+                if (vendor_id == 0xFFFF) continue;
+
+                if (pci_config_read_8(bus, dev, func, PCI_CLASS)    != class ||
+                    pci_config_read_8(bus, dev, func, PCI_SUBCLASS) != subclass) continue;
+
+                device->bus       = bus;
+                device->device    = dev;
+                device->function  = func;
+                device->vendor_id = vendor_id;
+                device->device_id = pci_config_read_16(bus, dev, func, PCI_DEVICE_ID);
+                device->class     = class;
+                device->subclass  = subclass;
+                device->prog_if   = pci_config_read_8(bus, dev, func, PCI_PROG_IF);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
@@ -44,7 +44,7 @@ typedef struct Process {
 
 static Process _proc = {0};
 
-extern open_file_table_t open_file_table[256];
+extern open_file_table_t **open_file_table;
 
 Process *get_current_process(void) {
     return &_proc;
@@ -88,12 +88,12 @@ uint32_t create_process(int32_t argc, char **argv) {
     main_thread->stack_limit  = (void *)((uint32_t)main_thread->stack + PAGE_SIZE);
 
     // Load program into memory; The open file FD addresses and Program Buffer
-    //   addresses are virtual and mapped to valid physical memory from malloc(),
+    //   addresses are virtual and mapped to valid physical memory from program_sbrk(),
     //   syscall_open(), etc.
     void *entry_point = NULL; 
     uint8_t *pgm_buf = NULL;
     uint32_t pgm_size = 0;
-    entry_point = load_elf_file(open_file_table[fd].address, (void **)&pgm_buf, &pgm_size); 
+    entry_point = load_elf_file(open_file_table[fd]->address, (void **)&pgm_buf, &pgm_size); 
 
     main_thread->pgm_buf  = (uint32_t)pgm_buf;
     main_thread->pgm_size = pgm_size;
@@ -102,17 +102,19 @@ uint32_t create_process(int32_t argc, char **argv) {
     main_thread->regs.eip    = (int32_t)entry_point;
     main_thread->regs.eflags = 0x200;
 
-    // Create & Map userspace stack
-    void *stack = (void *)((uint8_t *)main_thread->pgm_buf + main_thread->pgm_size + PAGE_SIZE);
-    void *phys_addr = allocate_blocks(1);  // Only 4KB for now
-    map_address(address_space, (uint32_t)phys_addr, (uint32_t)stack, 
-                PTE_PRESENT | PTE_READ_WRITE | PTE_USER);
-
-    // Create & map userspace memory for arguments (heap?), above stack 
-    void *args = (void *)((uint8_t *)stack + PAGE_SIZE);
-    phys_addr = allocate_blocks(1); 
-    map_address(address_space, (uint32_t)phys_addr, (uint32_t)args, 
-                PTE_PRESENT | PTE_READ_WRITE | PTE_USER);
+    // Create & Map userspace stack after an unmapped page, to fault on stack overflow;
+    //   Only 4KB for now. The heap starts after the stack & args at the program break
+    program_break += PAGE_SIZE;
+    void *stack = program_sbrk(PAGE_SIZE);
+
+    // Create & map userspace memory for arguments, above stack 
+    void *args = program_sbrk(PAGE_SIZE);
+
+    if (stack == (void *)-1 || args == (void *)-1) {
+        program_memory_release();
+        close(fd);
+        return 0;
+    }
 
     // Copy argv into args memory
     char **user_argv = args;
@@ -3,19 +3,21 @@
  */
 #pragma once
 
-#define MAX_SYSCALLS 10 
+#define MAX_SYSCALLS 12 
 
 typedef enum {
     SYSCALL_TEST0  = 0,
     SYSCALL_EXIT   = 1,
     SYSCALL_SLEEP  = 2,
-    SYSCALL_MALLOC = 3,
-    SYSCALL_FREE   = 4,
+    SYSCALL_SBRK   = 3,
+    // 4 is reserved, was SYSCALL_FREE
     SYSCALL_WRITE  = 5,
     SYSCALL_OPEN   = 6,
     SYSCALL_CLOSE  = 7,
     SYSCALL_READ   = 8,
     SYSCALL_SEEK   = 9,
+    SYSCALL_FSYNC  = 10,
+    SYSCALL_SYNC   = 11,
 } system_call_numbers;
 
 typedef enum {
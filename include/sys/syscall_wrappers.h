@@ -7,6 +7,21 @@
 #include "C/stdint.h"
 #include "sys/syscall_numbers.h"
 
+// Move the program break, the end of the program's memory, by a # of bytes rounded up to
+//   whole pages. sbrk(0) gets the current break
+// RETURNS:
+//   old break, or (void *)-1 on error
+void *sbrk(const int32_t increment) {
+    int32_t result = SYSCALL_SBRK;
+    void *old_break = (void *)-1;
+
+    __asm__ __volatile__ ("int $0x80" 
+                          : "+a"(result), "=d"(old_break) 
+                          : "b"(increment) 
+                          : "memory");
+    return old_break;
+}
+
 // Open()
 // RETURNS:
 //   fd of 3+, or -1 on error
@@ -66,3 +81,24 @@ int32_t seek(const int32_t fd, const int32_t offset, const whence_value_t whence
     return result;
 }
 
+// Write a file's changed data to disk now, instead of at close() or the next periodic flush
+int32_t fsync(const int32_t fd) {
+    int32_t result = -1;
+
+    __asm__ __volatile__ ("int $0x80" 
+                          : "=a"(result) 
+                          : "a"(SYSCALL_FSYNC), "b"(fd) 
+                          : "memory");
+    return result;
+}
+
+// Write all open files' changed data and all file system changes to disk now
+int32_t sync(void) {
+    int32_t result = -1;
+
+    __asm__ __volatile__ ("int $0x80" 
+                          : "=a"(result) 
+                          : "a"(SYSCALL_SYNC) 
+                          : "memory");
+    return result;
+}
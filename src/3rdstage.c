@@ -46,18 +46,25 @@ __attribute__ ((section ("prekernel_entry"))) void prekernel_main(void) {
     // Set memory regions/blocks for the kernel and "OS" memory map areas as used/reserved
     deinitialize_memory_region(0, 0x12000);                                 // Reserve all memory below 12000h for the kernel/OS
     deinitialize_memory_region(MEMMAP_AREA, max_blocks / BLOCKS_PER_BYTE);  // Reserve physical memory map area 
+    deinitialize_memory_region(0x80000, 0x10000);                          // Reserve stack below 90000h
+    deinitialize_memory_region(KERNEL_ADDRESS, 0x400000);                   // Reserve 4MB mapped for the higher half kernel
 
     // Load initial superblock state
     superblock = *(superblock_t *)SUPERBLOCK_ADDRESS;
 
-    // Load root inode, root is always inode 1 
-    rw_sectors(1, 
-               (superblock.first_inode_block*8),   // 1 block = 8 sectors
-               (uint32_t)temp_sector,
-               READ_WITH_RETRY);
+    // Small block cache, only needed for finding files to load
+    static block_cache_entry_t cache_entries[4];
+    static uint8_t cache_data[4][FS_BLOCK_SIZE];
+    block_cache_init(cache_entries, (uint8_t *)cache_data, 4);
+
+    // Small inode cache, holds the root dir and inodes in paths being looked up
+    static inode_t inodes[8];
+    static inode_cache_info_t inode_info[8];
+    inode_cache_init(inodes, inode_info, 8);
 
-    root_inode = *((inode_t *)temp_sector + 1);
-    superblock.root_inode_pointer = (uint32_t)&root_inode;
+    // Load root inode, root is always inode 1 
+    root_inode = inode_get(1);
+    superblock.root_inode_pointer = (uint32_t)root_inode;
 
     // Set filesystem starting point
     extern char current_dir[512];
@@ -67,19 +74,21 @@ __attribute__ ((section ("prekernel_entry"))) void prekernel_main(void) {
     current_parent_inode = root_inode;  // Root's parent is itself
 
     // Find kernel inode
-    inode_t inode = inode_from_path("/sys/bin/kernel.bin"); 
+    inode_t *inode = inode_from_path("/sys/bin/kernel.bin");
 
     // Load kernel from disk
-    fs_load_file(&inode, KERNEL_ADDRESS);
+    fs_load_file(inode, KERNEL_ADDRESS);
+    inode_put(inode);
     
     // Find font inode
     inode = inode_from_path("/sys/bin/ter-u32n.bin"); 
 
     // Load font from disk
-    fs_load_file(&inode, FONT_ADDRESS);
+    fs_load_file(inode, FONT_ADDRESS);
 
     // Mark font memory as in use
-    deinitialize_memory_region(FONT_ADDRESS, inode.extent[0].length_blocks * FS_BLOCK_SIZE);
+    deinitialize_memory_region(FONT_ADDRESS, inode->extent[0].length_blocks * FS_BLOCK_SIZE);
+    inode_put(inode);
 
     // Set up virtual memory & paging - TODO: Check if return value is true/false
     initialize_virtual_memory_manager();
@@ -14,7 +14,7 @@
 #include "print/print_registers.h"
 #include "memory/physical_memory_manager.h"
 #include "memory/virtual_memory_manager.h"
-#include "memory/malloc.h"
+#include "memory/slab.h"
 #include "interrupts/idt.h"
 #include "interrupts/exceptions.h"
 #include "interrupts/pic.h"
@@ -24,25 +24,47 @@
 #include "sound/pc_speaker.h"
 #include "sys/syscall_wrappers.h"
 #include "fs/fs_impl.h"
+#include "fs/fs_check.h"
 #include "process/process.h"
 
 #include "../src/tests/kernel_tests.c"
 
-// Open file table & inode table pointers
-open_file_table_t open_file_table[256];
-inode_t open_inode_table[256];
-uint32_t max_open_files = 256;
-uint32_t max_open_inodes = 256;
+// Open file table, grows as more files are open; entries are from open_file_cache
+open_file_table_t **open_file_table = 0;
+uint32_t max_open_files = 0;
 uint32_t current_open_files = 0;
-uint32_t current_open_inodes = 0;
+slab_cache_t open_file_cache;
+
+// Inode cache storage, open files' inodes are held in it
+#define OPEN_INODE_TABLE_SIZE 256
+inode_t open_inode_table[OPEN_INODE_TABLE_SIZE];
+inode_cache_info_t open_inode_info[OPEN_INODE_TABLE_SIZE];
 
 extern char current_dir[512];   // Current working directory string
 
-uint32_t next_available_file_virtual_address;
+// Virtual addresses open files are mapped to
+#define FILE_MAPPING_ADDRESS 0x40000000 // ~1GB
+#define FILE_MAPPING_PAGES   0x40000    // 1GB of address space
+virtual_ranges_t file_address_space;
+
+// Virtual addresses slabs & kmalloc() pages are mapped to
+#define KERNEL_OBJECT_ADDRESS 0xD0000000
+#define KERNEL_OBJECT_PAGES   0x10000    // 256MB of address space
+virtual_ranges_t kernel_object_space;
+
+// File system block cache, BLOCK_CACHE_SIZE is in fs/fs.h; 256KB of cached blocks
+block_cache_entry_t block_cache_entries[BLOCK_CACHE_SIZE];
+uint8_t block_cache_data[BLOCK_CACHE_SIZE][FS_BLOCK_SIZE];
+
+// Metadata journal transactions are staged here to write them with 1 request
+uint8_t journal_staging_data[JOURNAL_STAGING_BLOCKS][FS_BLOCK_SIZE];
+
+// Inode & data bitmaps kept in memory
+#define FS_BITMAP_BLOCKS (1 + MAX_BITMAP_BLOCKS)   // 1 inode bitmap block, up to 4GB of data blocks
+uint32_t fs_bitmap_data[FS_BITMAP_BLOCKS][WORDS_PER_BITMAP_BLOCK];
 
 // Forward function declarations
 void init_fs_vars(void);
-void init_malloc(void);
 
 void shell(bool, int32_t);
 
@@ -50,6 +72,10 @@ bool cmd_chgcolors(int32_t argc, char *argv[]);
 bool cmd_chgfont(int32_t argc, char *argv[]);
 bool cmd_cls(int32_t argc, char *argv[]);
 bool cmd_date(int32_t argc, char *argv[]);
+bool cmd_defrag(int32_t argc, char *argv[]);
+bool cmd_diskbench(int32_t argc, char *argv[]);
+bool cmd_diskstat(int32_t argc, char *argv[]);
+bool cmd_fsstat(int32_t argc, char *argv[]);
 bool cmd_gfxtst(int32_t argc, char *argv[]);
 bool cmd_msleep(int32_t argc, char *argv[]);
 bool cmd_prtmemmap(int32_t argc, char *argv[]);
@@ -58,6 +84,7 @@ bool cmd_runtests(int32_t argc, char *argv[]);
 bool cmd_shutdown(int32_t argc, char *argv[]);
 bool cmd_sleep(int32_t argc, char *argv[]);
 bool cmd_soundtest(int32_t argc, char *argv[]);
+bool cmd_sync(int32_t argc, char *argv[]);
 bool cmd_touch(int32_t argc, char *argv[]);
 bool cmd_type(int32_t argc, char *argv[]);
 
@@ -74,6 +101,10 @@ __attribute__ ((section ("kernel_entry"))) void kernel_main(void) {
     max_blocks  = *(uint32_t *)PHYS_MEM_MAX_BLOCKS;
     used_blocks = *(uint32_t *)PHYS_MEM_USED_BLOCKS;
 
+    // Allocate physical memory with buddy allocator from now on, storage covers 4GB
+    static uint32_t buddy_storage[BUDDY_MAP_WORDS(0x100000)];
+    initialize_buddy_allocator(buddy_storage, BUDDY_MAP_WORDS(0x100000));
+
     // Set up interrupts
     init_idt_32();
 
@@ -95,6 +126,7 @@ __attribute__ ((section ("kernel_entry"))) void kernel_main(void) {
     set_idt_descriptor_32(0x20, (uint32_t)timer_irq0_handler, INT_GATE_FLAGS);  
     set_idt_descriptor_32(0x21, (uint32_t)keyboard_irq1_handler, INT_GATE_FLAGS);
     set_idt_descriptor_32(0x28, (uint32_t)cmos_rtc_irq8_handler, INT_GATE_FLAGS);
+    set_idt_descriptor_32(0x2E, (uint32_t)ata_irq14_handler, INT_GATE_FLAGS);
     
     // Clear out PS/2 keyboard buffer: check status register and read from data port
     //   until clear
@@ -106,6 +138,21 @@ __attribute__ ((section ("kernel_entry"))) void kernel_main(void) {
     clear_irq_mask(1); // Enable keyboard IRQ1, keyboard interrupts
     clear_irq_mask(2); // Enable PIC2 line
     clear_irq_mask(8); // Enable CMOS RTC IRQ8
+    clear_irq_mask(14); // Enable primary ATA disk IRQ14
+
+    // Have disk reads/writes use IRQ14 instead of polling, and bus master DMA if
+    //   there's a PCI IDE controller
+    *timer_ticks = 0;
+    ata_init();
+    ata_dma_init();
+
+    // Open files are mapped to ranges of addresses in this region
+    virtual_ranges_init(&file_address_space, FILE_MAPPING_ADDRESS, FILE_MAPPING_PAGES);
+
+    // Kernel object caches
+    virtual_ranges_init(&kernel_object_space, KERNEL_OBJECT_ADDRESS, KERNEL_OBJECT_PAGES);
+    slab_init();
+    slab_cache_init(&open_file_cache, "open_file", sizeof(open_file_table_t), 0);
     
     // Enable CMOS RTC
     enable_rtc();
@@ -143,6 +190,10 @@ void shell(bool from_process, int32_t return_status) {
         CHGFONT,
         CLS,
         DATE,
+        DEFRAG,
+        DISKBENCH,
+        DISKSTAT,
+        FSSTAT,
         GFXTST,
         LS,
         MKDIR,
@@ -157,6 +208,7 @@ void shell(bool from_process, int32_t return_status) {
         SHUTDOWN,
         SLEEP,
         SOUNDTEST,
+        SYNC,
         TOUCH,
         TYPE,
 
@@ -170,6 +222,10 @@ void shell(bool from_process, int32_t return_status) {
         [CHGFONT]   = "chgfont",
         [CLS]       = "cls",
         [DATE]      = "date",
+        [DEFRAG]    = "defrag",
+        [DISKBENCH] = "diskbench",
+        [DISKSTAT]  = "diskstat",
+        [FSSTAT]    = "fsstat",
         [GFXTST]    = "gfxtst",
         [LS]        = "ls",
         [MKDIR]     = "mkdir",
@@ -184,6 +240,7 @@ void shell(bool from_process, int32_t return_status) {
         [SHUTDOWN]  = "shutdown", 
         [SLEEP]     = "sleep", 
         [SOUNDTEST] = "soundtest", 
+        [SYNC]      = "sync",
         [TOUCH]     = "touch",
         [TYPE]      = "type",
     };
@@ -196,6 +253,10 @@ void shell(bool from_process, int32_t return_status) {
         [CHGFONT]   = cmd_chgfont,
         [CLS]       = cmd_cls,
         [DATE]      = cmd_date,
+        [DEFRAG]    = cmd_defrag,
+        [DISKBENCH] = cmd_diskbench,
+        [DISKSTAT]  = cmd_diskstat,
+        [FSSTAT]    = cmd_fsstat,
         [GFXTST]    = cmd_gfxtst,
         [LS]        = print_dir,
         [MKDIR]     = fs_make_dir,
@@ -210,18 +271,14 @@ void shell(bool from_process, int32_t return_status) {
         [SHUTDOWN]  = cmd_shutdown,
         [SLEEP]     = cmd_sleep,
         [SOUNDTEST] = cmd_soundtest,
+        [SYNC]      = cmd_sync,
         [TOUCH]     = cmd_touch,
         [TYPE]      = cmd_type,
     };
 
-    // Set up kernel malloc variables 
-    init_malloc();
-
     // Set up file system variables
     init_fs_vars();
 
-    next_available_file_virtual_address = 0x40000000; // Default to ~1GB
-
     if (first_boot) {
         first_boot = false;
 
@@ -353,11 +410,12 @@ void shell(bool from_process, int32_t return_status) {
         }
 
         // Check if this is a new file or not, don't run a newly created file
-        inode_t program_inode = inode_from_path(argv[0]);
-        if (program_inode.id == 0) {
+        inode_t *program_inode = inode_from_path(argv[0]);
+        if (!program_inode) {
             printf("\r\nError: Program %s does not exist.\r\n", argv[0]);
             continue;
         }
+        inode_put(program_inode);
 
         int32_t pid = create_process(argc, argv);
         if (pid < 0) {
@@ -373,41 +431,36 @@ void init_fs_vars(void) {
     // Load initial superblock state
     superblock = *(superblock_t *)SUPERBLOCK_ADDRESS;
 
-    // Load root inode, root is always inode 1 
-    rw_sectors(1, 
-               (superblock.first_inode_block*8),   // 1 block = 8 sectors
-               (uint32_t)temp_sector,
-               READ_WITH_RETRY);
+    // Set up block cache once, keep cached blocks when returning to the shell from a process
+    if (!block_cache) block_cache_init(block_cache_entries, (uint8_t *)block_cache_data, BLOCK_CACHE_SIZE);
+    if (!data_bitmap.words) {
+        // Finish metadata transactions left in the journal, e.g. by a crash, before reading metadata
+        journal_init((uint8_t *)journal_staging_data);
+        if (journal_replay()) {
+            rw_sectors(1, SUPERBLOCK_DISK_SECTOR, SUPERBLOCK_ADDRESS, READ_WITH_RETRY);
+            superblock = *(superblock_t *)SUPERBLOCK_ADDRESS;
+        }
+        fs_bitmaps_init((uint32_t *)fs_bitmap_data, FS_BITMAP_BLOCKS);
 
-    root_inode = *((inode_t *)temp_sector + 1);
-    superblock.root_inode_pointer = (uint32_t)&root_inode;
+        // Sync metadata as 1 journal transaction before more of it is dirty than that holds
+        block_cache_dirty_limit = fs_dirty_block_limit();
+        block_cache_commit = fs_sync_cache;
+    }
+
+    // Same for the inode cache; load root inode, root is always inode 1 and stays cached
+    if (!inode_cache) {
+        inode_cache_init(open_inode_table, open_inode_info, OPEN_INODE_TABLE_SIZE);
+        root_inode = inode_get(1);
+    }
+    superblock.root_inode_pointer = (uint32_t)root_inode;
 
     // Set filesystem starting point
     strcpy(current_dir, "/");   // Start in 'root' directory by default
-    current_dir_inode    = root_inode;
+    inode_put(current_dir_inode);
+    current_dir_inode    = inode_get(1);
     current_parent_inode = root_inode;  // Root's parent is itself
 }
 
-// Initialize malloc variables/mappings/etc.
-void init_malloc(void) {
-    extern malloc_block_t *malloc_list_head;
-    extern uint32_t malloc_phys_address;
-    extern uint32_t malloc_virt_address;
-
-    malloc_start = 0x400000;    // 4MB
-    malloc_virt_address = malloc_start;
-    malloc_phys_address = (uint32_t)allocate_blocks(1);
-    map_address(current_page_directory, malloc_phys_address, malloc_virt_address,
-                PTE_PRESENT | PTE_READ_WRITE | PTE_USER);
-
-    malloc_list_head       = (malloc_block_t *)malloc_virt_address;
-    malloc_list_head->size = PAGE_SIZE - sizeof(malloc_block_t);
-    malloc_list_head->free = true;
-    malloc_list_head->next = 0;
-
-    total_malloc_pages  = 1;
-}
-
 // Change terminal colors
 bool cmd_chgcolors(int32_t argc, char *argv[]) {
     (void)argc, (void)argv;
@@ -525,6 +578,196 @@ bool cmd_date(int32_t argc, char *argv[]) {
     return true;
 }
 
+// Print transfer rate for a disk benchmark
+void print_disk_rate(const char *name, const uint32_t bytes, const uint32_t ticks) {
+    if (ticks == 0) {
+        printf("%s: <1ms, try more passes\r\n", name);
+        return;
+    }
+
+    // Ticks are ~1ms, so bytes per tick = ~KB/s
+    const uint32_t kb_per_second = bytes / ticks;
+    printf("%s: %u KB/s (%u.%.2u MB/s) in %ums\r\n",
+           name, kb_per_second, kb_per_second / 1000, (kb_per_second % 1000) / 10, ticks);
+}
+
+// Defragment files: move each file in more than 1 extent into 1 run of blocks, and print how
+//   fragmented files were. "defrag -n" only prints
+bool cmd_defrag(int32_t argc, char *argv[]) {
+    const bool move = !(argc > 1 && !strcmp(argv[1], "-n"));
+    defrag_report_t report = {0};
+
+    printf("\r\n");
+    fs_defrag_all(&report, move, true);
+
+    printf("%u files, %u fragmented, %u extents, %u blocks\r\n",
+           report.files, report.fragmented, report.extents, report.blocks);
+
+    if (report.files > 0 && report.extents > 0) {
+        printf("Avg extents per file: %u.%u, avg run: %u blocks\r\n",
+               report.extents / report.files, (report.extents * 10 / report.files) % 10,
+               report.blocks / report.extents);
+    }
+
+    if (move) printf("Moved %u files into 1 extent, could not move %u\r\n", report.moved, report.failed);
+    return true;
+}
+
+// Compare disk read & write speeds for PIO and bus master DMA, using a file's data blocks
+bool cmd_diskbench(int32_t argc, char *argv[]) {
+    if (argc < 2) {
+        printf("\r\nUsage: diskbench <file> [passes]\r\n");
+        return false;
+    }
+
+    inode_t *inode = inode_from_path(argv[1]);
+    if (!inode) {
+        printf("\r\nError: file %s not found\r\n", argv[1]);
+        return false;
+    }
+
+    uint32_t passes = (argc > 2) ? atoi(argv[2]) : 4;
+    if (passes == 0) passes = 1;
+
+    // fs_load_file() reads whole blocks
+    const uint32_t size = bytes_to_blocks(inode->size_bytes) * FS_BLOCK_SIZE;
+    if (size == 0) {
+        printf("\r\nError: file %s is empty\r\n", argv[1]);
+        inode_put(inode);
+        return false;
+    }
+
+    // Load file once with PIO to compare reads against, and to write back the same data
+    uint8_t *data   = kmalloc(size);
+    uint8_t *buffer = kmalloc(size);
+    if (!data || !buffer) {
+        kfree(data);
+        kfree(buffer);
+        inode_put(inode);
+        printf("\r\nError: not enough memory for %u byte buffers\r\n", size);
+        return false;
+    }
+    const bool dma_enabled = ata_dma_enabled;
+
+    ata_dma_enabled = false;
+    fs_load_file(inode, (uint32_t)data);
+
+    printf("\r\nFile size: %u bytes, %u passes\r\n", size, passes);
+
+    for (uint32_t dma = 0; dma < 2; dma++) {
+        if (dma && !ata_dma_available) {
+            printf("DMA: no bus master IDE controller, skipped\r\n");
+            break;
+        }
+        ata_dma_enabled = dma;
+
+        uint32_t start = *timer_ticks;
+        for (uint32_t i = 0; i < passes; i++)
+            fs_load_file(inode, (uint32_t)buffer);
+        print_disk_rate(dma ? "DMA read " : "PIO read ", size * passes, *timer_ticks - start);
+
+        if (memcmp(buffer, data, size) != 0) {
+            printf("Error: %s read data does not match\r\n", dma ? "DMA" : "PIO");
+            break;  // Don't write back bad data
+        }
+
+        start = *timer_ticks;
+        for (uint32_t i = 0; i < passes; i++)
+            fs_save_file(inode, (uint32_t)data);
+        print_disk_rate(dma ? "DMA write" : "PIO write", size * passes, *timer_ticks - start);
+    }
+
+    ata_dma_enabled = dma_enabled;
+    kfree(buffer);
+    kfree(data);
+    inode_put(inode);
+    return true;
+}
+
+// Print disk request queue counters
+bool cmd_diskstat(int32_t argc, char *argv[]) {
+    (void)argc, (void)argv;
+
+    printf("\r\n-----------------"
+           "\r\nDisk Request Stats"
+           "\r\n-----------------\r\n");
+
+    if (ata_device.present) {
+        // Sectors / 2048 = MB
+        printf("Drive: %s, %u MB\r\n", ata_device.model, ata_total_sectors() / 2048);
+        printf("Supports: LBA48 %s, DMA %s, multiple %u sectors, write cache %s\r\n",
+               ata_device.lba48 ? "yes" : "no", ata_device.dma ? "yes" : "no", 
+               ata_device.max_multiple, ata_device.write_cache ? "on" : "off");
+    } else {
+        printf("Drive: IDENTIFY failed, using 28 bit LBA\r\n");
+    }
+    printf("Mode: %s, %s, %u sectors per PIO IRQ\r\n", ata_irq_enabled ? "IRQ14" : "Polling",
+           ata_dma_enabled ? "DMA" : "PIO", ata_multiple_sectors);
+    printf("Requests: %u (DMA: %u) Errors: %u Sectors: %u IRQs: %u Cache flushes: %u\r\n",
+           ata_stats.requests, ata_stats.dma_requests, ata_stats.errors, ata_stats.sectors, ata_stats.irqs,
+           ata_stats.flushes);
+    printf("Retries: %u Timeouts: %u Resets: %u Last error: %x\r\n",
+           ata_stats.retries, ata_stats.timeouts, ata_stats.resets, ata_stats.last_error);
+    printf("Queue depth: %u (max %u of %u)\r\n",
+           ata_stats.queue_depth, ata_stats.max_queue_depth, ATA_REQUEST_QUEUE_SIZE);
+    printf("Latency in ms: last %u avg %u max %u\r\n",
+           ata_stats.last_latency,
+           ata_stats.requests ? ata_stats.total_latency / ata_stats.requests : 0,
+           ata_stats.max_latency);
+    printf("Block cache: %u hits, %u misses, %u write backs, %u of %u blocks dirty\r\n",
+           block_cache_stats.hits, block_cache_stats.misses, block_cache_stats.write_backs,
+           block_cache_dirty_count(), block_cache_size);
+    printf("Inode cache: %u hits, %u misses, %u write backs\r\n",
+           inode_cache_stats.hits, inode_cache_stats.misses, inode_cache_stats.write_backs);
+    printf("Dentry cache: %u hits, %u not found hits, %u misses\r\n",
+           dentry_cache_stats.hits, dentry_cache_stats.negative_hits, dentry_cache_stats.misses);
+    printf("Read-ahead: %u batches, %u pages read, %u used\r\n",
+           readahead_stats.batches, readahead_stats.pages, readahead_stats.used);
+    printf("Journal: %u of %u blocks, %u commits, %u blocks logged, %u replayed\r\n",
+           journal_count, superblock.num_journal_blocks, journal_stats.commits, journal_stats.blocks,
+           journal_stats.replays);
+    return true;
+}
+
+// Print file system usage & fragmentation, and check the data bitmap against files' blocks
+bool cmd_fsstat(int32_t argc, char *argv[]) {
+    (void)argc, (void)argv;
+
+    fs_sync();  // Check what's on disk, with all cached changes written
+    if (num_block_groups == 0) init_block_groups();
+
+    fs_check_disk_t disk = {
+        .superblock   = &superblock,
+        .inode_bitmap = inode_bitmap.words,
+        .data_bitmap  = data_bitmap.words,
+        .total_blocks = total_disk_blocks,
+        .read_block   = block_cache_read,
+        .seen         = kmalloc(((total_disk_blocks + 31) / 32) * sizeof(uint32_t)),
+    };
+    if (!disk.seen) return false;
+
+    fs_check_t check = {0};
+    fs_check(&disk, &check);
+    kfree(disk.seen);
+
+    printf("\r\nBlocks: %u total, %u used, %u free\r\n",
+           check.total_blocks, check.total_blocks - check.free_blocks, check.free_blocks);
+    printf("Free space: %u runs, largest %u blocks\r\n", check.free_runs, check.largest_free_run);
+    printf("Files: %u, directories: %u, extents: %u\r\n", check.files, check.dirs, check.extents);
+    printf("Extents per file: 0: %u  1: %u  2: %u  3: %u  4: %u  5-8: %u  9+: %u\r\n",
+           check.extent_histogram[0], check.extent_histogram[1], check.extent_histogram[2],
+           check.extent_histogram[3], check.extent_histogram[4], check.extent_histogram[5],
+           check.extent_histogram[6]);
+    printf("Directories: %u blocks, %u entries, largest is inode %u with %u entries\r\n",
+           check.dir_blocks, check.dir_entries, check.largest_dir_id, check.largest_dir_entries);
+    printf("Errors: %u bad inodes, %u bad extents, %u shared blocks, %u used blocks marked free, "
+           "%u free blocks marked used\r\n",
+           check.bad_inodes, check.bad_extents, check.shared_blocks, check.unmarked_blocks,
+           check.leaked_blocks);
+
+    return check.bad_inodes + check.bad_extents + check.shared_blocks + check.unmarked_blocks == 0;
+}
+
 // 2D Graphics test
 bool cmd_gfxtst(int32_t argc, char *argv[]) {
     (void)argc, (void)argv;
@@ -718,13 +961,31 @@ bool cmd_prtmemmap(int32_t argc, char *argv[])  {
     //   total memory in 4KB blocks, total # of used blocks, total # of free blocks
     printf("\r\nTotal 4KB blocks: %d", max_blocks);
     printf("\r\nUsed or reserved blocks: %d", used_blocks);
-    printf("\r\nFree or available blocks: %d\r\n\r\n", max_blocks - used_blocks);
+    printf("\r\nFree or available blocks: %d\r\n", max_blocks - used_blocks);
+
+    // Free buddy blocks of each size
+    if (buddy_map) {
+        printf("Free buddy blocks (4KB, 8KB, ... 4MB):");
+        for (uint32_t order = 0; order < BUDDY_ORDERS; order++)
+            printf(" %d", buddy_free[order]);
+
+        printf("\r\nFree blocks cached for 1 block allocations: %d", this_cpu_frame_cache()->count);
+    }
+
+    // Kernel object caches
+    printf("\r\n\r\nKernel object caches:\r\n");
+    for (slab_cache_t *cache = slab_caches; cache; cache = cache->next_cache)
+        printf("%s: size %d, in use %d, peak %d, slabs %d, allocs %d, frees %d\r\n",
+               cache->name, cache->object_size, cache->in_use, cache->peak_in_use,
+               cache->slabs, cache->allocs, cache->frees);
+    printf("kmalloc pages for large sizes: %d\r\n\r\n", kmalloc_large_pages);
     return true;
 }
 
 // Reboot
 bool cmd_reboot(int32_t argc, char *argv[]) {
     (void)argc, (void)argv;
+    flush_open_files(); // Write cached file system changes to disk first
     outb(0x64, 0xFE);   // Send "Reset CPU" command to PS/2 keyboard controller port
     return false;       // Should never reach here!
 }
@@ -732,6 +993,7 @@ bool cmd_reboot(int32_t argc, char *argv[]) {
 // Shutdown
 bool cmd_shutdown(int32_t argc, char *argv[]) {
     (void)argc, (void)argv;
+    flush_open_files(); // Write cached file system changes to disk first
 
     // Shutdown (QEMU)
     __asm__ ("outw %%ax, %%dx" : : "a"(0x2000), "d"(0x604) );
@@ -767,6 +1029,13 @@ bool cmd_soundtest(int32_t argc, char *argv[]) {
     return true;
 }
 
+// Write open files' changed data & cached file system changes to disk
+bool cmd_sync(int32_t argc, char *argv[]) {
+    (void)argc, (void)argv;
+    flush_open_files();
+    return true;
+}
+
 // Touch command: Create new empty file
 bool cmd_touch(int32_t argc, char *argv[]) {
     if (argc < 1) return false;
@@ -13,6 +13,7 @@
 #include "sys/syscall_wrappers.h"
 #include "global/global_addresses.h"
 #include "fs/fs_impl.h"
+#include "memory/malloc.h"
 
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
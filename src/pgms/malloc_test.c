@@ -0,0 +1,71 @@
+//
+// malloc_test.c: test user malloc() & free(); exits 0 if all checks pass
+//
+#include "C/stdint.h"
+#include "C/stdbool.h"
+#include "C/stdio.h"
+#include "C/stdlib.h"
+#include "memory/malloc.h"
+
+// Print whether a check passed
+bool check(const bool ok, const char *what) {
+    printf("%s: %s\r\n", what, ok ? "OK" : "FAIL");
+    return ok;
+}
+
+int32_t main(void) {
+    bool ok = true;
+    malloc_stats_t stats;
+
+    printf("\r\nRunning malloc tests...\r\n");
+
+    // A freed block is used again for the next allocation that fits
+    uint8_t *first = malloc(100);
+    free(first);
+    uint8_t *again = malloc(100);
+    ok &= check(first && again == first, "Reuse after free");
+    free(again);
+
+    // Freed neighbours merge into 1 block, whatever order they're freed in
+    uint8_t *a = malloc(1000);
+    uint8_t *b = malloc(1000);
+    uint8_t *c = malloc(1000);
+    uint8_t *guard = malloc(16);    // Keeps c from merging with the free end of the heap
+    ok &= check(a && b && c && guard, "Allocate 3 blocks");
+
+    free(a);
+    free(c);
+    free(b);
+
+    malloc_stats(&stats);
+    ok &= check(stats.largest_free_block >= 3000, "Coalesce freed neighbours");
+
+    uint8_t *merged = malloc(2000);
+    ok &= check(merged == a, "Allocate from coalesced block");
+    free(merged);
+    free(guard);
+
+    // A free block at the end of the heap is used when the size fits it exactly, even though
+    //   that size's class is rounded past the block's
+    malloc_stats(&stats);
+    const uint32_t heap_bytes = stats.heap_bytes;
+    uint8_t *small = malloc(100);
+
+    malloc_stats(&stats);
+    uint8_t *fit = malloc(stats.largest_free_block - MALLOC_HEADER_SIZE);
+
+    malloc_stats(&stats);
+    ok &= check(small && fit && stats.free_blocks == 0 && stats.heap_bytes == heap_bytes,
+                "Exact fit at end of heap");
+    free(fit);
+    free(small);
+
+    // Everything freed, so all of the heap is 1 free block again
+    malloc_stats(&stats);
+    ok &= check(stats.used_bytes == 0 && stats.free_blocks == 1, "Heap empty after freeing all");
+
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+
+    // Should never reach here!
+    return EXIT_FAILURE;
+}
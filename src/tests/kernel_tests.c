@@ -5,7 +5,7 @@ bool test_open_close(void); // Test functions...
 bool test_seek(void);
 bool test_write(void);
 bool test_read(void);
-bool test_malloc(void);
+bool test_kmalloc(void);
 
 // Run test functions and present results
 bool cmd_runtests(int32_t argc, char *argv[]) {
@@ -21,7 +21,7 @@ bool cmd_runtests(int32_t argc, char *argv[]) {
         { "Seek() Syscall on New/Empty file", test_seek },
         { "Write() Syscall for New file",     test_write },
         { "Read() Syscall on file",           test_read },
-        { "Malloc() & Free() tests",          test_malloc },
+        { "Kmalloc() & Kfree() tests",        test_kmalloc },
         // TODO: { "Seek() Syscall on file with data", test_seek },
     };
 
@@ -148,6 +148,12 @@ bool test_write(void) {
         return false;
     }
 
+    // Written data is only in memory until close(), fsync(), or a periodic flush
+    if (fsync(fd) != 0) {
+        printf("\r\nError: could not fsync() file %s\r\n", file);
+        return false;
+    }
+
     // TODO: Test O_APPEND
 
     close(fd);
@@ -199,37 +205,62 @@ bool test_read(void) {
     return true;
 }
 
-// Test malloc() & free() function calls
-bool test_malloc(void) {
-    void *buf;
-    void *buf2;
-    void *buf3;
-    void *buf4;
-    void *buf5;
+// Test kmalloc() & kfree(): allocations don't overlap, everything freed is given back, and
+//   freed objects are reused instead of growing the caches
+bool test_kmalloc(void) {
+    const uint32_t sizes[] = { 100, 42, 250, 6000, 333 };
+    const uint32_t count = sizeof sizes / sizeof sizes[0];
+    uint8_t *bufs[sizeof sizes / sizeof sizes[0]];
+
+    uint32_t objects_before = 0;
+    for (uint32_t i = 0; i < SLAB_SIZE_CLASSES; i++) objects_before += kmalloc_caches[i].in_use;
+    const uint32_t large_pages_before = kmalloc_large_pages;
+
+    for (uint32_t i = 0; i < count; i++) {
+        bufs[i] = kmalloc(sizes[i]);
+        if (!bufs[i]) {
+            printf("\r\nError: could not kmalloc %u bytes\r\n", sizes[i]);
+            return false;
+        }
+
+        printf("\r\nKmalloc-ed %u bytes to address %x", sizes[i], (uint32_t)bufs[i]);
+        memset(bufs[i], i+1, sizes[i]);
+    }
+
+    // Writing each buffer should not have changed any other
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < sizes[i]; j++) {
+            if (bufs[i][j] != i+1) {
+                printf("\r\nError: buffer at %x overlaps another\r\n", (uint32_t)bufs[i]);
+                return false;
+            }
+        }
+    }
 
-    buf = malloc(100);
-    printf("\r\nMalloc-ed 100 bytes to address %x\r\n", (uint32_t)buf);
-    printf("Free-ing bytes...\r\n");
-    free(buf);
+    printf("\r\nKfree-ing buffers...\r\n");
+    for (uint32_t i = 0; i < count; i++) kfree(bufs[i]);
 
-    buf2 = malloc(42);
-    printf("Malloc-ed 42 bytes to address %x\r\n", (uint32_t)buf2);
-    printf("Free-ing bytes...\r\n");
-    free(buf2);
+    uint32_t objects_after = 0;
+    for (uint32_t i = 0; i < SLAB_SIZE_CLASSES; i++) objects_after += kmalloc_caches[i].in_use;
 
-    buf3 = malloc(250);
-    printf("Malloc-ed 250 bytes to address %x\r\n", (uint32_t)buf3);
+    if (objects_after != objects_before || kmalloc_large_pages != large_pages_before) {
+        printf("Error: %u objects & %u large pages in use after kfree, %u & %u before\r\n",
+               objects_after, kmalloc_large_pages, objects_before, large_pages_before);
+        return false;
+    }
 
-    buf4 = malloc(6000);
-    printf("Malloc-ed 6000 bytes to address %x\r\n", (uint32_t)buf4);
+    // Allocating & freeing in a loop reuses the same memory
+    slab_cache_t *cache = &kmalloc_caches[2];     // 128 bytes
+    kfree(kmalloc(100));
+    const uint32_t slabs = cache->slabs;
 
-    buf5 = malloc(333);
-    printf("Malloc-ed 333 bytes to address %x\r\n", (uint32_t)buf5);
+    for (uint32_t i = 0; i < 1000; i++) kfree(kmalloc(100));
 
-    free(buf4);
-    free(buf5);
-    free(buf3);
+    if (cache->slabs != slabs) {
+        printf("Error: %s cache grew from %u to %u slabs without objects in use\r\n",
+               cache->name, slabs, cache->slabs);
+        return false;
+    }
 
     return true;
 }
-